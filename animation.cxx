@@ -0,0 +1,356 @@
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "animation.h"
+#include "ht16k33.h"
+
+// Frames go out at this rate while a brightness ramp is running
+#define ANIM_FRAME_US 50000
+// Time each stage of a digit transition is shown
+#define ANIM_TRANSITION_STEP_US 60000
+#define ANIM_SCROLL_STEP_MS 250
+#define ANIM_BLINK_STEP_MS 500
+#define ANIM_DEFAULT_DURATION_MS 3000
+// Messages waiting behind the one being shown
+#define ANIM_PENDING 4
+#define ANIM_DIGITS 4
+
+static const int digit_positions[ANIM_DIGITS] = { 0, 1, 3, 4 };
+
+struct ANIM_FRAME_T
+{
+    uint16_t segments[ANIM_POSITIONS];
+    uint8_t brightness;
+};
+
+static uint16_t base[ANIM_POSITIONS];
+// Last frame rendered, what a transition starts from
+static uint16_t shown[ANIM_POSITIONS];
+static uint16_t transition_from[ANIM_POSITIONS];
+static uint64_t transition_start_us;
+static uint64_t transition_end_us;
+
+static DISPLAY_MESSAGE_T message;
+// The message text is turned into segment patterns when it starts
+static uint16_t message_glyphs[DISPLAY_MESSAGE_MAX];
+static int message_len;
+static bool showing;
+static uint64_t message_start_us;
+static uint64_t message_end_us;
+// Highest priority first
+static DISPLAY_MESSAGE_T pending[ANIM_PENDING];
+static int pending_count;
+
+static unsigned int fade_from = 15;
+static unsigned int fade_to = 15;
+static uint64_t fade_start_us;
+static uint64_t fade_end_us;
+
+// The next frame is composed as soon as the current one is out, so when it
+// falls due it only has to be copied to the framebuffer. Any change above
+// throws it away and asks for a frame straight away.
+static ANIM_FRAME_T ahead;
+static uint64_t ahead_us;
+static uint64_t ahead_next_us;
+static bool ahead_valid;
+static uint64_t next_frame_us = UINT64_MAX;
+
+static void changed()
+{
+    ahead_valid = false;
+    next_frame_us = 0;
+}
+
+static void show_text(int first, uint16_t *segments)
+{
+    for (int k = 0; k < ANIM_DIGITS; ++k)
+    {
+        int c = first + k;
+        if (c >= 0 && c < message_len)
+        {
+            segments[digit_positions[k]] = message_glyphs[c];
+        }
+    }
+}
+
+// Returns when the message next changes
+static uint64_t compose_message(uint64_t t, uint16_t *segments)
+{
+    uint64_t step_us = message.step_ms * 1000ull;
+    uint64_t step = (t - message_start_us) / step_us;
+    uint64_t next = message_start_us + (step + 1) * step_us;
+    switch (message.effect)
+    {
+        case DISPLAY_SCROLL:
+        {
+            // Starts with the first character in the last digit and ends
+            // with the last character leaving the first
+            int shift = step % (message_len + ANIM_DIGITS);
+            show_text(shift - (ANIM_DIGITS - 1), segments);
+            break;
+        }
+        case DISPLAY_BLINK:
+            if ((step & 1) == 0)
+            {
+                show_text(0, segments);
+            }
+            break;
+        default:
+            show_text(0, segments);
+            next = message_end_us;
+            break;
+    }
+    return next < message_end_us ? next : message_end_us;
+}
+
+// Digits go from what was shown when a message started or ended to the
+// new ones, returns when the next step is due
+static uint64_t compose_transition(uint64_t t, uint16_t *segments)
+{
+    if (t >= transition_end_us)
+    {
+        return UINT64_MAX;
+    }
+    uint64_t step = (t - transition_start_us) / ANIM_TRANSITION_STEP_US;
+    for (int k = 0; k < ANIM_DIGITS; ++k)
+    {
+        int pos = digit_positions[k];
+        switch (ANIM_TRANSITION_DEFAULT)
+        {
+            case ANIM_TRANSITION_MORPH:
+                segments[pos] &= transition_from[pos];
+                break;
+            case ANIM_TRANSITION_WIPE:
+                if ((uint64_t)k > step)
+                {
+                    segments[pos] = transition_from[pos];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return transition_start_us + (step + 1) * ANIM_TRANSITION_STEP_US;
+}
+
+// Work out the frame at time t, returns when the next different one is due
+static uint64_t compose(uint64_t t, ANIM_FRAME_T *frame)
+{
+    uint64_t next;
+    if (showing && t < message_end_us)
+    {
+        memset(frame->segments, 0, sizeof(frame->segments));
+        next = compose_message(t, frame->segments);
+    }
+    else
+    {
+        memcpy(frame->segments, base, sizeof(base));
+        next = UINT64_MAX;
+    }
+    uint64_t step = compose_transition(t, frame->segments);
+    if (step < next)
+    {
+        next = step;
+    }
+
+    if (t < fade_end_us)
+    {
+        int span = (int)fade_to - (int)fade_from;
+        frame->brightness = fade_from + span * (int64_t)(t - fade_start_us) / (int64_t)(fade_end_us - fade_start_us);
+        uint64_t step = t + ANIM_FRAME_US < fade_end_us ? t + ANIM_FRAME_US : fade_end_us;
+        if (step < next)
+        {
+            next = step;
+        }
+    }
+    else
+    {
+        frame->brightness = fade_to;
+    }
+    return next;
+}
+
+static void start_transition(uint64_t now_us)
+{
+    if (ANIM_TRANSITION_DEFAULT == ANIM_TRANSITION_NONE)
+    {
+        return;
+    }
+    memcpy(transition_from, shown, sizeof(shown));
+    transition_start_us = now_us;
+    int steps = ANIM_TRANSITION_DEFAULT == ANIM_TRANSITION_WIPE ? ANIM_DIGITS - 1 : 1;
+    transition_end_us = now_us + steps * ANIM_TRANSITION_STEP_US;
+}
+
+static void start_message(const DISPLAY_MESSAGE_T *msg, uint64_t now_us)
+{
+    message = *msg;
+    message_len = ht16k33_render_string(message.text, message_glyphs, DISPLAY_MESSAGE_MAX);
+    showing = true;
+    message_start_us = now_us;
+    uint64_t length_us;
+    if (message.effect == DISPLAY_SCROLL)
+    {
+        // Whole passes only
+        uint64_t pass_us = (message_len + ANIM_DIGITS) * message.step_ms * 1000ull;
+        uint64_t passes = (message.duration_ms * 1000ull + pass_us - 1) / pass_us;
+        length_us = (passes > 0 ? passes : 1) * pass_us;
+    }
+    else
+    {
+        length_us = message.duration_ms * 1000ull;
+    }
+    message_end_us = now_us + length_us;
+    start_transition(now_us);
+    changed();
+}
+
+// Once the message showing is over the next one waiting starts, so nothing
+// waiting ever ranks above the message showing
+static void end_message(uint64_t now_us)
+{
+    if (!showing || now_us < message_end_us)
+    {
+        return;
+    }
+    showing = false;
+    if (pending_count > 0)
+    {
+        DISPLAY_MESSAGE_T m = pending[0];
+        --pending_count;
+        memmove(pending, pending + 1, pending_count * sizeof(pending[0]));
+        start_message(&m, now_us);
+    }
+    else
+    {
+        start_transition(now_us);
+        changed();
+    }
+}
+
+static bool insert_pending(const DISPLAY_MESSAGE_T *msg)
+{
+    if (pending_count == ANIM_PENDING)
+    {
+        if (pending[ANIM_PENDING - 1].priority >= msg->priority)
+        {
+            return false;
+        }
+        --pending_count;
+    }
+    int i = pending_count;
+    while (i > 0 && pending[i - 1].priority < msg->priority)
+    {
+        pending[i] = pending[i - 1];
+        --i;
+    }
+    pending[i] = *msg;
+    ++pending_count;
+    return true;
+}
+
+// The message showing ranks at least as high as any waiting, so when it is
+// cut in on it goes back at the front. If the queue is full the last entry,
+// the lowest ranked, makes room.
+static void requeue_interrupted(const DISPLAY_MESSAGE_T *msg)
+{
+    if (pending_count == ANIM_PENDING)
+    {
+        --pending_count;
+    }
+    memmove(pending + 1, pending, pending_count * sizeof(pending[0]));
+    pending[0] = *msg;
+    ++pending_count;
+}
+
+void anim_set_base(const uint16_t *frame, uint64_t now_us)
+{
+    if (memcmp(base, frame, sizeof(base)) == 0)
+    {
+        return;
+    }
+    memcpy(base, frame, sizeof(base));
+    // The time cuts over at once so every change lands on the second edge.
+    // A transition left from a message ending would hold the new digits back.
+    if (!showing || now_us >= message_end_us)
+    {
+        transition_end_us = now_us;
+    }
+    changed();
+}
+
+bool anim_add_message(const DISPLAY_MESSAGE_T *msg, uint64_t now_us)
+{
+    DISPLAY_MESSAGE_T m = *msg;
+    m.text[DISPLAY_MESSAGE_MAX - 1] = '\0';
+    if (m.step_ms == 0)
+    {
+        m.step_ms = m.effect == DISPLAY_SCROLL ? ANIM_SCROLL_STEP_MS : ANIM_BLINK_STEP_MS;
+    }
+    if (m.duration_ms == 0 && m.effect != DISPLAY_SCROLL)
+    {
+        m.duration_ms = ANIM_DEFAULT_DURATION_MS;
+    }
+
+    end_message(now_us);
+    if (showing)
+    {
+        if (m.priority <= message.priority)
+        {
+            return insert_pending(&m);
+        }
+        requeue_interrupted(&message);
+    }
+    start_message(&m, now_us);
+    return true;
+}
+
+void anim_fade_to(unsigned int level, uint32_t duration_ms, uint64_t now_us)
+{
+    ANIM_FRAME_T frame;
+    compose(now_us, &frame);
+    fade_from = frame.brightness;
+    fade_to = level <= 15 ? level : 15;
+    fade_start_us = now_us;
+    fade_end_us = now_us + duration_ms * 1000ull;
+    changed();
+}
+
+uint64_t anim_next_frame_us()
+{
+    return next_frame_us;
+}
+
+void anim_render(HT16K33_T *display, uint64_t now_us)
+{
+    end_message(now_us);
+
+    ANIM_FRAME_T frame;
+    uint64_t next;
+    if (ahead_valid && now_us >= ahead_us && now_us < ahead_next_us)
+    {
+        frame = ahead;
+        next = ahead_next_us;
+    }
+    else
+    {
+        next = compose(now_us, &frame);
+    }
+
+    for (int pos = 0; pos < ANIM_POSITIONS; ++pos)
+    {
+        ht16k33_display_set(display, pos, frame.segments[pos]);
+    }
+    memcpy(shown, frame.segments, sizeof(shown));
+    // Every display dims together
+    ht16k33_set_brightness_all(frame.brightness);
+
+    next_frame_us = next;
+    ahead_valid = next != UINT64_MAX;
+    if (ahead_valid)
+    {
+        ahead_us = next;
+        ahead_next_us = compose(next, &ahead);
+    }
+}
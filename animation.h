@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include "display.h"
+#include "ht16k33.h"
+
+// Frame composer for the display, run on core 1 only. The time (or the busy
+// pattern) is the base frame, messages are shown over it and brightness
+// ramps apply to whatever is showing. Nothing here blocks, the display loop
+// asks when the next frame is due and renders it then.
+
+// Digit positions 0, 1, 3 and 4 with the colon at 2
+#define ANIM_POSITIONS 5
+#define ANIM_COLON_POSITION 2
+
+enum ANIM_TRANSITION
+{
+    ANIM_TRANSITION_NONE,
+    // Segments the old and new digits do not share go off, then the new
+    // ones come on
+    ANIM_TRANSITION_MORPH,
+    // Digits change one at a time from left to right
+    ANIM_TRANSITION_WIPE,
+};
+
+// Effect used when a message starts or ends
+#ifndef ANIM_TRANSITION_DEFAULT
+#define ANIM_TRANSITION_DEFAULT ANIM_TRANSITION_MORPH
+#endif
+
+// Set a new base frame, shown from now on with no transition so the time
+// changes on the second edge
+extern void anim_set_base(const uint16_t *frame, uint64_t now_us);
+
+// False if too many messages are waiting and this one ranks lowest
+extern bool anim_add_message(const DISPLAY_MESSAGE_T *msg, uint64_t now_us);
+
+extern void anim_fade_to(unsigned int level, uint32_t duration_ms, uint64_t now_us);
+
+// When the next frame is due, UINT64_MAX if nothing is moving
+extern uint64_t anim_next_frame_us();
+
+// Put the frame for now in the display's framebuffer, the caller commits it
+extern void anim_render(HT16K33_T *display, uint64_t now_us);
@@ -0,0 +1,126 @@
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+
+#include "boot_timeline.h"
+
+// A time is written once and then its flag is set, so the other core only
+// reads it once it is whole
+struct BOOT_MARK_T
+{
+    uint64_t begin_us;
+    uint64_t end_us;
+    volatile bool begun;
+    volatile bool ended;
+};
+
+#define BOOT_MAX_NAME 12
+// Widest the parts of the JSON can be, the text around the list and each
+// phase with both times at their widest
+#define BOOT_JSON_FIXED 96
+#define BOOT_JSON_PER_PHASE (BOOT_MAX_NAME + 48)
+
+static_assert(BOOT_JSON_FIXED + BOOT_PHASES * BOOT_JSON_PER_PHASE <= BOOT_JSON_MAX, "BOOT_JSON_MAX is too small");
+
+static const char phase_names[BOOT_PHASES][BOOT_MAX_NAME + 1] = {
+    "stdio", "display", "wifi_init", "prefs", "wifi_connect", "httpd", "dns", "ntp", "first_time",
+};
+
+// Each phase is marked from one core, so each entry has a single writer
+static BOOT_MARK_T marks[BOOT_PHASES];
+static bool printed;
+
+void boot_begin(BOOT_PHASE phase)
+{
+    BOOT_MARK_T *m = &marks[phase];
+    if (!m->begun)
+    {
+        m->begin_us = time_us_64();
+        __dmb();
+        m->begun = true;
+    }
+}
+
+void boot_end(BOOT_PHASE phase)
+{
+    boot_end_at(phase, time_us_64());
+}
+
+void boot_end_at(BOOT_PHASE phase, uint64_t end_us)
+{
+    BOOT_MARK_T *m = &marks[phase];
+    if (!m->ended)
+    {
+        m->end_us = end_us;
+        __dmb();
+        m->ended = true;
+    }
+}
+
+// Zero until set
+static uint64_t begin_of(int i)
+{
+    if (!marks[i].begun)
+    {
+        return 0;
+    }
+    __dmb();
+    return marks[i].begin_us;
+}
+
+static uint64_t end_of(int i)
+{
+    if (!marks[i].ended)
+    {
+        return 0;
+    }
+    __dmb();
+    return marks[i].end_us;
+}
+
+static bool complete()
+{
+    for (int i = 0; i < BOOT_PHASES; ++i)
+    {
+        if (!marks[i].ended)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int boot_get_json(char *buf, size_t len)
+{
+    size_t off = snprintf(buf, len, "{\"watchdog_reboot\":%s,\"cols\":[\"phase\",\"begin_us\",\"end_us\"],\"phases\":[",
+        watchdog_caused_reboot() ? "true" : "false");
+    for (int i = 0; i < BOOT_PHASES && off < len; ++i)
+    {
+        off += snprintf(buf + off, len - off, "%s[\"%s\",%llu,%llu]", i > 0 ? "," : "", phase_names[i],
+            (unsigned long long)begin_of(i), (unsigned long long)end_of(i));
+    }
+    if (off < len)
+    {
+        off += snprintf(buf + off, len - off, "]}\n");
+    }
+    return off < len ? (int)off : -1;
+}
+
+void boot_print_once()
+{
+    if (printed || !complete())
+    {
+        return;
+    }
+    printed = true;
+    printf("boot timeline, ms from reset\n");
+    for (int i = 0; i < BOOT_PHASES; ++i)
+    {
+        uint64_t begin = begin_of(i);
+        uint64_t end = end_of(i);
+        printf("  %-12s %8.1f %8.1f %8.1f\n", phase_names[i], begin / 1000.0, end / 1000.0,
+            begin != 0 ? (end - begin) / 1000.0 : 0.0);
+    }
+}
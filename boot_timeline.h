@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Where the time goes from reset to the first correct time on the display.
+// Each startup phase notes when it began and ended, by time_us_64() which
+// counts from reset. Only the first begin and end of a phase are kept, so
+// the marks can sit in code that runs again later, such as a reconnect.
+
+enum BOOT_PHASE
+{
+    BOOT_STDIO,
+    // Until the first frame is on the display
+    BOOT_DISPLAY,
+    BOOT_WIFI_INIT,
+    BOOT_PREFS,
+    BOOT_WIFI_CONNECT,
+    BOOT_HTTPD,
+    BOOT_DNS,
+    BOOT_NTP,
+    // Until the display shows synchronised time
+    BOOT_FIRST_TIME,
+    BOOT_PHASES
+};
+
+// Safe from either core and from lwIP callbacks
+extern void boot_begin(BOOT_PHASE phase);
+extern void boot_end(BOOT_PHASE phase);
+// For a phase whose end is only seen after it happened, end_us is the
+// time_us_64() it really ended
+extern void boot_end_at(BOOT_PHASE phase, uint64_t end_us);
+
+// The timeline as JSON, returns the length or -1 if it does not fit. A
+// buffer of BOOT_JSON_MAX always fits.
+#define BOOT_JSON_MAX 768
+extern int boot_get_json(char *buf, size_t len);
+
+// Print the timeline once every phase has ended, call now and again
+extern void boot_print_once();
@@ -0,0 +1,529 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "clock.h"
+#include "preferences.h"
+#include "tempco.h"
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "hardware/sync.h"
+#include "hardware/watchdog.h"
+
+// Offsets bigger than this are stepped, smaller ones are slewed
+#define CLOCK_STEP_THRESHOLD_US 128000
+// Maximum rate at which a phase error is slewed out
+#define CLOCK_SLEW_PPM 500
+// Crystal frequency error is clamped to this
+#define CLOCK_MAX_FREQ_PPB 500000
+// Poll interval is 2^poll seconds
+#define CLOCK_MIN_POLL 4
+#define CLOCK_MAX_POLL 12
+// Offsets below this count towards lengthening the poll interval
+#define CLOCK_GOOD_OFFSET_US 10000
+// How many good samples in a row before the poll interval is doubled
+#define CLOCK_POLL_HYSTERESIS 4
+// Frequency is measured over a baseline of between a half and a whole window
+#define CLOCK_FREQ_MIN_BASELINE_US (60 * 1000000LL)
+#define CLOCK_FREQ_WINDOW_US (4 * 3600 * 1000000LL)
+// Keep the reference point recent enough that the arithmetic cannot overflow
+#define CLOCK_REBASE_US (3600 * 1000000LL)
+// Starting guess at the network jitter before any samples
+#define CLOCK_INITIAL_JITTER_US 2000
+// How much a saved frequency is trusted less per day of age
+#define CLOCK_AGING_PPB_PER_DAY 100
+// The frequency is only saved to flash once it is known this well, at most
+// once a day unless it has moved by more than the uncertainty
+#define CLOCK_DRIFT_SAVE_UNCERTAINTY_PPB 1000
+#define CLOCK_DRIFT_SAVE_INTERVAL_S (24 * 3600)
+#define CLOCK_DRIFT_RESAVE_INTERVAL_S (3600)
+// Frequency samples for temperature compensation span at least this so
+// network jitter does not swamp them
+#define CLOCK_TEMPCO_MIN_INTERVAL_US (256 * 1000000LL)
+
+#define CLOCK_PERSIST_MAGIC 0xc10c5afe
+
+struct CLOCK_ANCHOR_T
+{
+    bool valid;
+    uint64_t local_us;
+    int64_t utc_us;
+};
+
+struct CLOCK_SEED_T
+{
+    bool valid;
+    int32_t freq_ppb;
+    int32_t uncertainty_ppb;
+    int64_t time;
+};
+
+// Everything needed to turn local time into UTC
+struct CLOCK_TIMEBASE_T
+{
+    uint64_t ref_local_us;
+    int64_t ref_utc_us;
+    // Fraction of a microsecond carried over at the reference point, in ppb us
+    int64_t ref_rem;
+    int64_t slew_us;
+    int32_t freq_ppb;
+    // Temperature feed forward, on top of the measured average frequency
+    int32_t comp_ppb;
+};
+
+struct CLOCK_T
+{
+    bool synced;
+    // Carried over a reboot, the reset delay is only a guess so the first
+    // sample steps the clock however small the offset
+    bool restored;
+    CLOCK_TIMEBASE_T tb;
+    int32_t freq_uncertainty_ppb;
+    int64_t jitter_us;
+    int poll;
+    int poll_count;
+    int64_t last_offset_us;
+    CLOCK_ANCHOR_T anchor;
+    CLOCK_ANCHOR_T next_anchor;
+    // Local times the frequency estimate was last measured between
+    uint64_t freq_from_us;
+    uint64_t freq_to_us;
+    CLOCK_SEED_T seed;
+    CLOCK_ANCHOR_T last_sample;
+};
+
+// Kept in RAM that is not cleared at startup so the time survives a watchdog reboot
+struct CLOCK_PERSIST_T
+{
+    int64_t utc_us;
+    uint32_t magic;
+    // Time from when this was written until the reboot is expected
+    uint32_t reset_delay_us;
+    int32_t freq_ppb;
+    uint32_t checksum;
+};
+
+static CLOCK_T clk;
+// Writers hold cs, the timebase they leave is published under a sequence
+// count so readers on either core never wait on the lock
+static critical_section cs;
+static CLOCK_TIMEBASE_T published;
+static volatile uint32_t published_seq;
+static CLOCK_PERSIST_T __uninitialized_ram(persisted);
+
+// Must be called with cs held
+static void publish()
+{
+    published_seq = published_seq + 1;
+    __dmb();
+    published = clk.tb;
+    __dmb();
+    published_seq = published_seq + 1;
+}
+
+static uint32_t persist_checksum(const CLOCK_PERSIST_T *p)
+{
+    const uint32_t *words = (const uint32_t *)p;
+    uint32_t sum = 2166136261u;
+    for (size_t i = 0; i < offsetof(CLOCK_PERSIST_T, checksum) / sizeof(uint32_t); ++i)
+    {
+        sum = (sum ^ words[i]) * 16777619u;
+    }
+    return sum;
+}
+
+void clock_init()
+{
+    critical_section_init(&cs);
+    clk.poll = CLOCK_MIN_POLL;
+    clk.freq_uncertainty_ppb = CLOCK_MAX_FREQ_PPB;
+    clk.jitter_us = CLOCK_INITIAL_JITTER_US;
+
+    // time_us_64() restarts from zero at the reboot
+    if (watchdog_caused_reboot() && persisted.magic == CLOCK_PERSIST_MAGIC && persisted.checksum == persist_checksum(&persisted))
+    {
+        uint64_t now = time_us_64();
+        clk.tb.ref_local_us = now;
+        clk.tb.ref_utc_us = persisted.utc_us + persisted.reset_delay_us + (int64_t)now;
+        clk.tb.freq_ppb = persisted.freq_ppb;
+        clk.synced = true;
+        clk.restored = true;
+        printf("clock restored after reboot, reset delay %lu ms, freq %ld ppb\n",
+            (unsigned long)(persisted.reset_delay_us / 1000), (long)clk.tb.freq_ppb);
+    }
+    persisted.magic = 0;
+    publish();
+}
+
+bool clock_is_synced()
+{
+    return clk.synced;
+}
+
+// How much of the outstanding slew has been applied after elapsed_us
+static int64_t slew_applied(const CLOCK_TIMEBASE_T *tb, int64_t elapsed_us)
+{
+    if (elapsed_us <= 0)
+    {
+        return 0;
+    }
+    int64_t max_slew = elapsed_us * CLOCK_SLEW_PPM / 1000000;
+    if (tb->slew_us > max_slew)
+    {
+        return max_slew;
+    }
+    if (tb->slew_us < -max_slew)
+    {
+        return -max_slew;
+    }
+    return tb->slew_us;
+}
+
+// The frequency correction over elapsed_us, rounded down with what is left
+// over going in rem so that rebasing does not lose it
+static int64_t rate_correction(const CLOCK_TIMEBASE_T *tb, int64_t elapsed_us, int64_t *rem)
+{
+    int64_t scaled = elapsed_us * (tb->freq_ppb + tb->comp_ppb) + tb->ref_rem;
+    int64_t us = scaled / 1000000000;
+    if (scaled % 1000000000 < 0)
+    {
+        --us;
+    }
+    *rem = scaled - us * 1000000000;
+    return us;
+}
+
+static int64_t utc_at(const CLOCK_TIMEBASE_T *tb, uint64_t local_us)
+{
+    int64_t elapsed = (int64_t)(local_us - tb->ref_local_us);
+    int64_t rem;
+    return tb->ref_utc_us + elapsed + rate_correction(tb, elapsed, &rem) + slew_applied(tb, elapsed);
+}
+
+// Move the reference point to local_us, folding in any slew applied so far
+static void rebase(uint64_t local_us)
+{
+    int64_t elapsed = (int64_t)(local_us - clk.tb.ref_local_us);
+    if (elapsed <= 0)
+    {
+        return;
+    }
+    int64_t rem;
+    clk.tb.ref_utc_us += elapsed + rate_correction(&clk.tb, elapsed, &rem) + slew_applied(&clk.tb, elapsed);
+    clk.tb.ref_rem = rem;
+    clk.tb.slew_us -= slew_applied(&clk.tb, elapsed);
+    clk.tb.ref_local_us = local_us;
+}
+
+int64_t clock_local_to_utc_us(uint64_t local_us)
+{
+    CLOCK_TIMEBASE_T tb;
+    uint32_t seq;
+    do
+    {
+        while ((seq = published_seq) & 1)
+        {
+            tight_loop_contents();
+        }
+        __dmb();
+        tb = published;
+        __dmb();
+    } while (seq != published_seq);
+    return utc_at(&tb, local_us);
+}
+
+void clock_persist(uint32_t reset_delay_us)
+{
+    // Readers never rebase, so keep the reference point recent from here
+    uint64_t now = time_us_64();
+    if ((int64_t)(now - clk.tb.ref_local_us) > CLOCK_REBASE_US)
+    {
+        critical_section_enter_blocking(&cs);
+        rebase(now);
+        publish();
+        critical_section_exit(&cs);
+    }
+
+    if (!clk.synced)
+    {
+        persisted.magic = 0;
+        return;
+    }
+    persisted.utc_us = clock_get_utc_us();
+    persisted.reset_delay_us = reset_delay_us;
+    persisted.freq_ppb = clk.tb.freq_ppb;
+    persisted.magic = CLOCK_PERSIST_MAGIC;
+    persisted.checksum = persist_checksum(&persisted);
+}
+
+uint64_t clock_utc_to_local_us(int64_t utc_us)
+{
+    // The rate is within a fraction of a percent of one so a couple of
+    // rounds of correction are plenty
+    uint64_t local_us = time_us_64();
+    for (int i = 0; i < 2; ++i)
+    {
+        local_us += utc_us - clock_local_to_utc_us(local_us);
+    }
+    return local_us;
+}
+
+int64_t clock_get_utc_us()
+{
+    return clock_local_to_utc_us(time_us_64());
+}
+
+time_t clock_get_time()
+{
+    return (time_t)(clock_get_utc_us() / 1000000);
+}
+
+static void set_anchor(CLOCK_ANCHOR_T *anchor, uint64_t local_us, int64_t utc_us)
+{
+    anchor->valid = true;
+    anchor->local_us = local_us;
+    anchor->utc_us = utc_us;
+}
+
+// Blend a measured frequency with the one saved from an earlier run, by
+// inverse variance, for as long as the saved one is the better of the two.
+// A saved value that disagrees with the measurement is dropped.
+static int64_t apply_seed(int64_t freq, int64_t *uncertainty, int64_t true_utc_us)
+{
+    double age_days = (true_utc_us / 1000000 - clk.seed.time) / 86400.0;
+    double seed_unc = clk.seed.uncertainty_ppb + (age_days > 0 ? age_days * CLOCK_AGING_PPB_PER_DAY : 0);
+    double meas_unc = (double)*uncertainty;
+    if (fabs((double)(freq - clk.seed.freq_ppb)) > 3 * (seed_unc + meas_unc))
+    {
+        printf("saved frequency %ld ppb disagrees with %lld ppb\n", (long)clk.seed.freq_ppb, (long long)freq);
+        clk.seed.valid = false;
+        return freq;
+    }
+    if (seed_unc >= meas_unc)
+    {
+        clk.seed.valid = false;
+        return freq;
+    }
+    double ws = 1 / (seed_unc * seed_unc);
+    double wm = 1 / (meas_unc * meas_unc);
+    *uncertainty = (int64_t)(1 / sqrt(ws + wm));
+    return (int64_t)((clk.seed.freq_ppb * ws + freq * wm) / (ws + wm));
+}
+
+// Estimate the crystal frequency error from the raw (local, true utc) pairs. The
+// baseline is kept between half and a whole window so the estimate tracks slow
+// drift but is not swamped by the network jitter of individual samples.
+static void update_frequency(uint64_t local_us, int64_t true_utc_us)
+{
+    if (!clk.anchor.valid)
+    {
+        set_anchor(&clk.anchor, local_us, true_utc_us);
+        return;
+    }
+
+    int64_t baseline = (int64_t)(local_us - clk.anchor.local_us);
+    if (baseline >= CLOCK_FREQ_MIN_BASELINE_US)
+    {
+        int64_t drift = (true_utc_us - clk.anchor.utc_us) - baseline;
+        int64_t freq = drift * 1000000 / (baseline / 1000);
+        // Each end of the baseline is out by about the jitter
+        int64_t uncertainty = 2 * clk.jitter_us * 1000000 / (baseline / 1000);
+        if (clk.seed.valid)
+        {
+            freq = apply_seed(freq, &uncertainty, true_utc_us);
+        }
+        if (freq > CLOCK_MAX_FREQ_PPB)
+        {
+            freq = CLOCK_MAX_FREQ_PPB;
+        }
+        else if (freq < -CLOCK_MAX_FREQ_PPB)
+        {
+            freq = -CLOCK_MAX_FREQ_PPB;
+        }
+        clk.tb.freq_ppb = (int32_t)freq;
+        clk.freq_from_us = clk.anchor.local_us;
+        clk.freq_to_us = local_us;
+        clk.freq_uncertainty_ppb = (int32_t)(uncertainty < CLOCK_MAX_FREQ_PPB ? uncertainty : CLOCK_MAX_FREQ_PPB);
+    }
+
+    if (baseline >= CLOCK_FREQ_WINDOW_US && clk.next_anchor.valid)
+    {
+        clk.anchor = clk.next_anchor;
+        clk.next_anchor.valid = false;
+    }
+    else if (baseline >= CLOCK_FREQ_WINDOW_US / 2 && !clk.next_anchor.valid)
+    {
+        set_anchor(&clk.next_anchor, local_us, true_utc_us);
+    }
+}
+
+// The frequency over just the time since the last sample, for fitting against temperature
+static void update_interval_frequency(uint64_t local_us, int64_t true_utc_us)
+{
+    if (clk.last_sample.valid)
+    {
+        int64_t interval = (int64_t)(local_us - clk.last_sample.local_us);
+        if (interval < CLOCK_TEMPCO_MIN_INTERVAL_US)
+        {
+            return;
+        }
+        int64_t drift = (true_utc_us - clk.last_sample.utc_us) - interval;
+        tempco_add_frequency((int32_t)(drift * 1000000 / (interval / 1000)), interval);
+    }
+    set_anchor(&clk.last_sample, local_us, true_utc_us);
+}
+
+static void step(uint64_t local_us, int64_t true_utc_us)
+{
+    clk.tb.ref_local_us = local_us;
+    clk.tb.ref_utc_us = true_utc_us;
+    clk.tb.ref_rem = 0;
+    clk.tb.slew_us = 0;
+    clk.poll = CLOCK_MIN_POLL;
+    clk.poll_count = 0;
+    clk.anchor.valid = false;
+    clk.next_anchor.valid = false;
+}
+
+void clock_update(int64_t offset_us, int64_t delay_us, uint64_t local_us)
+{
+    critical_section_enter_blocking(&cs);
+    int64_t true_utc = utc_at(&clk.tb, local_us) + offset_us;
+    clk.last_offset_us = offset_us;
+    if (!clk.synced || clk.restored || llabs(offset_us) > CLOCK_STEP_THRESHOLD_US)
+    {
+        // Stepping loses the frequency anchors but keeps the estimate itself
+        step(local_us, true_utc);
+        update_frequency(local_us, true_utc);
+        clk.synced = true;
+        clk.restored = false;
+        publish();
+        critical_section_exit(&cs);
+        printf("clock stepped by %lld us\n", (long long)offset_us);
+        return;
+    }
+
+    rebase(local_us);
+    clk.jitter_us += (llabs(offset_us) - clk.jitter_us) / 8;
+    update_frequency(local_us, true_utc);
+    update_interval_frequency(local_us, true_utc);
+    // The new measurement supersedes whatever slew was still outstanding
+    clk.tb.slew_us = offset_us;
+
+    if (llabs(offset_us) <= CLOCK_GOOD_OFFSET_US)
+    {
+        if (++clk.poll_count >= CLOCK_POLL_HYSTERESIS)
+        {
+            if (clk.poll < CLOCK_MAX_POLL)
+            {
+                ++clk.poll;
+            }
+            clk.poll_count = 0;
+        }
+    }
+    else
+    {
+        // A disturbance: back off harder the worse it is
+        clk.poll -= llabs(offset_us) > 4 * CLOCK_GOOD_OFFSET_US ? 2 : 1;
+        if (clk.poll < CLOCK_MIN_POLL)
+        {
+            clk.poll = CLOCK_MIN_POLL;
+        }
+        clk.poll_count = 0;
+    }
+    publish();
+    critical_section_exit(&cs);
+    printf("clock offset %lld us delay %lld us freq %ld ppb poll %d\n", (long long)offset_us, (long long)delay_us, (long)clk.tb.freq_ppb, clk.poll);
+}
+
+uint32_t clock_get_poll_interval_ms()
+{
+    return (1u << clk.poll) * 1000;
+}
+
+int clock_get_poll_exponent()
+{
+    return clk.poll;
+}
+
+int32_t clock_get_frequency_ppb()
+{
+    return clk.tb.freq_ppb;
+}
+
+bool clock_get_frequency_window(uint32_t *age_s, uint32_t *length_s)
+{
+    critical_section_enter_blocking(&cs);
+    uint64_t from = clk.freq_from_us;
+    uint64_t to = clk.freq_to_us;
+    critical_section_exit(&cs);
+    if (to == 0)
+    {
+        return false;
+    }
+    *age_s = (uint32_t)((time_us_64() - from) / 1000000);
+    *length_s = (uint32_t)((to - from) / 1000000);
+    return true;
+}
+
+void clock_set_compensation_ppb(int32_t comp_ppb)
+{
+    critical_section_enter_blocking(&cs);
+    rebase(time_us_64());
+    clk.tb.comp_ppb = comp_ppb;
+    publish();
+    critical_section_exit(&cs);
+}
+
+int32_t clock_get_frequency_uncertainty_ppb()
+{
+    return clk.freq_uncertainty_ppb;
+}
+
+void clock_seed_frequency(int32_t freq_ppb, int32_t uncertainty_ppb, int64_t time)
+{
+    critical_section_enter_blocking(&cs);
+    clk.seed.valid = true;
+    clk.seed.freq_ppb = freq_ppb;
+    clk.seed.uncertainty_ppb = uncertainty_ppb;
+    clk.seed.time = time;
+    // A frequency carried over a reboot is more recent than the saved one
+    if (!clk.synced)
+    {
+        clk.tb.freq_ppb = freq_ppb;
+        clk.freq_uncertainty_ppb = uncertainty_ppb;
+    }
+    publish();
+    critical_section_exit(&cs);
+    printf("clock seeded with %ld +/- %ld ppb\n", (long)freq_ppb, (long)uncertainty_ppb);
+}
+
+// Flash has limited endurance so only write when there is something worth keeping
+void clock_save_drift()
+{
+    if (!clk.synced || clk.seed.valid || clk.freq_uncertainty_ppb > CLOCK_DRIFT_SAVE_UNCERTAINTY_PPB)
+    {
+        return;
+    }
+    int64_t now = clock_get_time();
+    bool have_saved = prefs_drift_valid();
+    int64_t age = now - prefs.freq_time;
+    if (have_saved)
+    {
+        bool moved = labs(prefs.freq_ppb - clk.tb.freq_ppb) > clk.freq_uncertainty_ppb + prefs.freq_uncertainty_ppb;
+        if (age < CLOCK_DRIFT_SAVE_INTERVAL_S && !(moved && age >= CLOCK_DRIFT_RESAVE_INTERVAL_S))
+        {
+            return;
+        }
+    }
+    prefs.freq_ppb = clk.tb.freq_ppb;
+    prefs.freq_uncertainty_ppb = clk.freq_uncertainty_ppb;
+    prefs.freq_time = now;
+    printf("saving frequency %ld +/- %ld ppb\n", (long)clk.tb.freq_ppb, (long)clk.freq_uncertainty_ppb);
+    prefs_save();
+}
+
+int64_t clock_get_last_offset_us()
+{
+    return clk.last_offset_us;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Disciplined timebase built on time_us_64(). NTP samples are fed in with
+// clock_update() and steer the phase (by slewing) and the frequency of the
+// clock rather than stepping it, except for large errors.
+
+extern void clock_init();
+extern bool clock_is_synced();
+
+// UTC in microseconds since 1970 for a given time_us_64() value, or now
+extern int64_t clock_local_to_utc_us(uint64_t local_us);
+extern int64_t clock_get_utc_us();
+// The time_us_64() value at which the clock will read utc_us
+extern uint64_t clock_utc_to_local_us(int64_t utc_us);
+extern time_t clock_get_time();
+
+// offset_us is (true time - our time) measured at local time local_us
+extern void clock_update(int64_t offset_us, int64_t delay_us, uint64_t local_us);
+
+// Start from a frequency error learnt on an earlier run, measured at time.
+// It is checked against the first samples and dropped if it disagrees.
+extern void clock_seed_frequency(int32_t freq_ppb, int32_t uncertainty_ppb, int64_t time);
+// Feed forward correction on top of the measured frequency, for temperature
+extern void clock_set_compensation_ppb(int32_t comp_ppb);
+// Write the frequency error to flash if it is good and has not been saved lately
+extern void clock_save_drift();
+
+// Save the time so it survives a watchdog reboot expected reset_delay_us from
+// now. The time is shown again straight after the reboot and the first NTP
+// sample steps it, so an early or late reset is only briefly wrong.
+extern void clock_persist(uint32_t reset_delay_us);
+
+extern uint32_t clock_get_poll_interval_ms();
+extern int clock_get_poll_exponent();
+extern int32_t clock_get_frequency_ppb();
+// When the baseline the frequency estimate was measured over started, as
+// seconds ago, and how long it was. False if there is no measured estimate.
+extern bool clock_get_frequency_window(uint32_t *age_s, uint32_t *length_s);
+extern int32_t clock_get_frequency_uncertainty_ppb();
+extern int64_t clock_get_last_offset_us();
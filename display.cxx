@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+#include "animation.h"
+#include "boot_timeline.h"
+#include "clock.h"
+#include "display.h"
+#include "health.h"
+#include "ht16k33.h"
+#include "i2c_async.h"
+#include "localtime.h"
+#include "power.h"
+#include "spsc_queue.h"
+#include "tempco.h"
+#include "wifi_details.h"
+
+// Core 1 wakes this long before a second edge and then waits for it, which
+// covers the wake up latency
+#define DISPLAY_LEAD_US 2000
+#define DISPLAY_BUSY_STEPS 6
+// The display dims to this at night, ramping over the fade time
+#define DISPLAY_NIGHT_BRIGHTNESS 0
+#define DISPLAY_NIGHT_FADE_MS 2000
+// The loop beats at least once a second, this allows for a slow I2C bus
+#define DISPLAY_HEALTH_DEADLINE_MS 2000
+// How often core 1 looks for the bus to be released while it is held
+#define DISPLAY_HOLD_POLL_US 100
+
+// Address of a second backpack showing the day and month, 0 if there is
+// none. Set in wifi_details.h.
+#ifndef DISPLAY_DATE_ADDR
+#define DISPLAY_DATE_ADDR 0
+#endif
+
+// How one update went, passed back to core 0 for the stats
+struct DISPLAY_REPORT_T
+{
+    int32_t phase_us;
+    uint32_t write_us;
+};
+
+struct DISPLAY_FADE_T
+{
+    uint8_t level;
+    uint32_t fade_ms;
+};
+
+static SPSC_QUEUE_T<uint8_t, 4> mode_queue;
+static SPSC_QUEUE_T<DISPLAY_MESSAGE_T, 4> message_queue;
+static SPSC_QUEUE_T<DISPLAY_FADE_T, 4> fade_queue;
+static SPSC_QUEUE_T<DISPLAY_REPORT_T, 16> report_queue;
+
+// Only touched on core 1
+static uint8_t day_brightness = 6;
+static HT16K33_T *time_display;
+static HT16K33_T *date_display;
+
+// Set on core 0 before core 1 starts
+static int display_beat = -1;
+
+// Core 0 sets bus_hold to a new request number to have the bus held and to
+// zero to release it. Core 1 answers in bus_held with the number once the
+// bus is quiet, so an answer left over from an earlier hold never counts.
+static volatile uint32_t bus_hold;
+static volatile uint32_t bus_held;
+static uint32_t hold_count;
+
+// Only touched on core 0
+static uint32_t phase_count;
+static int64_t phase_sum_us;
+static uint32_t phase_max_us;
+static uint32_t last_write_us;
+static HT16K33_STATS_T last_i2c_stats;
+static uint64_t last_stats_us;
+
+static void show_time(time_t t, bool dots, uint16_t *frame, int *brightness)
+{
+    struct tm tmbuf;
+    char dbuf[6];
+    char date[6];
+    if (localtime_get_time_at(t, &tmbuf))
+    {
+        snprintf(dbuf, sizeof(dbuf), "%2d %02d", tmbuf.tm_hour, tmbuf.tm_min);
+        // Both are under 100, the % 100 lets the compiler see that they fit
+        snprintf(date, sizeof(date), "%2u %02u", (unsigned)tmbuf.tm_mday % 100, (unsigned)(tmbuf.tm_mon + 1) % 100);
+    }
+    else
+    {
+        strcpy(dbuf, "-- --");
+        strcpy(date, "-- --");
+    }
+    if (date_display != nullptr)
+    {
+        ht16k33_display_string(date_display, date);
+    }
+    if (tmbuf.tm_hour < 8 || tmbuf.tm_hour >= 20)
+    {
+        *brightness = DISPLAY_NIGHT_BRIGHTNESS;
+    }
+    else
+    {
+        *brightness = day_brightness;
+    }
+
+    for (int pos = 0; pos < ANIM_POSITIONS; ++pos)
+    {
+        frame[pos] = ht16k33_char_pattern(dbuf[pos]);
+    }
+    frame[ANIM_COLON_POSITION] = dots ? 0xff : 0;
+}
+
+// step must be 0 to 6
+static void show_busy(int step, uint16_t *frame)
+{
+    uint16_t pattern = 1 << step;
+    for (int pos = 0; pos < ANIM_POSITIONS; ++pos)
+    {
+        frame[pos] = pos == ANIM_COLON_POSITION ? 0 : pattern;
+    }
+}
+
+static void display_core_main()
+{
+    // Lets core 0 park us while it writes flash
+    multicore_lockout_victim_init();
+    // The I2C interrupt is taken on the core that sets it up
+    boot_begin(BOOT_DISPLAY);
+    ht16k33_init();
+    time_display = ht16k33_add(HT16K33_BASE_ADDR);
+    if (DISPLAY_DATE_ADDR != 0)
+    {
+        date_display = ht16k33_add(DISPLAY_DATE_ADDR);
+    }
+    anim_fade_to(day_brightness, 0, time_us_64());
+
+    DISPLAY_MODE mode = DISPLAY_WAITING;
+    int busy_step = 0;
+    int brightness = day_brightness;
+    // Smoothed time from starting a frame to it reaching the display, frames
+    // are centred on the edge
+    uint32_t write_us = 1000;
+    bool sent = false;
+    uint64_t start = 0;
+    uint64_t edge_local = 0;
+    uint32_t clock_generation = power_get_clock_generation();
+    for (;;)
+    {
+        health_beat(display_beat);
+
+        uint32_t hold = bus_hold;
+        if (hold != 0)
+        {
+            if (!i2c_async_busy())
+            {
+                bus_held = hold;
+            }
+            power_idle_until(from_us_since_boot(time_us_64() + DISPLAY_HOLD_POLL_US));
+            continue;
+        }
+        bus_held = 0;
+
+        // The I2C divider follows the system clock, set it again once the
+        // bus is quiet
+        uint32_t generation = power_get_clock_generation();
+        if (generation != clock_generation && i2c_async_retune())
+        {
+            clock_generation = generation;
+        }
+
+        // The last frame went out in the background, it has long finished.
+        // The display is up once the first frame is on it. A frame with a
+        // failed write is counted by the driver and not timed.
+        uint64_t done;
+        bool ok;
+        bool finished = ht16k33_get_commit_done(&done, &ok);
+        if (finished && ok)
+        {
+            boot_end_at(BOOT_DISPLAY, done);
+        }
+        if (sent && finished)
+        {
+            if (ok)
+            {
+                uint32_t frame_us = (uint32_t)(done - start);
+                write_us += ((int32_t)frame_us - (int32_t)write_us) / 8;
+                DISPLAY_REPORT_T report = { (int32_t)((start + done) / 2 - edge_local), frame_us };
+                report_queue.push(report);
+            }
+            sent = false;
+        }
+
+        uint8_t m;
+        while (mode_queue.pop(&m))
+        {
+            mode = (DISPLAY_MODE)m;
+        }
+        DISPLAY_MESSAGE_T msg;
+        while (message_queue.pop(&msg))
+        {
+            anim_add_message(&msg, time_us_64());
+        }
+        DISPLAY_FADE_T fade;
+        while (fade_queue.pop(&fade))
+        {
+            day_brightness = fade.level;
+            if (brightness != DISPLAY_NIGHT_BRIGHTNESS)
+            {
+                brightness = fade.level;
+                anim_fade_to(fade.level, fade.fade_ms, time_us_64());
+            }
+        }
+
+        int64_t utc_us = clock_get_utc_us();
+        int64_t edge = (utc_us / 1000000 + 1) * 1000000;
+        if (edge - utc_us < DISPLAY_LEAD_US + write_us)
+        {
+            edge += 1000000;
+        }
+        uint64_t wake = clock_utc_to_local_us(edge) - DISPLAY_LEAD_US - write_us / 2;
+
+        // Animation frames in between the edges
+        uint64_t frame_at = anim_next_frame_us();
+        if (frame_at < wake - DISPLAY_LEAD_US)
+        {
+            // Core 0 asking for the bus wakes us early
+            power_idle_until(from_us_since_boot(frame_at), &bus_hold);
+            if (bus_hold != 0)
+            {
+                continue;
+            }
+            anim_render(time_display, time_us_64());
+            // Only edge frames are timed
+            sent = false;
+            ht16k33_commit();
+            continue;
+        }
+        power_idle_until(from_us_since_boot(wake), &bus_hold);
+        if (bus_hold != 0)
+        {
+            continue;
+        }
+
+        // Work out where the edge is again in case the clock was updated
+        // while asleep, then wait for it so the colon toggle and any digit
+        // change land on the true second. A step back can move the edge a
+        // long way, never spin for more than the lead.
+        time_t t = edge / 1000000;
+        edge_local = clock_utc_to_local_us(edge);
+        uint64_t until = edge_local - write_us / 2;
+        if ((int64_t)(until - wake) > DISPLAY_LEAD_US)
+        {
+            until = wake + DISPLAY_LEAD_US;
+        }
+        busy_wait_until(from_us_since_boot(until));
+
+        start = time_us_64();
+        uint16_t frame[ANIM_POSITIONS];
+        if (mode == DISPLAY_TIME || clock_is_synced())
+        {
+            int target;
+            show_time(t, (t & 1) == 0, frame, &target);
+            if (target != brightness)
+            {
+                brightness = target;
+                anim_fade_to(target, DISPLAY_NIGHT_FADE_MS, start);
+            }
+        }
+        else
+        {
+            show_busy(busy_step, frame);
+            busy_step = (busy_step + 1) % DISPLAY_BUSY_STEPS;
+        }
+        anim_set_base(frame, start);
+        anim_render(time_display, start);
+        sent = ht16k33_commit();
+        if (clock_is_synced())
+        {
+            boot_end(BOOT_FIRST_TIME);
+        }
+
+        tempco_sample();
+    }
+}
+
+void display_start()
+{
+    display_beat = health_register("display", DISPLAY_HEALTH_DEADLINE_MS);
+    multicore_launch_core1(display_core_main);
+}
+
+void display_set_mode(DISPLAY_MODE mode)
+{
+    mode_queue.push((uint8_t)mode);
+}
+
+bool display_hold_bus(uint32_t wait_us)
+{
+    uint32_t hold = ++hold_count;
+    if (hold == 0)
+    {
+        hold = ++hold_count;
+    }
+    bus_hold = hold;
+    // Wake core 1 if it is waiting for an event
+    __sev();
+    uint64_t until = time_us_64() + wait_us;
+    while (bus_held != hold)
+    {
+        if (time_us_64() >= until)
+        {
+            display_release_bus();
+            return false;
+        }
+        tight_loop_contents();
+    }
+    return true;
+}
+
+void display_release_bus()
+{
+    bus_hold = 0;
+    __sev();
+}
+
+bool display_show_message(const DISPLAY_MESSAGE_T *msg)
+{
+    return message_queue.push(*msg);
+}
+
+bool display_set_brightness(unsigned int level, uint32_t fade_ms)
+{
+    DISPLAY_FADE_T fade = { (uint8_t)(level <= 15 ? level : 15), fade_ms };
+    return fade_queue.push(fade);
+}
+
+void display_print_stats()
+{
+    DISPLAY_REPORT_T report;
+    while (report_queue.pop(&report))
+    {
+        ++phase_count;
+        phase_sum_us += report.phase_us;
+        if ((uint32_t)abs(report.phase_us) > phase_max_us)
+        {
+            phase_max_us = (uint32_t)abs(report.phase_us);
+        }
+        last_write_us = report.write_us;
+    }
+    if (phase_count > 0)
+    {
+        printf("display phase mean %lld us, worst %lu us, write %lu us\n", (long long)(phase_sum_us / phase_count),
+            (unsigned long)phase_max_us, (unsigned long)last_write_us);
+    }
+
+    // The counters are written on core 1 but each is a single word
+    HT16K33_STATS_T i2c_stats;
+    ht16k33_get_stats(&i2c_stats);
+    uint64_t now = time_us_64();
+    if (last_stats_us != 0)
+    {
+        float secs = (now - last_stats_us) / 1e6f;
+        printf("display i2c %.1f transactions, %.1f bytes, %.0f us bus time per second\n",
+            (i2c_stats.transactions - last_i2c_stats.transactions) / secs,
+            (i2c_stats.bytes - last_i2c_stats.bytes) / secs,
+            (i2c_stats.bus_us - last_i2c_stats.bus_us) / secs);
+    }
+    last_i2c_stats = i2c_stats;
+    last_stats_us = now;
+
+    I2C_ASYNC_STATS_T bus_stats;
+    i2c_async_get_stats(&bus_stats);
+    if (bus_stats.aborts || bus_stats.timeouts || bus_stats.recoveries || bus_stats.overflows || i2c_stats.failed)
+    {
+        printf("display i2c errors %lu aborts, %lu timeouts, %lu recoveries, %lu overflows, %lu failed frames\n",
+            (unsigned long)bus_stats.aborts, (unsigned long)bus_stats.timeouts,
+            (unsigned long)bus_stats.recoveries, (unsigned long)bus_stats.overflows,
+            (unsigned long)i2c_stats.failed);
+    }
+}
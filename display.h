@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+// The time display runs on core 1, which owns the HT16K33, its I2C bus and the
+// temperature sensor from display_start() on. Digits change and the colon
+// toggles on the UTC second edge of the disciplined clock.
+
+enum DISPLAY_MODE
+{
+    // Time if it is known, otherwise a busy pattern
+    DISPLAY_WAITING,
+    DISPLAY_TIME,
+};
+
+enum DISPLAY_EFFECT
+{
+    // Text moves in from the right one character per step
+    DISPLAY_SCROLL,
+    // Text flashes on and off, each half taking a step
+    DISPLAY_BLINK,
+    DISPLAY_STATIC,
+};
+
+#define DISPLAY_MESSAGE_MAX 32
+
+// A message shown in place of the time. Messages of higher priority cut in
+// front of lower ones, which are shown again from the start afterwards.
+struct DISPLAY_MESSAGE_T
+{
+    char text[DISPLAY_MESSAGE_MAX];
+    uint8_t effect;
+    uint8_t priority;
+    // Zero for the default speed of the effect
+    uint16_t step_ms;
+    // How long to show it for, zero for one scroll pass or the default
+    uint32_t duration_ms;
+};
+
+extern void display_start();
+
+// Called from core 0
+extern void display_set_mode(DISPLAY_MODE mode);
+extern void display_print_stats();
+
+// Called from core 0 around a change of system clock. Asks core 1 to finish
+// any I2C write and keep off the bus, and waits up to wait_us for it to. If
+// it returns true the bus stays quiet until display_release_bus().
+extern bool display_hold_bus(uint32_t wait_us);
+extern void display_release_bus();
+
+// Called from core 0 with the lwIP lock held, as the HTTP handlers are.
+// False if core 1 has not caught up with earlier requests.
+extern bool display_show_message(const DISPLAY_MESSAGE_T *msg);
+// Daytime brightness 0 to 15, ramped to over fade_ms
+extern bool display_set_brightness(unsigned int level, uint32_t fade_ms);
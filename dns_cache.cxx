@@ -0,0 +1,478 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "pico/stdlib.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/timeouts.h"
+#include "lwip/udp.h"
+
+#include "dns_cache.h"
+
+#define DNS_CACHE_NAMES 8
+#define DNS_CACHE_ADDRS 4
+#define DNS_CACHE_MAX_NAME 64
+#define DNS_PORT 53
+#define DNS_MSG_MAX 512
+// Queries are checked on this period and resent if unanswered
+#define DNS_CACHE_TICK_TIME 1000
+#define DNS_CACHE_TRIES 3
+// TTLs are clamped to this range
+#define DNS_CACHE_MIN_TTL 60
+#define DNS_CACHE_MAX_TTL (24 * 3600)
+// After a failure wait this long before asking again
+#define DNS_CACHE_RETRY_TIME 30
+// Refresh when this fraction of the TTL is left
+#define DNS_CACHE_REFRESH_DIVISOR 5
+// Callers that can wait on the first answer for one name
+#define DNS_CACHE_WAITERS 4
+// Source ports are picked at random from the dynamic range
+#define DNS_CACHE_PORT_BASE 0xc000
+#define DNS_CACHE_PORT_MASK 0x3fff
+
+struct DNS_CACHE_WAITER_T
+{
+    dns_found_callback found;
+    void *arg;
+};
+
+struct DNS_CACHE_ENTRY_T
+{
+    char name[DNS_CACHE_MAX_NAME];
+    ip_addr_t addrs[DNS_CACHE_ADDRS];
+    int addr_count;
+    int next;
+    // Times are seconds since boot
+    uint32_t expires;
+    uint32_t refresh_at;
+    bool query_active;
+    uint16_t query_id;
+    // Replies are only taken from the server the query went to
+    ip_addr_t query_server;
+    int tries;
+    uint64_t query_sent_us;
+    // Callers waiting for the first answer
+    DNS_CACHE_WAITER_T waiters[DNS_CACHE_WAITERS];
+    int waiter_count;
+};
+
+static DNS_CACHE_ENTRY_T entries[DNS_CACHE_NAMES];
+static struct udp_pcb *dns_pcb;
+
+static uint32_t now_s()
+{
+    return (uint32_t)(time_us_64() / 1000000);
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static bool any_query_active()
+{
+    for (int i = 0; i < DNS_CACHE_NAMES; ++i)
+    {
+        if (entries[i].query_active)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool send_query(DNS_CACHE_ENTRY_T *entry)
+{
+    const ip_addr_t *server = dns_getserver(0);
+    if (server == nullptr || ip_addr_isany(server))
+    {
+        return false;
+    }
+
+    // A forged reply has to guess the ID and the port as well as race the
+    // real one. The port can only move while no other query is waiting on
+    // the old one.
+    if (!any_query_active())
+    {
+        udp_bind(dns_pcb, IP_ANY_TYPE, DNS_CACHE_PORT_BASE | (LWIP_RAND() & DNS_CACHE_PORT_MASK));
+    }
+
+    uint8_t msg[12 + DNS_CACHE_MAX_NAME + 2 + 4];
+    memset(msg, 0, 12);
+    // Resends keep the ID so a slow answer to an earlier try still counts
+    if (entry->tries == 0)
+    {
+        entry->query_id = (uint16_t)LWIP_RAND();
+    }
+    msg[0] = entry->query_id >> 8;
+    msg[1] = entry->query_id;
+    msg[2] = 0x01; // recursion desired
+    msg[5] = 1;    // one question
+    size_t off = 12;
+    const char *label = entry->name;
+    while (*label)
+    {
+        const char *dot = strchr(label, '.');
+        size_t len = dot ? (size_t)(dot - label) : strlen(label);
+        if (len == 0 || len > 63)
+        {
+            return false;
+        }
+        msg[off++] = len;
+        memcpy(msg + off, label, len);
+        off += len;
+        label += dot ? len + 1 : len;
+    }
+    msg[off++] = 0;
+    msg[off++] = 0; msg[off++] = 1; // type A
+    msg[off++] = 0; msg[off++] = 1; // class IN
+
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, off, PBUF_RAM);
+    if (p == nullptr)
+    {
+        return false;
+    }
+    memcpy(p->payload, msg, off);
+    err_t err = udp_sendto(dns_pcb, p, server, DNS_PORT);
+    pbuf_free(p);
+    if (err != ERR_OK)
+    {
+        return false;
+    }
+
+    entry->query_active = true;
+    ip_addr_copy(entry->query_server, *server);
+    entry->query_sent_us = time_us_64();
+    ++entry->tries;
+    return true;
+}
+
+static void query_finished(DNS_CACHE_ENTRY_T *entry, bool ok)
+{
+    entry->query_active = false;
+    entry->tries = 0;
+    if (!ok)
+    {
+        printf("dns cache lookup failed %s\n", entry->name);
+        entry->refresh_at = now_s() + DNS_CACHE_RETRY_TIME;
+    }
+    if (!ok && entry->addr_count > 0)
+    {
+        return;
+    }
+    // A callback may resolve again, so take the list first
+    DNS_CACHE_WAITER_T waiters[DNS_CACHE_WAITERS];
+    int count = entry->waiter_count;
+    memcpy(waiters, entry->waiters, sizeof(waiters[0]) * count);
+    entry->waiter_count = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        const ip_addr_t *addr = nullptr;
+        if (entry->addr_count > 0)
+        {
+            addr = &entry->addrs[entry->next];
+            entry->next = (entry->next + 1) % entry->addr_count;
+        }
+        waiters[i].found(entry->name, addr, waiters[i].arg);
+    }
+}
+
+// Names in a DNS message are a run of labels, possibly ending in a pointer
+static bool skip_name(const uint8_t *msg, int len, int *off)
+{
+    while (*off < len)
+    {
+        uint8_t l = msg[*off];
+        if (l == 0)
+        {
+            ++*off;
+            return true;
+        }
+        if ((l & 0xc0) == 0xc0)
+        {
+            *off += 2;
+            return *off <= len;
+        }
+        *off += l + 1;
+    }
+    return false;
+}
+
+// The question in a reply has to be the one that was asked, for an A record.
+// Case is ignored as servers may echo the name back differently.
+static bool question_matches(const uint8_t *msg, int len, int *off, const char *name)
+{
+    char asked[DNS_CACHE_MAX_NAME];
+    size_t n = 0;
+    while (*off < len)
+    {
+        uint8_t l = msg[(*off)++];
+        if (l == 0)
+        {
+            asked[n] = '\0';
+            bool ok = *off + 4 <= len && get16(msg + *off) == 1 && get16(msg + *off + 2) == 1;
+            *off += 4;
+            return ok && strcasecmp(asked, name) == 0;
+        }
+        // No compression is expected in the first name of a message
+        if (l > 63 || *off + l > len || n + l + 1 >= sizeof(asked))
+        {
+            return false;
+        }
+        if (n > 0)
+        {
+            asked[n++] = '.';
+        }
+        memcpy(asked + n, msg + *off, l);
+        n += l;
+        *off += l;
+    }
+    return false;
+}
+
+static void dns_cache_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    uint8_t msg[DNS_MSG_MAX];
+    int len = pbuf_copy_partial(p, msg, sizeof(msg), 0);
+    pbuf_free(p);
+    if (port != DNS_PORT || len < 12 || (msg[2] & 0x80) == 0)
+    {
+        return;
+    }
+
+    // Anything that does not match an outstanding query in every respect is
+    // dropped without touching it, so a forged reply can not end a query
+    uint16_t id = get16(msg);
+    DNS_CACHE_ENTRY_T *entry = nullptr;
+    int off = 12;
+    for (int i = 0; i < DNS_CACHE_NAMES; ++i)
+    {
+        DNS_CACHE_ENTRY_T *e = &entries[i];
+        if (e->query_active && e->query_id == id && ip_addr_cmp(addr, &e->query_server))
+        {
+            entry = e;
+            break;
+        }
+    }
+    if (entry == nullptr || get16(msg + 4) != 1 || !question_matches(msg, len, &off, entry->name))
+    {
+        return;
+    }
+
+    int rcode = msg[3] & 0xf;
+    int ancount = get16(msg + 6);
+
+    ip_addr_t addrs[DNS_CACHE_ADDRS];
+    int count = 0;
+    uint32_t ttl = DNS_CACHE_MAX_TTL;
+    for (int i = 0; i < ancount && count < DNS_CACHE_ADDRS; ++i)
+    {
+        if (!skip_name(msg, len, &off) || off + 10 > len)
+        {
+            break;
+        }
+        uint16_t type = get16(msg + off);
+        uint16_t cls = get16(msg + off + 2);
+        uint32_t record_ttl = get32(msg + off + 4);
+        uint16_t rdlength = get16(msg + off + 8);
+        off += 10;
+        if (off + rdlength > len)
+        {
+            break;
+        }
+        if (type == 1 && cls == 1 && rdlength == 4)
+        {
+            IP_ADDR4(&addrs[count], msg[off], msg[off + 1], msg[off + 2], msg[off + 3]);
+            ++count;
+            if (record_ttl < ttl)
+            {
+                ttl = record_ttl;
+            }
+        }
+        off += rdlength;
+    }
+
+    if (rcode != 0 || count == 0)
+    {
+        query_finished(entry, false);
+        return;
+    }
+
+    if (ttl < DNS_CACHE_MIN_TTL)
+    {
+        ttl = DNS_CACHE_MIN_TTL;
+    }
+    memcpy(entry->addrs, addrs, sizeof(addrs[0]) * count);
+    entry->addr_count = count;
+    entry->next %= count;
+    uint32_t now = now_s();
+    entry->expires = now + ttl;
+    entry->refresh_at = now + ttl - ttl / DNS_CACHE_REFRESH_DIVISOR;
+    printf("dns cache %s %d addresses ttl %lu\n", entry->name, count, ttl);
+    query_finished(entry, true);
+}
+
+static void dns_cache_tick(void *arg)
+{
+    uint64_t now_us = time_us_64();
+    uint32_t now = now_s();
+    for (int i = 0; i < DNS_CACHE_NAMES; ++i)
+    {
+        DNS_CACHE_ENTRY_T *entry = &entries[i];
+        if (entry->name[0] == '\0')
+        {
+            continue;
+        }
+        if (entry->query_active)
+        {
+            if (now_us - entry->query_sent_us >= DNS_CACHE_TICK_TIME * 1000)
+            {
+                if (entry->tries < DNS_CACHE_TRIES)
+                {
+                    // A resend that can not go out still uses up a try, so
+                    // the query always ends and its waiters hear back
+                    if (!send_query(entry))
+                    {
+                        ++entry->tries;
+                        entry->query_sent_us = now_us;
+                    }
+                }
+                else
+                {
+                    query_finished(entry, false);
+                }
+            }
+        }
+        else if ((int32_t)(now - entry->refresh_at) >= 0)
+        {
+            send_query(entry);
+        }
+    }
+    sys_timeout(DNS_CACHE_TICK_TIME, dns_cache_tick, nullptr);
+}
+
+bool dns_cache_init()
+{
+    if (dns_pcb != nullptr)
+    {
+        return true;
+    }
+    dns_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (dns_pcb == nullptr)
+    {
+        printf("failed to create dns cache pcb\n");
+        return false;
+    }
+    udp_recv(dns_pcb, dns_cache_recv, nullptr);
+    sys_timeout(DNS_CACHE_TICK_TIME, dns_cache_tick, nullptr);
+    return true;
+}
+
+void dns_cache_seed(const char *name, const ip_addr_t *addr)
+{
+    if (strlen(name) >= DNS_CACHE_MAX_NAME)
+    {
+        return;
+    }
+    for (int i = 0; i < DNS_CACHE_NAMES; ++i)
+    {
+        DNS_CACHE_ENTRY_T *entry = &entries[i];
+        if (entry->name[0] == '\0')
+        {
+            strcpy(entry->name, name);
+            entry->addrs[0] = *addr;
+            entry->addr_count = 1;
+            entry->next = 0;
+            entry->expires = now_s();
+            entry->refresh_at = entry->expires;
+            return;
+        }
+    }
+}
+
+int dns_cache_get_entries(const char **names, ip_addr_t *addrs, int max)
+{
+    int n = 0;
+    for (int i = 0; i < DNS_CACHE_NAMES && n < max; ++i)
+    {
+        if (entries[i].addr_count > 0)
+        {
+            names[n] = entries[i].name;
+            addrs[n] = entries[i].addrs[0];
+            ++n;
+        }
+    }
+    return n;
+}
+
+err_t dns_cache_resolve(const char *name, ip_addr_t *addr, dns_found_callback found, void *arg)
+{
+    if (ipaddr_aton(name, addr))
+    {
+        return ERR_OK;
+    }
+    if (strlen(name) >= DNS_CACHE_MAX_NAME)
+    {
+        return ERR_ARG;
+    }
+
+    DNS_CACHE_ENTRY_T *entry = nullptr;
+    DNS_CACHE_ENTRY_T *free_entry = nullptr;
+    for (int i = 0; i < DNS_CACHE_NAMES; ++i)
+    {
+        if (strcmp(entries[i].name, name) == 0)
+        {
+            entry = &entries[i];
+            break;
+        }
+        if (free_entry == nullptr && entries[i].name[0] == '\0')
+        {
+            free_entry = &entries[i];
+        }
+    }
+    if (entry == nullptr)
+    {
+        if (free_entry == nullptr)
+        {
+            return ERR_MEM;
+        }
+        entry = free_entry;
+        strcpy(entry->name, name);
+    }
+
+    // Addresses past their TTL are still handed out while a refresh is
+    // outstanding, pool servers rarely vanish that quickly
+    if (entry->addr_count > 0)
+    {
+        *addr = entry->addrs[entry->next];
+        entry->next = (entry->next + 1) % entry->addr_count;
+        if ((int32_t)(now_s() - entry->expires) >= 0 && !entry->query_active)
+        {
+            send_query(entry);
+        }
+        return ERR_OK;
+    }
+
+    if (entry->waiter_count >= DNS_CACHE_WAITERS)
+    {
+        return ERR_MEM;
+    }
+    if (!entry->query_active)
+    {
+        entry->tries = 0;
+        if (!send_query(entry))
+        {
+            return ERR_CONN;
+        }
+    }
+    entry->waiters[entry->waiter_count].found = found;
+    entry->waiters[entry->waiter_count].arg = arg;
+    ++entry->waiter_count;
+    return ERR_INPROGRESS;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "lwip/ip_addr.h"
+#include "lwip/dns.h"
+
+// Resolver cache that keeps every A record for a name along with its TTL and
+// refreshes them in the background before they expire, so that lookups in
+// the steady state are answered straight from the cache. All functions must
+// be called with the lwIP lock held.
+
+extern bool dns_cache_init();
+
+// Same contract as dns_gethostbyname: ERR_OK with *addr filled in from the
+// cache, ERR_INPROGRESS if found will be called later, or an error. Several
+// callers can wait on the same name and each gets its own callback, ERR_MEM
+// if too many already are. Each call for a name moves on to the next of its
+// addresses.
+extern err_t dns_cache_resolve(const char *name, ip_addr_t *addr, dns_found_callback found, void *arg);
+
+// Put in an address saved from before a reboot. It is handed out straight
+// away and refreshed on first use, as though its TTL had run out.
+extern void dns_cache_seed(const char *name, const ip_addr_t *addr);
+
+// Names that have an address and the first address of each, for saving.
+// Returns how many were filled in, up to max.
+extern int dns_cache_get_entries(const char **names, ip_addr_t *addrs, int max);
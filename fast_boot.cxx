@@ -0,0 +1,201 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "hardware/watchdog.h"
+
+#include "lwip/dhcp.h"
+#include "lwip/dns.h"
+#include "lwip/netif.h"
+#include "lwip/prot/dhcp.h"
+
+#include "clock.h"
+#include "dns_cache.h"
+#include "fast_boot.h"
+#include "wifi_link.h"
+
+#define FAST_BOOT_MAGIC 0xfa57b007
+#define FAST_BOOT_NAMES 6
+#define FAST_BOOT_MAX_NAME 48
+// A lease with less than this left is not worth asking for again
+#define FAST_BOOT_LEASE_MARGIN_S 60
+
+struct FAST_BOOT_NAME_T
+{
+    char name[FAST_BOOT_MAX_NAME];
+    uint32_t addr;
+};
+
+// Addresses are in network byte order as lwIP keeps them
+struct FAST_BOOT_PERSIST_T
+{
+    uint32_t magic;
+    WIFI_LINK_AP_T ap;
+    uint32_t ip;
+    uint32_t netmask;
+    uint32_t gw;
+    uint32_t dns;
+    // UTC seconds, 0 if there is no lease
+    int64_t lease_expires_s;
+    FAST_BOOT_NAME_T names[FAST_BOOT_NAMES];
+    uint32_t checksum;
+};
+
+struct FAST_BOOT_STATS_T
+{
+    bool ap;
+    bool lease;
+    int names;
+    uint32_t requested_ip;
+};
+
+static FAST_BOOT_PERSIST_T __uninitialized_ram(persisted);
+static FAST_BOOT_STATS_T restored;
+
+static uint32_t persist_checksum(const FAST_BOOT_PERSIST_T *p)
+{
+    const uint32_t *words = (const uint32_t *)p;
+    uint32_t sum = 2166136261u;
+    for (size_t i = 0; i < offsetof(FAST_BOOT_PERSIST_T, checksum) / sizeof(uint32_t); ++i)
+    {
+        sum = (sum ^ words[i]) * 16777619u;
+    }
+    return sum;
+}
+
+// Ask for the saved address again. When the link comes up lwIP sends a
+// REQUEST for it straight away, the INIT-REBOOT exchange, instead of going
+// through DISCOVER and OFFER first. A NAK sends it back to a discover.
+// Must be called with the lwIP lock held.
+static bool request_lease(const FAST_BOOT_PERSIST_T *saved)
+{
+    if (saved->ip == 0 || saved->lease_expires_s == 0 || !clock_is_synced())
+    {
+        return false;
+    }
+    int64_t left_s = saved->lease_expires_s - clock_get_utc_us() / 1000000;
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+    struct dhcp *dhcp = netif_dhcp_data(netif);
+    if (left_s < FAST_BOOT_LEASE_MARGIN_S || dhcp == nullptr)
+    {
+        return false;
+    }
+    ip4_addr_set_u32(&dhcp->offered_ip_addr, saved->ip);
+    ip4_addr_set_u32(&dhcp->offered_sn_mask, saved->netmask);
+    ip4_addr_set_u32(&dhcp->offered_gw_addr, saved->gw);
+    dhcp->offered_t0_lease = (uint32_t)left_s;
+    dhcp->state = DHCP_STATE_REBOOTING;
+    return true;
+}
+
+bool fast_boot_restore()
+{
+    memset(&restored, 0, sizeof(restored));
+    if (!watchdog_caused_reboot() || persisted.magic != FAST_BOOT_MAGIC ||
+        persisted.checksum != persist_checksum(&persisted))
+    {
+        persisted.magic = 0;
+        return false;
+    }
+    FAST_BOOT_PERSIST_T saved = persisted;
+
+    if (saved.ap.channel != 0)
+    {
+        wifi_link_set_ap(&saved.ap);
+        restored.ap = true;
+    }
+
+    cyw43_arch_lwip_begin();
+    restored.lease = request_lease(&saved);
+    if (restored.lease)
+    {
+        restored.requested_ip = saved.ip;
+    }
+    if (saved.dns != 0)
+    {
+        ip_addr_t dns;
+        ip_addr_set_ip4_u32(&dns, saved.dns);
+        dns_setserver(0, &dns);
+    }
+    for (int i = 0; i < FAST_BOOT_NAMES; ++i)
+    {
+        FAST_BOOT_NAME_T *n = &saved.names[i];
+        n->name[FAST_BOOT_MAX_NAME - 1] = '\0';
+        if (n->name[0] != '\0' && n->addr != 0)
+        {
+            ip_addr_t addr;
+            ip_addr_set_ip4_u32(&addr, n->addr);
+            dns_cache_seed(n->name, &addr);
+            ++restored.names;
+        }
+    }
+    cyw43_arch_lwip_end();
+
+    printf("fast boot: %s, %s, %d server addresses\n", restored.ap ? "access point cached" : "no access point",
+        restored.lease ? "requesting saved lease" : "no lease", restored.names);
+    return restored.ap || restored.lease || restored.names > 0;
+}
+
+void fast_boot_save()
+{
+    FAST_BOOT_PERSIST_T save;
+    memset(&save, 0, sizeof(save));
+    wifi_link_get_ap(&save.ap);
+
+    cyw43_arch_lwip_begin();
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+    struct dhcp *dhcp = netif_dhcp_data(netif);
+    if (dhcp != nullptr && dhcp->state == DHCP_STATE_BOUND && clock_is_synced())
+    {
+        save.ip = ip4_addr_get_u32(netif_ip4_addr(netif));
+        save.netmask = ip4_addr_get_u32(netif_ip4_netmask(netif));
+        save.gw = ip4_addr_get_u32(netif_ip4_gw(netif));
+        uint32_t used_s = dhcp->lease_used * DHCP_COARSE_TIMER_SECS;
+        save.lease_expires_s = clock_get_utc_us() / 1000000 + dhcp->offered_t0_lease - used_s;
+    }
+    else if (persisted.magic == FAST_BOOT_MAGIC)
+    {
+        // Renewing or not synchronised, keep the lease saved before
+        save.ip = persisted.ip;
+        save.netmask = persisted.netmask;
+        save.gw = persisted.gw;
+        save.lease_expires_s = persisted.lease_expires_s;
+    }
+    const ip_addr_t *dns = dns_getserver(0);
+    if (dns != nullptr)
+    {
+        save.dns = ip4_addr_get_u32(dns);
+    }
+    const char *names[FAST_BOOT_NAMES];
+    ip_addr_t addrs[FAST_BOOT_NAMES];
+    int count = dns_cache_get_entries(names, addrs, FAST_BOOT_NAMES);
+    for (int i = 0, n = 0; i < count; ++i)
+    {
+        if (strlen(names[i]) < FAST_BOOT_MAX_NAME)
+        {
+            strcpy(save.names[n].name, names[i]);
+            save.names[n].addr = ip4_addr_get_u32(&addrs[i]);
+            ++n;
+        }
+    }
+    cyw43_arch_lwip_end();
+
+    save.magic = FAST_BOOT_MAGIC;
+    save.checksum = persist_checksum(&save);
+    persisted = save;
+}
+
+void fast_boot_print_stats()
+{
+    if (!restored.ap && !restored.lease && restored.names == 0)
+    {
+        return;
+    }
+    cyw43_arch_lwip_begin();
+    uint32_t ip = ip4_addr_get_u32(netif_ip4_addr(&cyw43_state.netif[CYW43_ITF_STA]));
+    cyw43_arch_lwip_end();
+    printf("fast boot: up %llu ms after reset, %s\n", (unsigned long long)(time_us_64() / 1000),
+        !restored.lease ? "full dhcp" : ip == restored.requested_ip ? "saved lease reused" : "saved lease refused");
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Network state kept across a watchdog or OTA reboot so the clock is back on
+// the network quickly. It holds the access point and channel to join
+// without a scan, the DHCP lease to ask for again with an INIT-REBOOT
+// request rather than a full discover, and the addresses of the NTP servers
+// so the first round does not wait on DNS. Like the time it lives in RAM
+// that is not cleared at startup, so a power cycle starts from scratch.
+
+// Put back what was saved, call after station mode is enabled and before
+// joining. Returns true if there was anything to use.
+extern bool fast_boot_restore();
+
+// Save the current state, call now and again while the link is up. The
+// lease is only saved once the clock is synchronised, as its expiry is kept
+// as UTC.
+extern void fast_boot_save();
+
+// Report how the restored state fared, call once connected
+extern void fast_boot_print_stats();
@@ -0,0 +1,28 @@
+#include "pico/multicore.h"
+#include "hardware/sync.h"
+
+#include "flash_lockout.h"
+#include "health.h"
+
+uint32_t flash_lockout_begin()
+{
+    // Nothing feeds the watchdog until this ends, so start a fresh period
+    health_feed();
+    // Interrupts go off first so nothing else on this core can try to take
+    // the lockout while it is held
+    uint32_t interrupts = save_and_disable_interrupts();
+    if (multicore_lockout_victim_is_initialized(1))
+    {
+        multicore_lockout_start_blocking();
+    }
+    return interrupts;
+}
+
+void flash_lockout_end(uint32_t interrupts)
+{
+    if (multicore_lockout_victim_is_initialized(1))
+    {
+        multicore_lockout_end_blocking();
+    }
+    restore_interrupts(interrupts);
+}
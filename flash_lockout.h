@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// Flash can not be read while it is being erased or programmed. Wrap writes
+// in these to turn off interrupts and park core 1 in RAM for the duration.
+extern uint32_t flash_lockout_begin();
+extern void flash_lockout_end(uint32_t interrupts);
@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "pico/unique_id.h"
+
+#include "lwip/igmp.h"
+#include "lwip/pbuf.h"
+#include "lwip/timeouts.h"
+#include "lwip/udp.h"
+
+#include "clock.h"
+#include "fleet.h"
+#include "ntp.h"
+#include "wifi_details.h"
+#include "wifi_pm.h"
+
+// Set FLEET_MODE to 1 in wifi_details.h to share time between clocks
+#ifndef FLEET_MODE
+#define FLEET_MODE 0
+#endif
+#ifndef FLEET_GROUP
+#define FLEET_GROUP "239.255.67.76"
+#endif
+#define FLEET_PORT 12367
+#define FLEET_MAGIC 0x50434c4b // "PCLK"
+#define FLEET_MSG_LEN 40
+#define FLEET_MSG_BEACON 1
+#define FLEET_MSG_DELAY_REQ 2
+#define FLEET_MSG_DELAY_RESP 3
+#define FLEET_STRATUM_UNSYNC 16
+// The state machine runs from a timer with this period
+#define FLEET_TICK_TIME 1000
+#define FLEET_BEACON_INTERVAL (4 * 1000)
+// A leader not heard from for this long is taken to have gone
+#define FLEET_LEADER_TIMEOUT (4 * FLEET_BEACON_INTERVAL)
+// Time spent listening for a leader before standing for election, plus a
+// per clock holdoff so the whole fleet does not go to NTP at once
+#define FLEET_LISTEN_TIME (3 * FLEET_BEACON_INTERVAL)
+#define FLEET_HOLDOFF_SPREAD (10 * 1000)
+// Path delay measurements, the lowest of the last few is used
+#define FLEET_DELAY_INTERVAL (64 * 1000)
+#define FLEET_DELAY_FILTER 8
+// Beacon offsets are averaged for the clock poll interval, but no longer than this
+#define FLEET_MAX_UPDATE_INTERVAL (64 * 1000)
+
+struct FLEET_T
+{
+    struct udp_pcb *pcb;
+    ip_addr_t group;
+    uint32_t node_id;
+    FLEET_ROLE role;
+    uint64_t role_since_us;
+    uint64_t holdoff_us;
+    uint32_t seq;
+    uint64_t next_beacon_us;
+    // The leader being followed
+    uint32_t leader_id;
+    ip_addr_t leader_addr;
+    uint8_t leader_stratum;
+    uint64_t last_beacon_us;
+    // Path delay calibration, round trip times
+    int64_t delays[FLEET_DELAY_FILTER];
+    int delay_count;
+    int delay_next;
+    int64_t path_delay_us;
+    uint64_t next_delay_req_us;
+    int64_t delay_req_utc_us;
+    // Beacon offsets not yet passed to the clock
+    int64_t offset_sum;
+    uint64_t local_sum;
+    int offset_count;
+    uint64_t last_update_us;
+    int64_t last_offset_us;
+};
+
+static FLEET_T fleet;
+
+static const char *role_names[] = { "off", "listen", "candidate", "leader", "follower" };
+
+static void put32(uint32_t v, uint8_t *buf)
+{
+    buf[0] = v >> 24;
+    buf[1] = v >> 16;
+    buf[2] = v >> 8;
+    buf[3] = v;
+}
+
+static uint32_t get32(const uint8_t *buf)
+{
+    return (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+}
+
+static void put64(int64_t v, uint8_t *buf)
+{
+    put32((uint32_t)((uint64_t)v >> 32), buf);
+    put32((uint32_t)v, buf + 4);
+}
+
+static int64_t get64(const uint8_t *buf)
+{
+    return (int64_t)((uint64_t)get32(buf) << 32 | get32(buf + 4));
+}
+
+static void set_role(FLEET_ROLE role)
+{
+    if (role != fleet.role)
+    {
+        printf("fleet %s -> %s\n", role_names[fleet.role], role_names[role]);
+    }
+    fleet.role = role;
+    fleet.role_since_us = time_us_64();
+}
+
+static uint8_t own_stratum()
+{
+    NTP_REFERENCE_T ref;
+    return ntp_get_reference(&ref) ? ref.stratum : FLEET_STRATUM_UNSYNC;
+}
+
+// Lower stratum wins, then the lower node id
+static bool ranks_above(uint8_t stratum_a, uint32_t id_a, uint8_t stratum_b, uint32_t id_b)
+{
+    return stratum_a != stratum_b ? stratum_a < stratum_b : id_a < id_b;
+}
+
+// A delay response also carries its own transmit time
+static void send_msg(const ip_addr_t *addr, u16_t port, uint8_t type, int64_t t_a, int64_t t_b)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, FLEET_MSG_LEN, PBUF_RAM);
+    if (p == nullptr)
+    {
+        return;
+    }
+    uint8_t *msg = (uint8_t *)p->payload;
+    memset(msg, 0, FLEET_MSG_LEN);
+    put32(FLEET_MAGIC, msg);
+    msg[4] = type;
+    msg[5] = own_stratum();
+    put32(fleet.node_id, msg + 8);
+    put32(fleet.seq++, msg + 12);
+    put64(t_a, msg + 16);
+    put64(t_b, msg + 24);
+    if (type == FLEET_MSG_DELAY_RESP)
+    {
+        put64(clock_get_utc_us(), msg + 32);
+    }
+    udp_sendto(fleet.pcb, p, addr, port);
+    pbuf_free(p);
+}
+
+static void follow(uint32_t id, const ip_addr_t *addr, uint8_t stratum, uint64_t rx_local_us)
+{
+    printf("fleet following %08lx at %s stratum %d\n", (unsigned long)id, ipaddr_ntoa(addr), stratum);
+    fleet.leader_id = id;
+    fleet.leader_addr = *addr;
+    fleet.leader_stratum = stratum;
+    fleet.last_beacon_us = rx_local_us;
+    fleet.delay_count = 0;
+    fleet.delay_next = 0;
+    fleet.next_delay_req_us = rx_local_us;
+    fleet.offset_count = 0;
+    fleet.offset_sum = 0;
+    fleet.local_sum = 0;
+    fleet.last_update_us = rx_local_us;
+    set_role(FLEET_FOLLOWER);
+}
+
+static void apply_offsets()
+{
+    int64_t offset = fleet.offset_sum / fleet.offset_count;
+    uint64_t local_us = fleet.local_sum / fleet.offset_count;
+    fleet.offset_sum = 0;
+    fleet.local_sum = 0;
+    fleet.offset_count = 0;
+    fleet.last_update_us = time_us_64();
+    fleet.last_offset_us = offset;
+    clock_update(offset, 2 * fleet.path_delay_us, local_us);
+}
+
+static void beacon_sample(const uint8_t *msg, uint64_t rx_local_us)
+{
+    fleet.last_beacon_us = rx_local_us;
+    fleet.leader_stratum = msg[5];
+    if (fleet.delay_count == 0)
+    {
+        // Nothing to correct the beacon with yet
+        return;
+    }
+    int64_t offset = get64(msg + 16) + fleet.path_delay_us - clock_local_to_utc_us(rx_local_us);
+    fleet.offset_sum += offset;
+    fleet.local_sum += rx_local_us;
+    ++fleet.offset_count;
+    if (!clock_is_synced())
+    {
+        apply_offsets();
+    }
+}
+
+static void delay_sample(const uint8_t *msg, uint64_t rx_local_us)
+{
+    // t1 request sent, t2 leader received, t3 leader replied, t4 reply received
+    int64_t t1 = get64(msg + 16);
+    if (t1 != fleet.delay_req_utc_us)
+    {
+        return;
+    }
+    int64_t t2 = get64(msg + 24);
+    int64_t t3 = get64(msg + 32);
+    int64_t t4 = clock_local_to_utc_us(rx_local_us);
+    int64_t delay = (t4 - t1) - (t3 - t2);
+    if (delay < 0)
+    {
+        delay = 0;
+    }
+    fleet.delays[fleet.delay_next] = delay;
+    fleet.delay_next = (fleet.delay_next + 1) % FLEET_DELAY_FILTER;
+    if (fleet.delay_count < FLEET_DELAY_FILTER)
+    {
+        ++fleet.delay_count;
+    }
+    // The lowest round trip has seen the least queuing
+    int64_t min_delay = fleet.delays[0];
+    for (int i = 1; i < fleet.delay_count; ++i)
+    {
+        if (fleet.delays[i] < min_delay)
+        {
+            min_delay = fleet.delays[i];
+        }
+    }
+    fleet.path_delay_us = min_delay / 2;
+}
+
+static void fleet_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    uint64_t rx_local_us = time_us_64();
+    LWIP_UNUSED_ARG(arg);
+    LWIP_UNUSED_ARG(pcb);
+    wifi_pm_note_traffic(p->tot_len);
+    uint8_t msg[FLEET_MSG_LEN];
+    bool valid = p->tot_len == FLEET_MSG_LEN && pbuf_copy_partial(p, msg, FLEET_MSG_LEN, 0) == FLEET_MSG_LEN;
+    pbuf_free(p);
+    if (!valid || get32(msg) != FLEET_MAGIC)
+    {
+        return;
+    }
+    uint32_t id = get32(msg + 8);
+    uint8_t stratum = msg[5];
+    if (id == fleet.node_id)
+    {
+        return;
+    }
+
+    switch (msg[4])
+    {
+    case FLEET_MSG_BEACON:
+        if (fleet.role == FLEET_FOLLOWER && id == fleet.leader_id)
+        {
+            beacon_sample(msg, rx_local_us);
+        }
+        else if (fleet.role == FLEET_LISTEN || fleet.role == FLEET_CANDIDATE ||
+                 (fleet.role == FLEET_LEADER && ranks_above(stratum, id, own_stratum(), fleet.node_id)) ||
+                 (fleet.role == FLEET_FOLLOWER && ranks_above(stratum, id, fleet.leader_stratum, fleet.leader_id)))
+        {
+            follow(id, addr, stratum, rx_local_us);
+        }
+        break;
+    case FLEET_MSG_DELAY_REQ:
+        if (fleet.role == FLEET_LEADER)
+        {
+            send_msg(addr, port, FLEET_MSG_DELAY_RESP, get64(msg + 16), clock_local_to_utc_us(rx_local_us));
+        }
+        break;
+    case FLEET_MSG_DELAY_RESP:
+        if (fleet.role == FLEET_FOLLOWER && id == fleet.leader_id)
+        {
+            delay_sample(msg, rx_local_us);
+        }
+        break;
+    }
+}
+
+static void fleet_tick(void *arg)
+{
+    uint64_t now = time_us_64();
+    LWIP_UNUSED_ARG(arg);
+    switch (fleet.role)
+    {
+    case FLEET_LISTEN:
+        if (now - fleet.role_since_us >= FLEET_LISTEN_TIME * 1000 + fleet.holdoff_us)
+        {
+            set_role(FLEET_CANDIDATE);
+            ntp_poll_soon();
+        }
+        break;
+    case FLEET_CANDIDATE:
+    {
+        // Only a sync gained while standing counts, not one left over from before
+        NTP_REFERENCE_T ref;
+        if (ntp_get_reference(&ref) && ref.ref_local_us > fleet.role_since_us)
+        {
+            set_role(FLEET_LEADER);
+            fleet.next_beacon_us = now;
+        }
+        break;
+    }
+    case FLEET_LEADER:
+        if ((int64_t)(now - fleet.next_beacon_us) >= 0)
+        {
+            send_msg(&fleet.group, FLEET_PORT, FLEET_MSG_BEACON, clock_get_utc_us(), 0);
+            fleet.next_beacon_us += FLEET_BEACON_INTERVAL * 1000;
+        }
+        break;
+    case FLEET_FOLLOWER:
+        if (now - fleet.last_beacon_us > FLEET_LEADER_TIMEOUT * 1000)
+        {
+            printf("fleet leader %08lx lost\n", (unsigned long)fleet.leader_id);
+            set_role(FLEET_LISTEN);
+            break;
+        }
+        if ((int64_t)(now - fleet.next_delay_req_us) >= 0)
+        {
+            fleet.delay_req_utc_us = clock_get_utc_us();
+            send_msg(&fleet.leader_addr, FLEET_PORT, FLEET_MSG_DELAY_REQ, fleet.delay_req_utc_us, 0);
+            // Fill the filter quickly after changing leader
+            fleet.next_delay_req_us = now + (fleet.delay_count < FLEET_DELAY_FILTER ? FLEET_TICK_TIME : FLEET_DELAY_INTERVAL) * 1000;
+        }
+        if (fleet.offset_count > 0)
+        {
+            uint32_t interval_ms = clock_get_poll_interval_ms();
+            if (interval_ms > FLEET_MAX_UPDATE_INTERVAL)
+            {
+                interval_ms = FLEET_MAX_UPDATE_INTERVAL;
+            }
+            if (now - fleet.last_update_us >= interval_ms * 1000ull)
+            {
+                apply_offsets();
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    sys_timeout(FLEET_TICK_TIME, fleet_tick, nullptr);
+}
+
+bool fleet_init()
+{
+    if (!FLEET_MODE || fleet.pcb != nullptr)
+    {
+        return true;
+    }
+
+    pico_unique_board_id_t board_id;
+    pico_get_unique_board_id(&board_id);
+    uint32_t id = 2166136261u;
+    for (size_t i = 0; i < sizeof(board_id.id); ++i)
+    {
+        id = (id ^ board_id.id[i]) * 16777619u;
+    }
+    fleet.node_id = id;
+    fleet.holdoff_us = (uint64_t)(id % FLEET_HOLDOFF_SPREAD) * 1000;
+
+    bool ok = false;
+    cyw43_arch_lwip_begin();
+    ipaddr_aton(FLEET_GROUP, &fleet.group);
+    fleet.pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (fleet.pcb != nullptr && udp_bind(fleet.pcb, IP_ANY_TYPE, FLEET_PORT) == ERR_OK &&
+        igmp_joingroup(IP4_ADDR_ANY4, ip_2_ip4(&fleet.group)) == ERR_OK)
+    {
+        udp_set_multicast_ttl(fleet.pcb, 1);
+        udp_recv(fleet.pcb, fleet_recv, nullptr);
+        set_role(FLEET_LISTEN);
+        sys_timeout(FLEET_TICK_TIME, fleet_tick, nullptr);
+        ok = true;
+    }
+    else if (fleet.pcb != nullptr)
+    {
+        udp_remove(fleet.pcb);
+        fleet.pcb = nullptr;
+    }
+    cyw43_arch_lwip_end();
+    if (!ok)
+    {
+        printf("failed to start fleet mode\n");
+        return false;
+    }
+    printf("fleet node %08lx\n", (unsigned long)fleet.node_id);
+    return true;
+}
+
+bool fleet_wants_ntp()
+{
+    return fleet.role == FLEET_OFF || fleet.role == FLEET_CANDIDATE || fleet.role == FLEET_LEADER;
+}
+
+FLEET_ROLE fleet_get_role()
+{
+    return fleet.role;
+}
+
+const char *fleet_get_role_name()
+{
+    return role_names[fleet.role];
+}
+
+int64_t fleet_get_path_delay_us()
+{
+    return fleet.path_delay_us;
+}
+
+int64_t fleet_get_last_offset_us()
+{
+    return fleet.last_offset_us;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+
+// Fleet mode for networks with many clocks. One elected clock keeps polling
+// NTP and multicasts timestamped beacons, the rest discipline against those
+// beacons after calibrating the path delay to the leader. If the leader goes
+// quiet the others hold an election by each trying NTP, and the best ranked
+// one to get a sync takes over.
+
+enum FLEET_ROLE
+{
+    FLEET_OFF,
+    FLEET_LISTEN,
+    FLEET_CANDIDATE,
+    FLEET_LEADER,
+    FLEET_FOLLOWER,
+};
+
+extern bool fleet_init();
+
+// Whether this clock should be polling NTP itself
+extern bool fleet_wants_ntp();
+
+extern FLEET_ROLE fleet_get_role();
+extern const char *fleet_get_role_name();
+// Calibrated one way delay to the leader, and the last offset measured from its beacons
+extern int64_t fleet_get_path_delay_us();
+extern int64_t fleet_get_last_offset_us();
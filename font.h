@@ -0,0 +1,240 @@
+#pragma once
+
+#include <stdint.h>
+
+// Segment fonts for LED displays, built at compile time into a 128 entry
+// table per display type so rendering is a lookup per character.
+//
+// Glyphs are described once by the segments they light, named as on a 14
+// segment display
+//
+//   ---A---     A to F are the outer segments, G and I the left and right
+//  |\  |  /|    halves of the middle bar, H J K the upper diagonals and
+//  F H J K B    vertical and L M N the lower ones. P is the decimal point.
+//  |  \|/  |
+//   -G- -I-     A 16 segment display splits A and D in two and lights both
+//  |  /|\  |    halves. A 7 segment display is too different to share
+//  E L M N C    shapes so it has its own descriptions, where G is the
+//  |/  |  \|    whole middle bar.
+//   ---D---  P
+
+struct FONT_GLYPH_T
+{
+    const char *seg14;
+    const char *seg7;
+};
+
+// Printable ASCII, ' ' to '~'
+static constexpr FONT_GLYPH_T font_glyphs[] = {
+    { "", "" },                 // ' '
+    { "BCP", "BCP" },           // '!'
+    { "BJ", "BF" },             // '"'
+    { "BCDGIJM", "BCDEG" },     // '#'
+    { "ACDFGIJM", "ACDFG" },    // '$'
+    { "CFGIKL", "BEG" },        // '%'
+    { "ADEGHJN", "ABDEG" },     // '&'
+    { "J", "B" },               // '\''
+    { "KN", "ADEF" },           // '('
+    { "HL", "ABCD" },           // ')'
+    { "GHIJKLMN", "BFG" },      // '*'
+    { "GIJM", "EFG" },          // '+'
+    { "L", "E" },               // ','
+    { "GI", "G" },              // '-'
+    { "P", "P" },               // '.'
+    { "KL", "BEG" },            // '/'
+    { "ABCDEFKL", "ABCDEF" },   // '0'
+    { "BCK", "BC" },            // '1'
+    { "ABDEGI", "ABDEG" },      // '2'
+    { "ABCDI", "ABCDG" },       // '3'
+    { "BCFGI", "BCFG" },        // '4'
+    { "ADFGN", "ACDFG" },       // '5'
+    { "ACDEFGI", "ACDEFG" },    // '6'
+    { "ABC", "ABC" },           // '7'
+    { "ABCDEFGI", "ABCDEFG" },  // '8'
+    { "ABCDFGI", "ABCDFG" },    // '9'
+    { "JM", "" },               // ':'
+    { "JL", "" },               // ';'
+    { "KN", "DEG" },            // '<'
+    { "DGI", "DG" },            // '='
+    { "HL", "CDG" },            // '>'
+    { "ABIM", "ABEG" },         // '?'
+    { "ABDEFIJ", "ABDEFG" },    // '@'
+    { "ABCEFGI", "ABCEFG" },    // 'A'
+    { "ABCDIJM", "CDEFG" },     // 'B'
+    { "ADEF", "ADEF" },         // 'C'
+    { "ABCDJM", "BCDEG" },      // 'D'
+    { "ADEFGI", "ADEFG" },      // 'E'
+    { "AEFGI", "AEFG" },        // 'F'
+    { "ACDEFI", "ACDEF" },      // 'G'
+    { "BCEFGI", "BCEFG" },      // 'H'
+    { "ADJM", "EF" },           // 'I'
+    { "BCDE", "BCDE" },         // 'J'
+    { "EFGKN", "ACEFG" },       // 'K'
+    { "DEF", "DEF" },           // 'L'
+    { "BCEFHK", "ACE" },        // 'M'
+    { "BCEFHN", "ABCEF" },      // 'N'
+    { "ABCDEF", "ABCDEF" },     // 'O'
+    { "ABEFGI", "ABEFG" },      // 'P'
+    { "ABCDEFN", "ABDFG" },     // 'Q'
+    { "ABEFGIN", "AEF" },       // 'R'
+    { "ACDHI", "ACDFG" },       // 'S'
+    { "AJM", "DEFG" },          // 'T'
+    { "BCDEF", "BCDEF" },       // 'U'
+    { "EFKL", "BCDEF" },        // 'V'
+    { "BCEFLN", "BDF" },        // 'W'
+    { "HKLN", "BCEFG" },        // 'X'
+    { "HKM", "BCDFG" },         // 'Y'
+    { "ADKL", "ABDEG" },        // 'Z'
+    { "ADEF", "ADEF" },         // '['
+    { "HN", "CFG" },            // '\\'
+    { "ABCD", "ABCD" },         // ']'
+    { "LN", "ABF" },            // '^'
+    { "D", "D" },               // '_'
+    { "H", "F" },               // '`'
+    { "DEGM", "ABCDEG" },       // 'a'
+    { "DEFGN", "CDEFG" },       // 'b'
+    { "DEGI", "DEG" },          // 'c'
+    { "BCDIL", "BCDEG" },       // 'd'
+    { "DEGL", "ABDEFG" },       // 'e'
+    { "AEFG", "AEFG" },         // 'f'
+    { "BCDIK", "ABCDFG" },      // 'g'
+    { "EFGM", "CEFG" },         // 'h'
+    { "M", "E" },               // 'i'
+    { "BCD", "CD" },            // 'j'
+    { "JKMN", "ACEFG" },        // 'k'
+    { "EF", "EF" },             // 'l'
+    { "CEGIM", "CE" },          // 'm'
+    { "EGM", "CEG" },           // 'n'
+    { "CDEGI", "CDEG" },        // 'o'
+    { "EFGH", "ABEFG" },        // 'p'
+    { "BCIK", "ABCFG" },        // 'q'
+    { "EG", "EG" },             // 'r'
+    { "DIN", "ACDFG" },         // 's'
+    { "DEFG", "DEFG" },         // 't'
+    { "CDE", "CDE" },           // 'u'
+    { "EL", "CDE" },            // 'v'
+    { "CELN", "CE" },           // 'w'
+    { "GILN", "BCEFG" },        // 'x'
+    { "BCDIJ", "BCDFG" },       // 'y'
+    { "DGL", "ABDEG" },         // 'z'
+    { "ADEFG", "ADEF" },        // '{'
+    { "JM", "EF" },             // '|'
+    { "ABCDI", "ABCD" },        // '}'
+    { "FHK", "A" },             // '~'
+};
+
+static_assert(sizeof(font_glyphs) / sizeof(font_glyphs[0]) == '~' - ' ' + 1, "one glyph per printable character");
+
+// Bit for each named segment, by position in the string, ? for none.
+// 16 segment A and D are handled separately.
+static constexpr const char font_order7[] = "ABCDEFGP";
+static constexpr const char font_order14[] = "ABCDEFGIHJKLMNP";
+static constexpr const char font_order16[] = "??BC??EFGIHJKLMN";
+
+static constexpr uint16_t font_segment_bit(const char *order, char name)
+{
+    for (int i = 0; order[i]; ++i)
+    {
+        if (order[i] == name)
+        {
+            return 1 << i;
+        }
+    }
+    return 0;
+}
+
+template <int SEGMENTS>
+static constexpr uint16_t font_segments(const char *names)
+{
+    uint16_t bits = 0;
+    for (int i = 0; names[i]; ++i)
+    {
+        char n = names[i];
+        if (SEGMENTS == 7)
+        {
+            bits |= font_segment_bit(font_order7, n == 'I' ? 'G' : n);
+        }
+        else if (SEGMENTS == 14)
+        {
+            bits |= font_segment_bit(font_order14, n);
+        }
+        else if (n == 'A')
+        {
+            bits |= 0x3;
+        }
+        else if (n == 'D')
+        {
+            bits |= 0x30;
+        }
+        else if (n == 'P')
+        {
+            // No decimal point, a full stop uses the right half of the bottom
+            bits |= 0x20;
+        }
+        else
+        {
+            bits |= font_segment_bit(font_order16, n);
+        }
+    }
+    return bits;
+}
+
+struct FONT_TABLE_T
+{
+    uint16_t glyphs[128];
+};
+
+template <int SEGMENTS>
+static constexpr FONT_TABLE_T font_make_table()
+{
+    FONT_TABLE_T table = {};
+    for (int c = ' '; c <= '~'; ++c)
+    {
+        const FONT_GLYPH_T &g = font_glyphs[c - ' '];
+        table.glyphs[c] = font_segments<SEGMENTS>(SEGMENTS == 7 ? g.seg7 : g.seg14);
+    }
+    return table;
+}
+
+template <int SEGMENTS>
+struct FONT_T
+{
+    static_assert(SEGMENTS == 7 || SEGMENTS == 14 || SEGMENTS == 16, "fonts are 7, 14 or 16 segment");
+
+    static constexpr FONT_TABLE_T table = font_make_table<SEGMENTS>();
+    // Zero where the display has no decimal point, a 16 segment digit has
+    // used all 16 bits of its row
+    static constexpr uint16_t decimal_point = SEGMENTS == 16 ? 0 : font_segments<SEGMENTS>("P");
+
+    static constexpr uint16_t glyph(char ch)
+    {
+        return (unsigned char)ch < 128 ? table.glyphs[(unsigned char)ch] : 0;
+    }
+
+    // Fill up to max positions from str, returning how many were used. A
+    // '.' after a character lights that position's decimal point rather
+    // than taking one of its own.
+    static int render(const char *str, uint16_t *out, int max)
+    {
+        int n = 0;
+        for (; *str; ++str)
+        {
+            if (*str == '.' && decimal_point != 0 && n > 0 && (out[n - 1] & decimal_point) == 0)
+            {
+                out[n - 1] |= decimal_point;
+                continue;
+            }
+            if (n == max)
+            {
+                break;
+            }
+            out[n++] = glyph(*str);
+        }
+        return n;
+    }
+};
+
+// The tables match the patterns the clock always used
+static_assert(FONT_T<7>::glyph('2') == 0x5b && FONT_T<7>::glyph('-') == 0x40, "7 segment font");
+static_assert(FONT_T<14>::glyph('A') == 0xf7 && FONT_T<14>::glyph('W') == 0x2836, "14 segment font");
+static_assert(FONT_T<16>::glyph('A') == 0x3cf && FONT_T<16>::decimal_point == 0, "16 segment font");
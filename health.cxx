@@ -0,0 +1,214 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/watchdog.h"
+
+#include "health.h"
+
+#define HEALTH_MAX_TASKS 8
+#define HEALTH_MAX_NAME 16
+#define HEALTH_MAGIC 0x4ea17400
+// Widest the parts of the JSON can be, the text around the list with the
+// last stall and each heartbeat with every number at its widest
+#define HEALTH_JSON_FIXED 192
+#define HEALTH_JSON_PER_TASK (HEALTH_MAX_NAME + 48)
+
+static_assert(HEALTH_JSON_FIXED + HEALTH_MAX_TASKS * HEALTH_JSON_PER_TASK <= HEALTH_JSON_MAX,
+    "HEALTH_JSON_MAX is too small");
+
+struct HEALTH_TASK_T
+{
+    const char *name;
+    uint32_t deadline_us;
+    // time_us_32() of the last beat, a single word so either core can write it
+    volatile uint32_t last_us;
+    volatile bool enabled;
+    // Longest gap seen between beats
+    uint32_t max_gap_us;
+};
+
+// Kept in RAM that is not cleared at startup, and left alone on a normal
+// boot so the last stall stays readable until there is a new one
+struct HEALTH_RECORD_T
+{
+    uint32_t magic;
+    char task[HEALTH_MAX_NAME];
+    uint32_t stall_ms;
+    uint32_t uptime_s;
+    // Stalls recorded since the record was first written
+    uint32_t stalls;
+    // Set when a stall has been recorded and the watchdog is due to fire
+    uint32_t pending;
+    uint32_t checksum;
+};
+
+static HEALTH_TASK_T tasks[HEALTH_MAX_TASKS];
+static int task_count;
+static HEALTH_RECORD_T __uninitialized_ram(record);
+static bool stalled;
+
+static uint32_t record_checksum(const HEALTH_RECORD_T *r)
+{
+    const uint32_t *words = (const uint32_t *)r;
+    uint32_t sum = 2166136261u;
+    for (size_t i = 0; i < offsetof(HEALTH_RECORD_T, checksum) / sizeof(uint32_t); ++i)
+    {
+        sum = (sum ^ words[i]) * 16777619u;
+    }
+    return sum;
+}
+
+static bool record_valid()
+{
+    return record.magic == HEALTH_MAGIC && record.checksum == record_checksum(&record);
+}
+
+static void write_record(const char *task, uint32_t stall_ms, bool pending)
+{
+    uint32_t stalls = record_valid() ? record.stalls : 0;
+    memset(&record, 0, sizeof(record));
+    record.magic = HEALTH_MAGIC;
+    strncpy(record.task, task, sizeof(record.task) - 1);
+    record.stall_ms = stall_ms;
+    record.uptime_s = (uint32_t)(time_us_64() / 1000000);
+    record.stalls = stalls + 1;
+    record.pending = pending;
+    record.checksum = record_checksum(&record);
+}
+
+void health_init()
+{
+    if (watchdog_enable_caused_reboot())
+    {
+        if (!record_valid() || !record.pending)
+        {
+            // Nothing was written, so nothing got as far as checking
+            write_record("main loop", 0, false);
+        }
+        else
+        {
+            record.pending = false;
+            record.checksum = record_checksum(&record);
+        }
+    }
+    else if (record_valid() && record.pending)
+    {
+        // Recorded, then reset some other way before the watchdog fired
+        record.pending = false;
+        record.checksum = record_checksum(&record);
+    }
+    if (record_valid())
+    {
+        printf("last stall: %s for %lu ms after %lu s, %lu stalls\n", record.task, (unsigned long)record.stall_ms,
+            (unsigned long)record.uptime_s, (unsigned long)record.stalls);
+    }
+}
+
+int health_register(const char *name, uint32_t deadline_ms)
+{
+    if (task_count == HEALTH_MAX_TASKS)
+    {
+        printf("no room for heartbeat %s\n", name);
+        return -1;
+    }
+    // The name goes in the stall record and the JSON
+    if (strlen(name) >= HEALTH_MAX_NAME)
+    {
+        printf("heartbeat name %s is too long\n", name);
+        return -1;
+    }
+    HEALTH_TASK_T *task = &tasks[task_count];
+    task->name = name;
+    task->deadline_us = deadline_ms * 1000;
+    task->last_us = time_us_32();
+    task->enabled = true;
+    return task_count++;
+}
+
+void health_beat(int id)
+{
+    if (id >= 0 && id < task_count)
+    {
+        tasks[id].last_us = time_us_32();
+    }
+}
+
+void health_set_enabled(int id, bool enabled)
+{
+    if (id >= 0 && id < task_count)
+    {
+        tasks[id].last_us = time_us_32();
+        tasks[id].enabled = enabled;
+    }
+}
+
+bool health_feed()
+{
+    if (stalled)
+    {
+        return false;
+    }
+    uint32_t now = time_us_32();
+    for (int i = 0; i < task_count; ++i)
+    {
+        HEALTH_TASK_T *task = &tasks[i];
+        if (!task->enabled)
+        {
+            continue;
+        }
+        uint32_t gap = now - task->last_us;
+        if (gap > task->max_gap_us && (int32_t)gap >= 0)
+        {
+            task->max_gap_us = gap;
+        }
+        if ((int32_t)gap > (int32_t)task->deadline_us)
+        {
+            stalled = true;
+            write_record(task->name, gap / 1000, true);
+            printf("%s has stalled for %lu ms, letting the watchdog fire\n", task->name, (unsigned long)(gap / 1000));
+            return false;
+        }
+    }
+    watchdog_update();
+    return true;
+}
+
+int health_get_json(char *buf, size_t len)
+{
+    uint32_t now = time_us_32();
+    size_t off = snprintf(buf, len, "{\"cols\":[\"task\",\"enabled\",\"deadline_ms\",\"age_ms\",\"max_gap_ms\"],\"tasks\":[");
+    for (int i = 0; i < task_count && off < len; ++i)
+    {
+        const HEALTH_TASK_T *task = &tasks[i];
+        off += snprintf(buf + off, len - off, "%s[\"%s\",%s,%lu,%lu,%lu]", i > 0 ? "," : "", task->name,
+            task->enabled ? "true" : "false", (unsigned long)(task->deadline_us / 1000),
+            (unsigned long)((now - task->last_us) / 1000), (unsigned long)(task->max_gap_us / 1000));
+    }
+    if (off < len)
+    {
+        if (record_valid())
+        {
+            off += snprintf(buf + off, len - off, "],\"last_stall\":{\"task\":\"%s\",\"stall_ms\":%lu,\"uptime_s\":%lu,\"stalls\":%lu}}\n",
+                record.task, (unsigned long)record.stall_ms, (unsigned long)record.uptime_s, (unsigned long)record.stalls);
+        }
+        else
+        {
+            off += snprintf(buf + off, len - off, "],\"last_stall\":null}\n");
+        }
+    }
+    return off < len ? (int)off : -1;
+}
+
+void health_print_stats()
+{
+    uint32_t now = time_us_32();
+    for (int i = 0; i < task_count; ++i)
+    {
+        const HEALTH_TASK_T *task = &tasks[i];
+        printf("heartbeat %-8s %s age %lu ms max gap %lu ms deadline %lu ms\n", task->name,
+            task->enabled ? "on " : "off", (unsigned long)((now - task->last_us) / 1000),
+            (unsigned long)(task->max_gap_us / 1000), (unsigned long)(task->deadline_us / 1000));
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Health supervisor in front of the hardware watchdog. Each subsystem
+// registers a heartbeat with its own deadline and beats it as it makes
+// progress. The watchdog is only fed while every enabled heartbeat is within
+// its deadline. When one is missed, its name and how long it had stalled are
+// kept in RAM that survives the reset, and the watchdog is left to fire.
+// A reset from the watchdog with nothing recorded means the main loop
+// itself stopped feeding it.
+
+// Call once at startup, reports what stalled before the last reset
+extern void health_init();
+
+// Returns the id to beat, or -1 if the table is full. Only from core 0 and
+// before the heartbeat is used. Heartbeats start enabled.
+extern int health_register(const char *name, uint32_t deadline_ms);
+
+// Safe from either core and from interrupts
+extern void health_beat(int id);
+
+// A disabled heartbeat is not checked, enabling counts as a beat
+extern void health_set_enabled(int id, bool enabled);
+
+// Feed the watchdog if everything is healthy, otherwise record the stall.
+// Returns whether it was fed.
+extern bool health_feed();
+
+// Heartbeats and the last recorded stall as JSON, returns the length or -1
+// if it does not fit. A buffer of HEALTH_JSON_MAX always fits.
+#define HEALTH_JSON_MAX 768
+extern int health_get_json(char *buf, size_t len);
+
+extern void health_print_stats();
@@ -2,14 +2,51 @@
 
 #include <stdint.h>
 
+// Up to eight HT16K33s can share the bus, with the address set by the
+// solder jumpers on each backpack
+#define HT16K33_BASE_ADDR 0x70
+#define HT16K33_MAX_DISPLAYS 8
+
+struct HT16K33_T;
+
+// Sets up the bus, then add each display fitted
 void ht16k33_init();
-void ht16k33_display_string(const char *str);
-void ht16k33_scroll_string(const char *str, int interval_ms);
-void ht16k33_set_brightness(unsigned int bright);
-void ht16k33_set_blink(int blink);
-void ht16k33_set_display_on(bool on);
-void ht16k33_display_char(int position, char ch);
-void ht16k33_display_set(int position, uint16_t bin);
+// nullptr if the address is out of range or too many are fitted
+HT16K33_T *ht16k33_add(uint8_t addr);
+
+void ht16k33_display_string(HT16K33_T *d, const char *str);
+void ht16k33_set_brightness(HT16K33_T *d, unsigned int bright);
+void ht16k33_set_brightness_all(unsigned int bright);
+void ht16k33_set_blink(HT16K33_T *d, int blink);
+void ht16k33_set_display_on(HT16K33_T *d, bool on);
+void ht16k33_display_char(HT16K33_T *d, int position, char ch);
+void ht16k33_display_set(HT16K33_T *d, int position, uint16_t bin);
+// Segments that show ch
+uint16_t ht16k33_char_pattern(char ch);
+// Patterns for up to max positions of str with any '.' folded into the
+// position before, returns the number used
+int ht16k33_render_string(const char *str, uint16_t *patterns, int max);
+
+// The functions above change a copy of each display's state, this queues
+// whatever changed on all of them to go out in the background in one pass
+// over the bus. A display with a failed write gets everything again. False
+// if nothing was queued.
+bool ht16k33_commit();
+// True once the last commit has finished, with when and whether all of it
+// reached the displays
+bool ht16k33_get_commit_done(uint64_t *done_us, bool *ok);
 
+// Everything here, from ht16k33_init() on, must be called from one core
 
+struct HT16K33_STATS_T
+{
+    uint32_t transactions;
+    uint32_t bytes;
+    // Time the bus was busy, worked out from the byte count
+    uint32_t bus_us;
+    // Commits with a write that did not get through
+    uint32_t failed;
+};
 
+// Running totals since start up
+void ht16k33_get_stats(HT16K33_STATS_T *stats);
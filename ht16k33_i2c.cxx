@@ -9,7 +9,9 @@
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
 #include "pico/binary_info.h"
-#include <ctype.h>
+#include "font.h"
+#include "ht16k33.h"
+#include "i2c_async.h"
 
 /* Example code to drive a 4 digit 14 segment LED backpack using a HT16K33 I2C
    driver chip
@@ -31,10 +33,9 @@
 // How many digits are on our display.
 #define NUM_DIGITS 4
 
-// By default these display drivers are on bus address 0x70. Often there are
-// solder on options on the PCB of the backpack to set an address between
-// 0x70 and 0x77 to allow multiple devices to be used.
-static const int I2C_addr = 0x70;
+#define I2C_BAUD (400 * 1000)
+// The chip has 8 rows of 16 bits of display RAM
+#define HT16K33_RAM_SIZE 16
 
 // commands
 
@@ -54,105 +55,345 @@ static const int I2C_addr = 0x70;
 #define HT16K33_BLINK_1HZ       0x4
 #define HT16K33_BLINK_0p5HZ     0x6
 
-// Converts a character to the bit pattern needed to display the right segments.
-// These are pretty standard for 14segment LED's
+// The clock uses the 7 segment backpack, digits 0, 1, 3 and 4 with the
+// colon at 2. Build with 14 or 16 for the alphanumeric ones.
+#ifndef HT16K33_SEGMENTS
+#define HT16K33_SEGMENTS 7
+#endif
+
+typedef FONT_T<HT16K33_SEGMENTS> HT16K33_FONT;
+
+// One HT16K33. Changes are made to a copy of the chip's state and sent by
+// ht16k33_commit().
+struct HT16K33_T
+{
+    uint8_t addr;
+    bool needs_init;
+    // Set from the I2C interrupt when a write to this display fails
+    volatile bool write_failed;
+    // Copy of the display RAM, bytes dirty_start to dirty_end - 1 need sending
+    uint8_t framebuffer[HT16K33_RAM_SIZE];
+    int dirty_start;
+    int dirty_end;
+    // Wanted register values, and the last ones sent or -1 if unknown
+    int brightness;
+    int sent_brightness;
+    int setup;
+    int sent_setup;
+};
 
-static const uint8_t nums[] = { 0x3F, 0x06, 0x5B, 0x4F, 0x66, 0x6D, 0x7D, 0x07, 0x7F, 0x6F, 0x77, 0x7C, 0x39, 0x5E, 0x79, 0x71 };
+static HT16K33_T displays[HT16K33_MAX_DISPLAYS];
+static int display_count;
+static HT16K33_STATS_T stats;
+// Set from the I2C interrupt when the last commit has gone, and whether
+// every write in it got through. A failure in the writes of an earlier
+// commit still going out counts against this one too.
+static volatile bool commit_done;
+static volatile bool commit_ok;
+static volatile bool commit_failed;
+static volatile uint64_t commit_done_us;
 
-static uint16_t char_to_pattern(char ch) {
-// Map, "A" to "Z"
-static const int16_t alpha[] = {
-    0xF7,0x128F,0x39,0x120F,0xF9,0xF1,0xBD,0xF6,0x1209,0x1E,0x2470,0x38,0x536,0x2136,
-    0x3F,0xF3,0x203F,0x20F3,0x18D,0x1201,0x3E,0xC30,0x2836,0x2D00,0x1500,0xC09
-    };
+enum HT16K33_WRITE_KIND
+{
+    HT16K33_WRITE_RUN,
+    HT16K33_WRITE_ROW_INT,
+    HT16K33_WRITE_SETUP,
+    HT16K33_WRITE_BRIGHTNESS,
+    HT16K33_WRITE_RAM,
+};
 
-    if (ch == '-')
-        return 0x40;
+// The largest write is a whole display RAM after its start address
+struct HT16K33_WRITE_T
+{
+    uint8_t kind;
+    uint8_t addr;
+    uint8_t len;
+    uint8_t buf[HT16K33_RAM_SIZE + 1];
+};
 
-    if (isalpha(ch))
-        return alpha[toupper(ch) - 'A'];
-    
-    if (isdigit(ch))
-        return nums[ch - '0'];
-    
-    return 0;
+// Everything a display can need in one commit
+#define HT16K33_MAX_WRITES 5
+
+static void write_finished(bool ok, void *arg)
+{
+    if (!ok)
+    {
+        ((HT16K33_T *)arg)->write_failed = true;
+        commit_failed = true;
+    }
 }
 
-/* Quick helper function for single byte transfers */
-static void i2c_write_byte(uint8_t val)
+static void commit_finished(bool ok, void *arg)
 {
-#ifdef i2c_default
-    i2c_write_blocking(i2c_default, I2C_addr, &val, 1, false);
-#endif
+    write_finished(ok, arg);
+    commit_done_us = time_us_64();
+    commit_ok = !commit_failed;
+    if (!commit_ok)
+    {
+        ++stats.failed;
+    }
+    commit_done = true;
 }
 
+// Writes are queued and go out in the background, false if the queue is full
+static bool i2c_write(HT16K33_T *d, const HT16K33_WRITE_T *w, I2C_ASYNC_DONE_FN done)
+{
+    if (!i2c_async_write(w->addr, w->buf, w->len, done, d))
+    {
+        return false;
+    }
+    // Each byte and the address byte take 9 clocks, plus start and stop
+    ++stats.transactions;
+    stats.bytes += w->len;
+    stats.bus_us += ((w->len + 1) * 9 + 2) * 1000000 / I2C_BAUD;
+    return true;
+}
 
 void ht16k33_init()
 {
     // This example will use I2C0 on the default SDA and SCL pins (4, 5 on a Pico)
-    i2c_init(i2c_default, 100 * 1000);
-    gpio_set_function(PICO_DEFAULT_I2C_SDA_PIN, GPIO_FUNC_I2C);
-    gpio_set_function(PICO_DEFAULT_I2C_SCL_PIN, GPIO_FUNC_I2C);
-    gpio_pull_up(PICO_DEFAULT_I2C_SDA_PIN);
-    gpio_pull_up(PICO_DEFAULT_I2C_SCL_PIN);
+    i2c_async_init(i2c_default, PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN, I2C_BAUD);
     // Make the I2C pins available to picotool
     bi_decl(bi_2pins_with_func(PICO_DEFAULT_I2C_SDA_PIN, PICO_DEFAULT_I2C_SCL_PIN, GPIO_FUNC_I2C));
+}
 
-    i2c_write_byte(HT16K33_SYSTEM_RUN);
-    i2c_write_byte(HT16K33_SET_ROW_INT);
-    i2c_write_byte(HT16K33_DISPLAY_SETUP | HT16K33_DISPLAY_ON);
+HT16K33_T *ht16k33_add(uint8_t addr)
+{
+    if (addr < HT16K33_BASE_ADDR || addr >= HT16K33_BASE_ADDR + HT16K33_MAX_DISPLAYS)
+    {
+        return nullptr;
+    }
+    for (int i = 0; i < display_count; ++i)
+    {
+        if (displays[i].addr == addr)
+        {
+            return &displays[i];
+        }
+    }
+    if (display_count == HT16K33_MAX_DISPLAYS)
+    {
+        return nullptr;
+    }
+
+    // RAM contents are undefined at power up, everything goes in the
+    // first commit
+    HT16K33_T *d = &displays[display_count++];
+    memset(d, 0, sizeof(*d));
+    d->addr = addr;
+    d->needs_init = true;
+    d->dirty_start = 0;
+    d->dirty_end = HT16K33_RAM_SIZE;
+    d->brightness = 15;
+    d->sent_brightness = -1;
+    d->setup = HT16K33_DISPLAY_ON;
+    d->sent_setup = -1;
+    return d;
 }
 
-// Send a specific binary value to the specified digit
-void ht16k33_display_set(int position, uint16_t bin)
+// Set a specific binary value for the specified digit
+void ht16k33_display_set(HT16K33_T *d, int position, uint16_t bin)
 {
-    uint8_t buf[3];
-    buf[0] = position * 2;
-    buf[1] = bin & 0xff;
-    buf[2] = bin >> 8;
-#ifdef i2c_default
-    i2c_write_blocking(i2c_default, I2C_addr, buf, count_of(buf), false);
-#endif
+    int offset = position * 2;
+    if (offset < 0 || offset + 1 >= HT16K33_RAM_SIZE)
+    {
+        return;
+    }
+    uint8_t lo = bin & 0xff;
+    uint8_t hi = bin >> 8;
+    if (d->framebuffer[offset] == lo && d->framebuffer[offset + 1] == hi)
+    {
+        return;
+    }
+    d->framebuffer[offset] = lo;
+    d->framebuffer[offset + 1] = hi;
+    if (offset < d->dirty_start)
+    {
+        d->dirty_start = offset;
+    }
+    if (offset + 2 > d->dirty_end)
+    {
+        d->dirty_end = offset + 2;
+    }
 }
 
-void ht16k33_display_char(int position, char ch)
+// Work out what a display needs sending, each write is one transaction
+static int pending_writes(const HT16K33_T *d, HT16K33_WRITE_T *writes)
 {
-    ht16k33_display_set(position, char_to_pattern(ch));
+    int n = 0;
+    if (d->needs_init)
+    {
+        writes[n++] = { HT16K33_WRITE_RUN, d->addr, 1, { HT16K33_SYSTEM_RUN } };
+        writes[n++] = { HT16K33_WRITE_ROW_INT, d->addr, 1, { HT16K33_SET_ROW_INT } };
+    }
+    if (d->setup != d->sent_setup)
+    {
+        writes[n++] = { HT16K33_WRITE_SETUP, d->addr, 1, { (uint8_t)(HT16K33_DISPLAY_SETUP | d->setup) } };
+    }
+    if (d->brightness != d->sent_brightness)
+    {
+        writes[n++] = { HT16K33_WRITE_BRIGHTNESS, d->addr, 1, { (uint8_t)(HT16K33_BRIGHTNESS | d->brightness) } };
+    }
+    if (d->dirty_start < d->dirty_end)
+    {
+        HT16K33_WRITE_T *w = &writes[n++];
+        w->kind = HT16K33_WRITE_RAM;
+        w->addr = d->addr;
+        w->len = d->dirty_end - d->dirty_start + 1;
+        w->buf[0] = d->dirty_start;
+        memcpy(w->buf + 1, d->framebuffer + d->dirty_start, w->len - 1);
+    }
+    return n;
 }
-    
-void ht16k33_display_string(const char *str)
+
+// A write that failed may have left the chip in any state, so after one
+// everything is sent again, from the start up commands on
+static void resend_if_failed(HT16K33_T *d)
 {
-    int digit = 0;
-    while (*str && digit <= NUM_DIGITS)
+    if (!d->write_failed)
     {
-        ht16k33_display_char(digit++, *str++);
+        return;
     }
+    d->write_failed = false;
+    d->needs_init = true;
+    d->dirty_start = 0;
+    d->dirty_end = HT16K33_RAM_SIZE;
+    d->sent_brightness = -1;
+    d->sent_setup = -1;
 }
 
-void ht16k33_scroll_string(const char *str, int interval_ms)
+// State is marked sent once its write is queued. If the write then fails,
+// resend_if_failed() puts it back at the next commit.
+static void mark_sent(HT16K33_T *d, const HT16K33_WRITE_T *w)
 {
-    int l = strlen(str);
+    switch (w->kind)
+    {
+        case HT16K33_WRITE_ROW_INT:
+            d->needs_init = false;
+            break;
+        case HT16K33_WRITE_SETUP:
+            d->sent_setup = d->setup;
+            break;
+        case HT16K33_WRITE_BRIGHTNESS:
+            d->sent_brightness = d->brightness;
+            break;
+        case HT16K33_WRITE_RAM:
+            d->dirty_start = HT16K33_RAM_SIZE;
+            d->dirty_end = 0;
+            break;
+        default:
+            break;
+    }
+}
 
-    if (l <= NUM_DIGITS)
+// Queue everything that changed on every display as one run of writes. The
+// I2C interrupt starts each write as the one before finishes, so the bus
+// goes straight through them without the CPU.
+bool ht16k33_commit()
+{
+    i2c_async_poll();
+    for (int i = 0; i < display_count; ++i)
     {
-        ht16k33_display_string(str);
+        resend_if_failed(&displays[i]);
     }
-    else
+
+    // Count first so the last write of the run can say when the frame is
+    // out. Only what fits in the queue goes now, the rest stays pending for
+    // the next commit.
+    HT16K33_WRITE_T writes[HT16K33_MAX_WRITES];
+    int total = 0;
+    for (int i = 0; i < display_count; ++i)
     {
-        for (int i = 0; i < l - NUM_DIGITS + 1; i++)
+        total += pending_writes(&displays[i], writes);
+    }
+    int space = i2c_async_space();
+    if (total > space)
+    {
+        total = space;
+    }
+    if (total <= 0)
+    {
+        return false;
+    }
+
+    commit_done = false;
+    commit_failed = false;
+    int queued = 0;
+    for (int i = 0; i < display_count; ++i)
+    {
+        HT16K33_T *d = &displays[i];
+        int n = pending_writes(d, writes);
+        for (int k = 0; k < n && queued < total; ++k)
         {
-            ht16k33_display_string(&str[i]);
-            sleep_ms(interval_ms);
+            if (!i2c_write(d, &writes[k], queued + 1 == total ? commit_finished : write_finished))
+            {
+                // The room was checked above, only a write the bus refuses
+                // outright gets here
+                return queued > 0;
+            }
+            mark_sent(d, &writes[k]);
+            ++queued;
         }
     }
+    return true;
+}
+
+bool ht16k33_get_commit_done(uint64_t *done_us, bool *ok)
+{
+    if (!commit_done)
+    {
+        return false;
+    }
+    *done_us = commit_done_us;
+    *ok = commit_ok;
+    return true;
+}
+
+void ht16k33_get_stats(HT16K33_STATS_T *s)
+{
+    *s = stats;
+}
+
+uint16_t ht16k33_char_pattern(char ch)
+{
+    return HT16K33_FONT::glyph(ch);
+}
+
+int ht16k33_render_string(const char *str, uint16_t *patterns, int max)
+{
+    return HT16K33_FONT::render(str, patterns, max);
+}
+
+void ht16k33_display_char(HT16K33_T *d, int position, char ch)
+{
+    ht16k33_display_set(d, position, HT16K33_FONT::glyph(ch));
+}
+
+void ht16k33_display_string(HT16K33_T *d, const char *str)
+{
+    uint16_t patterns[NUM_DIGITS + 1];
+    int n = HT16K33_FONT::render(str, patterns, NUM_DIGITS + 1);
+    for (int digit = 0; digit < n; ++digit)
+    {
+        ht16k33_display_set(d, digit, patterns[digit]);
+    }
 }
 
-void ht16k33_set_brightness(unsigned int bright)
+void ht16k33_set_brightness(HT16K33_T *d, unsigned int bright)
 {
-    i2c_write_byte(HT16K33_BRIGHTNESS | (bright <= 15 ? bright : 15));
+    d->brightness = bright <= 15 ? bright : 15;
+}
+
+// The HT16K33 has no broadcast address, but the writes all go out in the
+// same pass at the next commit
+void ht16k33_set_brightness_all(unsigned int bright)
+{
+    for (int i = 0; i < display_count; ++i)
+    {
+        ht16k33_set_brightness(&displays[i], bright);
+    }
 }
 
-void ht16k33_set_blink(int blink)
+void ht16k33_set_blink(HT16K33_T *d, int blink)
 {
     int s = 0;
     switch (blink)
@@ -163,10 +404,10 @@ void ht16k33_set_blink(int blink)
         case 3: s = HT16K33_BLINK_0p5HZ; break;
     }
 
-    i2c_write_byte(HT16K33_DISPLAY_SETUP | HT16K33_DISPLAY_ON | s);
+    d->setup = HT16K33_DISPLAY_ON | s;
 }
 
-void ht16k33_set_display_on(bool on)
+void ht16k33_set_display_on(HT16K33_T *d, bool on)
 {
-    i2c_write_byte(HT16K33_DISPLAY_SETUP | (on ? HT16K33_DISPLAY_ON : HT16K33_DISPLAY_OFF));
+    d->setup = on ? HT16K33_DISPLAY_ON : HT16K33_DISPLAY_OFF;
 }
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/dma.h"
+#include "hardware/gpio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#include "i2c_async.h"
+
+#define I2C_ASYNC_QUEUE_LEN 32
+// A write that has not finished after this long has hung the bus, far longer
+// than the largest write takes even at 100 kHz
+#define I2C_ASYNC_TIMEOUT_US 10000
+// Half an SCL period at 100 kHz for the recovery bit banging
+#define I2C_RECOVER_HALF_US 5
+// A stuck target lets go of SDA after at most 9 clocks
+#define I2C_RECOVER_CLOCKS 9
+
+// Writes are held as IC_DATA_CMD words so DMA can feed them straight to the
+// FIFO, the last one carries the stop bit
+struct I2C_ASYNC_WRITE_T
+{
+    uint16_t cmds[I2C_ASYNC_MAX_LEN];
+    uint8_t len;
+    uint8_t addr;
+    I2C_ASYNC_DONE_FN done;
+    void *arg;
+};
+
+static i2c_inst_t *bus;
+static unsigned sda_pin;
+static unsigned scl_pin;
+static unsigned bus_baud;
+static int dma_chan = -1;
+
+// Shared with the interrupt, only changed with interrupts off
+static I2C_ASYNC_WRITE_T queue[I2C_ASYNC_QUEUE_LEN];
+static volatile uint32_t queue_head;
+static volatile uint32_t queue_tail;
+static volatile bool active;
+static volatile bool failed;
+static int current_addr = -1;
+static uint64_t started_us;
+static I2C_ASYNC_STATS_T stats;
+
+static void setup_bus()
+{
+    i2c_init(bus, bus_baud);
+    gpio_set_function(sda_pin, GPIO_FUNC_I2C);
+    gpio_set_function(scl_pin, GPIO_FUNC_I2C);
+    gpio_pull_up(sda_pin);
+    gpio_pull_up(scl_pin);
+
+    i2c_hw_t *hw = i2c_get_hw(bus);
+    hw->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS;
+    hw->intr_mask = I2C_IC_INTR_MASK_M_STOP_DET_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS;
+    current_addr = -1;
+}
+
+// Pins are driven open drain by switching between input and output low
+static void release_pin(unsigned pin)
+{
+    gpio_set_dir(pin, GPIO_IN);
+    busy_wait_us_32(I2C_RECOVER_HALF_US);
+}
+
+static void pull_pin(unsigned pin)
+{
+    gpio_set_dir(pin, GPIO_OUT);
+    busy_wait_us_32(I2C_RECOVER_HALF_US);
+}
+
+// A target that lost track part way through a byte can hold SDA low for
+// good. Clock SCL until it lets go, then send a stop to reset everyone.
+static void recover_bus()
+{
+    ++stats.recoveries;
+    i2c_deinit(bus);
+    gpio_init(sda_pin);
+    gpio_init(scl_pin);
+    gpio_put(sda_pin, false);
+    gpio_put(scl_pin, false);
+    release_pin(sda_pin);
+    release_pin(scl_pin);
+
+    for (int i = 0; i < I2C_RECOVER_CLOCKS && !gpio_get(sda_pin); ++i)
+    {
+        pull_pin(scl_pin);
+        release_pin(scl_pin);
+    }
+    pull_pin(scl_pin);
+    pull_pin(sda_pin);
+    release_pin(scl_pin);
+    release_pin(sda_pin);
+
+    setup_bus();
+}
+
+// Called with interrupts off
+static void start_next()
+{
+    if (queue_head == queue_tail)
+    {
+        active = false;
+        return;
+    }
+    I2C_ASYNC_WRITE_T *w = &queue[queue_head % I2C_ASYNC_QUEUE_LEN];
+    i2c_hw_t *hw = i2c_get_hw(bus);
+    if (w->addr != current_addr)
+    {
+        // The target address can only be changed with the block disabled
+        hw->enable = 0;
+        hw->tar = w->addr;
+        hw->enable = 1;
+        current_addr = w->addr;
+    }
+    active = true;
+    failed = false;
+    started_us = time_us_64();
+
+    dma_channel_config c = dma_channel_get_default_config(dma_chan);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_16);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, i2c_get_dreq(bus, true));
+    dma_channel_configure(dma_chan, &c, &hw->data_cmd, w->cmds, w->len, true);
+}
+
+// Called with interrupts off
+static void finish(bool ok)
+{
+    I2C_ASYNC_WRITE_T *w = &queue[queue_head % I2C_ASYNC_QUEUE_LEN];
+    if (ok)
+    {
+        ++stats.transactions;
+        stats.bytes += w->len;
+    }
+    I2C_ASYNC_DONE_FN done = w->done;
+    void *arg = w->arg;
+    ++queue_head;
+    if (done != nullptr)
+    {
+        done(ok, arg);
+    }
+    start_next();
+}
+
+static void i2c_async_irq()
+{
+    i2c_hw_t *hw = i2c_get_hw(bus);
+    uint32_t status = hw->intr_stat;
+    if (status & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
+    {
+        // The FIFO stays flushed until the abort is cleared, so stop the DMA
+        // first. A stop follows the abort and finishes the write.
+        dma_channel_abort(dma_chan);
+        (void)hw->clr_tx_abrt;
+        ++stats.aborts;
+        failed = true;
+    }
+    if (status & I2C_IC_INTR_STAT_R_STOP_DET_BITS)
+    {
+        (void)hw->clr_stop_det;
+        if (active)
+        {
+            finish(!failed);
+        }
+    }
+}
+
+bool i2c_async_init(i2c_inst_t *i2c, unsigned sda, unsigned scl, unsigned baud)
+{
+    bus = i2c;
+    sda_pin = sda;
+    scl_pin = scl;
+    bus_baud = baud;
+
+    dma_chan = dma_claim_unused_channel(false);
+    if (dma_chan < 0)
+    {
+        printf("no dma channel for i2c\n");
+        return false;
+    }
+
+    // Whatever was going on before a reset may have left the bus stuck
+    gpio_init(sda_pin);
+    gpio_pull_up(sda_pin);
+    busy_wait_us_32(I2C_RECOVER_HALF_US);
+    if (!gpio_get(sda_pin))
+    {
+        recover_bus();
+    }
+    else
+    {
+        setup_bus();
+    }
+
+    // The handler goes on the calling core, which must then be the only user
+    unsigned irq = i2c_hw_index(bus) == 0 ? I2C0_IRQ : I2C1_IRQ;
+    irq_set_exclusive_handler(irq, i2c_async_irq);
+    irq_set_enabled(irq, true);
+    return true;
+}
+
+bool i2c_async_write(uint8_t addr, const uint8_t *data, size_t len, I2C_ASYNC_DONE_FN done, void *arg)
+{
+    if (len == 0 || len > I2C_ASYNC_MAX_LEN || dma_chan < 0)
+    {
+        return false;
+    }
+
+    uint32_t irq = save_and_disable_interrupts();
+    if (queue_tail - queue_head >= I2C_ASYNC_QUEUE_LEN)
+    {
+        ++stats.overflows;
+        restore_interrupts(irq);
+        return false;
+    }
+    I2C_ASYNC_WRITE_T *w = &queue[queue_tail % I2C_ASYNC_QUEUE_LEN];
+    for (size_t i = 0; i < len; ++i)
+    {
+        w->cmds[i] = data[i];
+    }
+    w->cmds[len - 1] |= I2C_IC_DATA_CMD_STOP_BITS;
+    w->len = len;
+    w->addr = addr;
+    w->done = done;
+    w->arg = arg;
+    ++queue_tail;
+    if (!active)
+    {
+        start_next();
+    }
+    restore_interrupts(irq);
+    return true;
+}
+
+bool i2c_async_busy()
+{
+    return active || queue_head != queue_tail;
+}
+
+int i2c_async_space()
+{
+    if (dma_chan < 0)
+    {
+        return 0;
+    }
+    return I2C_ASYNC_QUEUE_LEN - (int)(queue_tail - queue_head);
+}
+
+void i2c_async_poll()
+{
+    uint32_t irq = save_and_disable_interrupts();
+    if (active && time_us_64() - started_us > I2C_ASYNC_TIMEOUT_US)
+    {
+        ++stats.timeouts;
+        dma_channel_abort(dma_chan);
+        recover_bus();
+        finish(false);
+    }
+    restore_interrupts(irq);
+}
+
+bool i2c_async_retune()
+{
+    uint32_t irq = save_and_disable_interrupts();
+    bool idle = !active && queue_head == queue_tail;
+    if (idle)
+    {
+        i2c_set_baudrate(bus, bus_baud);
+    }
+    restore_interrupts(irq);
+    return idle;
+}
+
+void i2c_async_get_stats(I2C_ASYNC_STATS_T *s)
+{
+    *s = stats;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hardware/i2c.h"
+
+// Interrupt driven I2C writes. Each write is queued, then fed to the I2C
+// FIFO by DMA, and completion is reported from the I2C interrupt so the CPU
+// only spends a few microseconds per transaction. Must be used from a
+// single core, the one that called i2c_async_init().
+
+#define I2C_ASYNC_MAX_LEN 24
+
+typedef void (*I2C_ASYNC_DONE_FN)(bool ok, void *arg);
+
+struct I2C_ASYNC_STATS_T
+{
+    uint32_t transactions;
+    uint32_t bytes;
+    // Writes the target did not acknowledge
+    uint32_t aborts;
+    // Writes that never finished, each followed by a bus recovery
+    uint32_t timeouts;
+    uint32_t recoveries;
+    // Writes refused because the queue was full
+    uint32_t overflows;
+};
+
+extern bool i2c_async_init(i2c_inst_t *i2c, unsigned sda, unsigned scl, unsigned baud);
+
+// Queue a write of up to I2C_ASYNC_MAX_LEN bytes, the data is copied. done
+// is called from the interrupt when it has gone, if it is not null.
+extern bool i2c_async_write(uint8_t addr, const uint8_t *data, size_t len, I2C_ASYNC_DONE_FN done, void *arg);
+
+extern bool i2c_async_busy();
+
+// How many more writes can be queued. Only the interrupt takes writes off
+// the queue, so there is at least this much room until the next write.
+extern int i2c_async_space();
+
+// Call now and again to catch a write that has hung and recover the bus
+extern void i2c_async_poll();
+
+// Set the divider for the baud rate again after the system clock has
+// changed. Does nothing and returns false while a write is going.
+extern bool i2c_async_retune();
+
+extern void i2c_async_get_stats(I2C_ASYNC_STATS_T *stats);
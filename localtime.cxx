@@ -1,11 +1,19 @@
 #include <stdlib.h>
+#include "pico/critical_section.h"
+#include "clock.h"
 #include "localtime.h"
 #include "preferences.h"
 #include "timegm.h"
 #include "zones.h"
-#include "hardware/rtc.h"
 
 static const char *zone = "";
+// The zone is changed from core 0 while core 1 converts times for the display
+static critical_section cs;
+
+extern void localtime_init()
+{
+    critical_section_init(&cs);
+}
 
 extern const char *localtime_get_zone_name()
 {
@@ -19,24 +27,24 @@ extern bool localtime_set_zone_name(const char *name)
     {
         return false;
     }
+    critical_section_enter_blocking(&cs);
     zone = micro_tz_db_get_safe_name(name);
     setenv("TZ", posix_str, 1);
     tzset();
+    critical_section_exit(&cs);
     return true;
 }
 
 extern bool localtime_get_time(struct tm *buf)
 {
-    datetime_t t;
-    rtc_get_datetime(&t);
-    buf->tm_mday = t.day;
-    buf->tm_mon = t.month - 1;
-    buf->tm_year = t.year - 1900;
-    buf->tm_hour = t.hour;
-    buf->tm_min = t.min;
-    buf->tm_sec = t.sec;
-    time_t tt = timegm(buf);
+    return localtime_get_time_at(clock_get_time(), buf);
+}
+
+extern bool localtime_get_time_at(time_t tt, struct tm *buf)
+{
+    critical_section_enter_blocking(&cs);
     localtime_r(&tt, buf);
-    return true;
+    critical_section_exit(&cs);
+    return clock_is_synced();
 }
 
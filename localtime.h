@@ -2,8 +2,13 @@
 
 #include <time.h>
 
+// Call before the display starts on core 1
+extern void localtime_init();
+
 extern const char *localtime_get_zone_name();
 extern bool localtime_set_zone_name(const char *name);
 
 extern bool localtime_get_time(struct tm *buf);
+// Same for a given time rather than now
+extern bool localtime_get_time_at(time_t tt, struct tm *buf);
 
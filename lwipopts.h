@@ -20,7 +20,12 @@
 #define MEMP_NUM_TCP_SEG            32
 #define MEMP_NUM_ARP_QUEUE          10
 #define PBUF_POOL_SIZE              24
+// NTP client and server, DNS cache, fleet, plus lwIP's own DNS and DHCP
+#define MEMP_NUM_UDP_PCB            8
 #define LWIP_ARP                    1
+// Room for dozens of SNTP clients on the LAN. A reply to a client that has
+// fallen out of the table is held while ARP runs, see sim/ntp_server_sim.cxx
+#define ARP_TABLE_SIZE              64
 #define LWIP_ETHERNET               1
 #define LWIP_ICMP                   1
 #define LWIP_RAW                    1
@@ -43,6 +48,7 @@
 #define LWIP_TCP                    1
 #define LWIP_UDP                    1
 #define LWIP_DNS                    1
+#define LWIP_IGMP                   1
 #define LWIP_TCP_KEEPALIVE          1
 #define LWIP_NETIF_TX_SINGLE_PBUF   1
 #define DHCP_DOES_ARP_CHECK         0
@@ -0,0 +1,736 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include "lwip/dns.h"
+#include "lwip/pbuf.h"
+#include "lwip/timeouts.h"
+#include "lwip/udp.h"
+
+#include "boot_timeline.h"
+#include "clock.h"
+#include "dns_cache.h"
+#include "ntp.h"
+#include "ntp_server.h"
+#include "ntp_select.h"
+#include "wifi_pm.h"
+#include "wifi_details.h"
+
+// Comma separated list of extra servers, names or addresses, that are always
+// queried in addition to the pool. Can be set in wifi_details.h.
+#ifndef NTP_LOCAL_SERVERS
+#define NTP_LOCAL_SERVERS ""
+#endif
+
+#define NTP_MSG_LEN 48
+#define NTP_PORT 123
+#define NTP_DELTA 2208988800 // seconds between 1 Jan 1900 and 1 Jan 1970
+// Retry time after a failed round, the normal poll interval comes from the clock discipline
+#define NTP_TEST_TIME (30 * 1000)
+// A request not answered within this is taken to be lost and is sent again
+#define NTP_REQUEST_TIMEOUT 500
+// Rounds are run from a timer with this period
+#define NTP_TICK_TIME 100
+// Upper limit on a round, covers slow DNS
+#define NTP_ROUND_TIME (3 * 1000)
+// A round still open this long after its end has lost its timer
+#define NTP_ROUND_STUCK_MS (2 * 1000)
+// Until the clock is synchronised each server gets a burst of requests and the
+// lowest delay reply is used
+#define NTP_BURST_COUNT 4
+#define NTP_BURST_SPACING (2 * 1000)
+#define NTP_BURST_ROUND_TIME (12 * 1000)
+// Extra requests allowed per round to cover lost packets
+#define NTP_RETRIES 2
+// Number of clock updates kept for the /ntp page
+#define NTP_HISTORY_SIZE 48
+#define NTP_MAX_SERVERS 6
+#define NTP_MAX_NAME 40
+// Widest the parts of the history JSON can be, with every number at its
+// widest: the text around the lists, each server and each sample
+#define NTP_JSON_FIXED 320
+#define NTP_JSON_PER_SERVER (NTP_MAX_NAME + 32)
+#define NTP_JSON_PER_SAMPLE 72
+#define NTP_FILTER_SIZE 8
+// Number of unanswered rounds after which a pool name is resolved again
+#define NTP_UNREACH_ROUNDS 4
+
+static const char *pool_servers[] = { "0.pool.ntp.org", "1.pool.ntp.org", "2.pool.ntp.org", "3.pool.ntp.org" };
+
+struct NTP_FILTER_T
+{
+    int64_t offset_us;
+    int64_t delay_us;
+    int64_t dispersion_us;
+    uint64_t local_us;
+};
+
+struct NTP_SERVER_T
+{
+    char name[NTP_MAX_NAME];
+    ip_addr_t address;
+    bool resolved;
+    bool dns_request_sent;
+    bool request_sent;
+    int attempts;
+    int replies;
+    uint8_t reach;
+    uint8_t stratum;
+    int64_t root_delay_us;
+    int64_t root_dispersion_us;
+    uint64_t request_local_us;
+    uint8_t request_stamp[8];
+    // The last few samples, the newest at filter_next - 1
+    NTP_FILTER_T filter[NTP_FILTER_SIZE];
+    int filter_count;
+    int filter_next;
+    // Lowest delay sample from the current round
+    NTP_FILTER_T sample;
+};
+
+struct NTP_HISTORY_T
+{
+    uint64_t local_us;
+    // Time error of the undisciplined crystal, true time - time_us_64()
+    int64_t raw_phase_us;
+    int32_t offset_us;
+    int32_t delay_us;
+    int32_t dispersion_us;
+    int32_t freq_ppb;
+    int8_t server;
+    int8_t poll;
+};
+
+struct NTP_T
+{
+    struct udp_pcb *ntp_pcb;
+    NTP_SERVER_T servers[NTP_MAX_SERVERS];
+    int server_count;
+    absolute_time_t ntp_test_time;
+    bool round_active;
+    bool burst;
+    absolute_time_t round_end_time;
+    uint64_t start_local_us;
+    NTP_HISTORY_T history[NTP_HISTORY_SIZE];
+    int history_count;
+    int history_next;
+    // What we pass on when serving time
+    NTP_REFERENCE_T reference;
+    bool reference_valid;
+};
+
+static NTP_T *state;
+static absolute_time_t last_ntp_result_time;
+
+// NTP timestamps are 32.32 fixed point seconds since 1900
+static int64_t ntp_to_utc_us(const uint8_t *buf)
+{
+    uint32_t seconds_since_1900 = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+    uint32_t fraction = buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7];
+    uint32_t seconds_since_1970 = seconds_since_1900 - NTP_DELTA;
+    return (int64_t)seconds_since_1970 * 1000000 + (int64_t)(((uint64_t)fraction * 1000000) >> 32);
+}
+
+static void utc_us_to_ntp(int64_t utc_us, uint8_t *buf)
+{
+    uint32_t seconds_since_1900 = (uint32_t)(utc_us / 1000000) + NTP_DELTA;
+    uint32_t fraction = (uint32_t)((((uint64_t)(utc_us % 1000000)) << 32) / 1000000);
+    buf[0] = seconds_since_1900 >> 24;
+    buf[1] = seconds_since_1900 >> 16;
+    buf[2] = seconds_since_1900 >> 8;
+    buf[3] = seconds_since_1900;
+    buf[4] = fraction >> 24;
+    buf[5] = fraction >> 16;
+    buf[6] = fraction >> 8;
+    buf[7] = fraction;
+}
+
+// Root delay and dispersion are 16.16 fixed point seconds
+static int64_t ntp_short_to_us(const uint8_t *buf)
+{
+    uint32_t v = buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+    return (int64_t)(((uint64_t)v * 1000000) >> 16);
+}
+
+static void add_server(const char *name, size_t len)
+{
+    if (state->server_count == NTP_MAX_SERVERS || len == 0 || len >= NTP_MAX_NAME)
+    {
+        return;
+    }
+    NTP_SERVER_T *server = &state->servers[state->server_count++];
+    memcpy(server->name, name, len);
+    server->name[len] = '\0';
+}
+
+// Make an NTP request, must be called with the lwIP lock held
+static void ntp_request(NTP_SERVER_T *server)
+{
+    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
+    if (p == nullptr)
+    {
+        return;
+    }
+    uint8_t *req = (uint8_t *) p->payload;
+    memset(req, 0, NTP_MSG_LEN);
+    req[0] = 0x1b;
+    // The server echoes our transmit timestamp back as the originate timestamp
+    server->request_local_us = time_us_64();
+    utc_us_to_ntp(clock_local_to_utc_us(server->request_local_us), server->request_stamp);
+    memcpy(req + 40, server->request_stamp, sizeof(server->request_stamp));
+    boot_begin(BOOT_NTP);
+    udp_sendto(state->ntp_pcb, p, &server->address, NTP_PORT);
+    pbuf_free(p);
+    server->request_sent = true;
+    ++server->attempts;
+}
+
+static bool ntp_round_step();
+
+// Call back with a DNS result
+static void ntp_dns_found(const char *hostname, const ip_addr_t *ipaddr, void *arg)
+{
+    NTP_SERVER_T *server = (NTP_SERVER_T *)arg;
+    server->dns_request_sent = false;
+    if (ipaddr)
+    {
+        server->address = *ipaddr;
+        server->resolved = true;
+        boot_end(BOOT_DNS);
+        printf("ntp address %s %s\n", hostname, ipaddr_ntoa(ipaddr));
+        if (state->round_active)
+        {
+            ntp_round_step();
+        }
+    }
+    else
+    {
+        printf("ntp dns request failed %s\n", hostname);
+    }
+}
+
+// Pick the lowest delay sample of the round and work out its root distance
+static bool server_candidate(const NTP_SERVER_T *server, NTP_CANDIDATE_T *candidate)
+{
+    if (server->replies == 0)
+    {
+        return false;
+    }
+
+    // Samples delayed more than the best recent one have suffered queuing
+    // somewhere, which bounds how asymmetric the path can have been
+    int64_t min_delay = server->sample.delay_us;
+    for (int i = 0; i < server->filter_count; ++i)
+    {
+        if (server->filter[i].delay_us < min_delay)
+        {
+            min_delay = server->filter[i].delay_us;
+        }
+    }
+    int64_t jitter_sq = 0;
+    for (int i = 0; i < server->filter_count; ++i)
+    {
+        int64_t excess = (server->filter[i].delay_us - min_delay) / 2;
+        jitter_sq += excess * excess;
+    }
+    int64_t jitter = server->filter_count > 0 ? (int64_t)sqrt((double)(jitter_sq / server->filter_count)) : 0;
+
+    candidate->offset_us = server->sample.offset_us;
+    candidate->distance_us = server->sample.delay_us / 2 + server->sample.dispersion_us + jitter;
+    candidate->truechimer = false;
+    return true;
+}
+
+// Select among the servers that have replied so far and update the clock.
+// Returns false if there is no agreement. Early updates, made before the
+// round ends to get an unsynchronised clock right quickly, also need
+// several servers to agree so one falseticker can not step the clock.
+static bool ntp_update_clock(bool early)
+{
+    NTP_CANDIDATE_T candidates[NTP_MAX_SERVERS];
+    NTP_SERVER_T *candidate_servers[NTP_MAX_SERVERS];
+    int n = 0;
+    for (int i = 0; i < state->server_count; ++i)
+    {
+        NTP_SERVER_T *server = &state->servers[i];
+        if (server_candidate(server, &candidates[n]))
+        {
+            candidate_servers[n++] = server;
+        }
+    }
+
+    int64_t offset_us;
+    int survivors = ntp_select(candidates, n, &offset_us);
+    if (early && survivors < NTP_SELECT_STEP_MIN)
+    {
+        return false;
+    }
+    if (survivors == 0)
+    {
+        printf("ntp selection failed, %d replies\n", n);
+        return false;
+    }
+
+    // Use the closest survivor as the reference for delay and sample time
+    int best = -1;
+    for (int i = 0; i < n; ++i)
+    {
+        if (candidates[i].truechimer)
+        {
+            if (best < 0 || candidates[i].distance_us < candidates[best].distance_us)
+            {
+                best = i;
+            }
+        }
+        else
+        {
+            printf("ntp falseticker %s offset %lld us\n", candidate_servers[i]->name, candidates[i].offset_us);
+        }
+    }
+    printf("ntp %d of %d servers agree\n", survivors, n);
+
+    bool first = !clock_is_synced();
+    NTP_SERVER_T *peer = candidate_servers[best];
+    NTP_HISTORY_T *h = &state->history[state->history_next];
+    h->local_us = peer->sample.local_us;
+    h->raw_phase_us = clock_local_to_utc_us(h->local_us) + offset_us - (int64_t)h->local_us;
+    h->offset_us = (int32_t)offset_us;
+    h->delay_us = (int32_t)peer->sample.delay_us;
+    h->dispersion_us = (int32_t)candidates[best].distance_us;
+    h->server = (int8_t)(peer - state->servers);
+
+    // The distance includes the filter jitter on top of the peer's own
+    // dispersion, pass that on along with the path delay
+    NTP_REFERENCE_T *ref = &state->reference;
+    ref->stratum = peer->stratum + 1;
+    ref->ref_id = lwip_ntohl(ip4_addr_get_u32(ip_2_ip4(&peer->address)));
+    ref->ref_local_us = peer->sample.local_us;
+    ref->root_delay_us = peer->root_delay_us + peer->sample.delay_us;
+    ref->root_dispersion_us = peer->root_dispersion_us +
+        candidates[best].distance_us - peer->sample.delay_us / 2 - peer->sample.dispersion_us;
+    state->reference_valid = true;
+
+    clock_update(offset_us, peer->sample.delay_us, peer->sample.local_us);
+    h->poll = (int8_t)clock_get_poll_exponent();
+    h->freq_ppb = clock_get_frequency_ppb();
+    state->history_next = (state->history_next + 1) % NTP_HISTORY_SIZE;
+    if (state->history_count < NTP_HISTORY_SIZE)
+    {
+        ++state->history_count;
+    }
+    last_ntp_result_time = get_absolute_time();
+    if (first)
+    {
+        printf("ntp first sync %llu ms after start\n", (time_us_64() - state->start_local_us) / 1000);
+        // The first update steps the clock so samples already taken this
+        // round are out by the same amount
+        for (int i = 0; i < state->server_count; ++i)
+        {
+            state->servers[i].sample.offset_us -= offset_us;
+        }
+    }
+    return true;
+}
+
+static void ntp_round_finished()
+{
+    state->round_active = false;
+    for (int i = 0; i < state->server_count; ++i)
+    {
+        NTP_SERVER_T *server = &state->servers[i];
+        server->reach <<= 1;
+        if (server->replies > 0)
+        {
+            server->reach |= 1;
+        }
+        else if ((server->reach & ((1 << NTP_UNREACH_ROUNDS) - 1)) == 0)
+        {
+            // Pool members come and go so look for another one
+            server->resolved = false;
+        }
+        server->request_sent = false;
+    }
+
+    if (ntp_update_clock(false))
+    {
+        state->ntp_test_time = make_timeout_time_ms(clock_get_poll_interval_ms());
+    }
+    else
+    {
+        state->ntp_test_time = make_timeout_time_ms(NTP_TEST_TIME);
+    }
+}
+
+// Send whatever requests are due and report whether the round has more to do
+static bool ntp_round_step()
+{
+    uint64_t now = time_us_64();
+    int wanted = state->burst ? NTP_BURST_COUNT : 1;
+    uint64_t spacing_us = state->burst ? NTP_BURST_SPACING * 1000 : 0;
+    bool busy = false;
+    for (int i = 0; i < state->server_count; ++i)
+    {
+        NTP_SERVER_T *server = &state->servers[i];
+        if (server->dns_request_sent)
+        {
+            busy = true;
+            continue;
+        }
+        if (!server->resolved || server->replies >= wanted)
+        {
+            continue;
+        }
+
+        bool lost = false;
+        if (server->request_sent)
+        {
+            if (now - server->request_local_us < NTP_REQUEST_TIMEOUT * 1000)
+            {
+                busy = true;
+                continue;
+            }
+            server->request_sent = false;
+            lost = true;
+        }
+
+        if (server->attempts >= wanted + NTP_RETRIES)
+        {
+            continue;
+        }
+        // Lost requests are sent again straight away, bursts are spaced out
+        if (server->attempts == 0 || lost || now - server->request_local_us >= spacing_us)
+        {
+            ntp_request(server);
+        }
+        busy = true;
+    }
+    return busy;
+}
+
+static void ntp_tick(void *arg)
+{
+    if (!state->round_active)
+    {
+        return;
+    }
+    if (ntp_round_step() && absolute_time_diff_us(get_absolute_time(), state->round_end_time) > 0)
+    {
+        sys_timeout(NTP_TICK_TIME, ntp_tick, nullptr);
+    }
+    else
+    {
+        ntp_round_finished();
+    }
+}
+
+// NTP data received
+static void ntp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    uint64_t receive_local_us = time_us_64();
+    wifi_pm_note_traffic(p->tot_len);
+    uint8_t mode = pbuf_get_at(p, 0) & 0x7;
+    uint8_t stratum = pbuf_get_at(p, 1);
+    uint8_t msg[NTP_MSG_LEN] = {0};
+    pbuf_copy_partial(p, msg, sizeof(msg), 0);
+
+    NTP_SERVER_T *server = nullptr;
+    for (int i = 0; i < state->server_count; ++i)
+    {
+        NTP_SERVER_T *s = &state->servers[i];
+        if (s->request_sent && ip_addr_cmp(addr, &s->address) &&
+            memcmp(msg + 24, s->request_stamp, sizeof(s->request_stamp)) == 0)
+        {
+            server = s;
+            break;
+        }
+    }
+
+    // Check the result
+    if (server != nullptr && port == NTP_PORT && p->tot_len == NTP_MSG_LEN && mode == 0x4 && stratum != 0)
+    {
+        // t1 request sent, t2 server received, t3 server replied, t4 reply received
+        int64_t t1 = clock_local_to_utc_us(server->request_local_us);
+        int64_t t2 = ntp_to_utc_us(msg + 32);
+        int64_t t3 = ntp_to_utc_us(msg + 40);
+        int64_t t4 = clock_local_to_utc_us(receive_local_us);
+        boot_end(BOOT_NTP);
+        NTP_FILTER_T *sample = &server->filter[server->filter_next];
+        sample->offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+        sample->delay_us = (t4 - t1) - (t3 - t2);
+        sample->dispersion_us = ntp_short_to_us(msg + 4) / 2 + ntp_short_to_us(msg + 8);
+        sample->local_us = receive_local_us;
+        server->filter_next = (server->filter_next + 1) % NTP_FILTER_SIZE;
+        if (server->filter_count < NTP_FILTER_SIZE)
+        {
+            ++server->filter_count;
+        }
+        if (server->replies == 0 || sample->delay_us < server->sample.delay_us)
+        {
+            server->sample = *sample;
+        }
+        server->stratum = stratum;
+        server->root_delay_us = ntp_short_to_us(msg + 4);
+        server->root_dispersion_us = ntp_short_to_us(msg + 8);
+        ++server->replies;
+        server->request_sent = false;
+
+        // Get the display right as soon as enough servers agree, the rest
+        // of the burst then refines it
+        if (!clock_is_synced())
+        {
+            ntp_update_clock(true);
+        }
+    }
+    else
+    {
+        printf("invalid ntp response\n");
+    }
+    pbuf_free(p);
+}
+
+// Must be called with the lwIP lock held, from the main loop
+static void ntp_start_round()
+{
+    state->round_active = true;
+    state->burst = !clock_is_synced();
+    uint32_t round_ms = state->burst ? NTP_BURST_ROUND_TIME : NTP_ROUND_TIME;
+    state->round_end_time = make_timeout_time_ms(round_ms);
+    // Power save would hold replies back at the access point and add to the
+    // measured delay
+    wifi_pm_hold(round_ms);
+    boot_begin(BOOT_DNS);
+    for (int i = 0; i < state->server_count; ++i)
+    {
+        NTP_SERVER_T *server = &state->servers[i];
+        server->replies = 0;
+        server->attempts = 0;
+        server->request_sent = false;
+        if (!server->resolved && !server->dns_request_sent)
+        {
+            server->dns_request_sent = true;
+            int err = dns_cache_resolve(server->name, &server->address, ntp_dns_found, server);
+            if (err == ERR_OK)
+            {
+                // Cached result or an address literal
+                server->dns_request_sent = false;
+                server->resolved = true;
+                boot_end(BOOT_DNS);
+            }
+            else if (err != ERR_INPROGRESS)
+            {
+                // ERR_INPROGRESS means expect a callback
+                server->dns_request_sent = false;
+                printf("dns request failed %s %d\n", server->name, err);
+            }
+        }
+    }
+    ntp_round_step();
+    sys_timeout(NTP_TICK_TIME, ntp_tick, nullptr);
+}
+
+// Perform initialisation
+bool ntp_init()
+{
+    if (state)
+    {
+        return true;
+    }
+    state = (NTP_T *)calloc(1, sizeof(NTP_T));
+    if (!state)
+    {
+        printf("failed to allocate state\n");
+        return false;
+    }
+    state->ntp_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (!state->ntp_pcb)
+    {
+        printf("failed to create pcb\n");
+        free(state);
+        state = nullptr;
+        return false;
+    }
+    udp_recv(state->ntp_pcb, ntp_recv, state);
+    cyw43_arch_lwip_begin();
+    bool dns_ok = dns_cache_init();
+    if (dns_ok && !ntp_server_init())
+    {
+        // Serving time to others is optional
+        printf("ntp server not started\n");
+    }
+    cyw43_arch_lwip_end();
+    if (!dns_ok)
+    {
+        udp_remove(state->ntp_pcb);
+        free(state);
+        state = nullptr;
+        return false;
+    }
+    state->start_local_us = time_us_64();
+
+    const char *local = NTP_LOCAL_SERVERS;
+    while (*local)
+    {
+        const char *end = strchr(local, ',');
+        size_t len = end ? end - local : strlen(local);
+        add_server(local, len);
+        local += end ? len + 1 : len;
+    }
+    for (size_t i = 0; i < count_of(pool_servers); ++i)
+    {
+        add_server(pool_servers[i], strlen(pool_servers[i]));
+    }
+    return true;
+}
+
+bool ntp_poll()
+{
+    if (!state)
+    {
+        return true;
+    }
+
+    // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
+    // You can omit them if you are in a callback from lwIP. Note that when using pico_cyw_arch_poll
+    // these calls are a no-op and can be omitted, but it is a good practice to use them in
+    // case you switch the cyw43_arch type later.
+    cyw43_arch_lwip_begin();
+    if (!state->round_active && absolute_time_diff_us(get_absolute_time(), state->ntp_test_time) < 0)
+    {
+        ntp_start_round();
+    }
+    bool stuck = state->round_active &&
+        absolute_time_diff_us(state->round_end_time, get_absolute_time()) > NTP_ROUND_STUCK_MS * 1000;
+    cyw43_arch_lwip_end();
+    return !stuck;
+}
+
+void ntp_poll_soon()
+{
+    if (state && !state->round_active)
+    {
+        state->ntp_test_time = get_absolute_time();
+    }
+}
+
+static const NTP_HISTORY_T *history_at(int i)
+{
+    return &state->history[(state->history_next - state->history_count + i + NTP_HISTORY_SIZE) % NTP_HISTORY_SIZE];
+}
+
+// Raw crystal phase at local time t, interpolated between the history samples
+static double phase_at(uint64_t t)
+{
+    for (int i = 1; i < state->history_count; ++i)
+    {
+        const NTP_HISTORY_T *a = history_at(i - 1);
+        const NTP_HISTORY_T *b = history_at(i);
+        if (t <= b->local_us && b->local_us > a->local_us)
+        {
+            double frac = (double)(t - a->local_us) / (double)(b->local_us - a->local_us);
+            return a->raw_phase_us + frac * (b->raw_phase_us - a->raw_phase_us);
+        }
+    }
+    return (double)history_at(state->history_count - 1)->raw_phase_us;
+}
+
+// Allan deviation of the undisciplined crystal from second differences of the
+// phase, resampled at the given tau since the history is not evenly spaced.
+// Returns a negative value if the history is too short.
+static double allan_deviation(uint32_t tau_s)
+{
+    if (state->history_count < 2)
+    {
+        return -1;
+    }
+    uint64_t tau_us = (uint64_t)tau_s * 1000000;
+    uint64_t start = history_at(0)->local_us;
+    uint64_t end = history_at(state->history_count - 1)->local_us;
+    double sum = 0;
+    int n = 0;
+    for (uint64_t t = start; t + 2 * tau_us <= end; t += tau_us)
+    {
+        double d = phase_at(t + 2 * tau_us) - 2 * phase_at(t + tau_us) + phase_at(t);
+        sum += d * d;
+        ++n;
+    }
+    if (n < 2)
+    {
+        return -1;
+    }
+    return sqrt(sum / (2.0 * n)) / (double)tau_us;
+}
+
+// Writes the history and some statistics derived from it as JSON
+static_assert(NTP_JSON_FIXED + NTP_MAX_SERVERS * NTP_JSON_PER_SERVER + NTP_HISTORY_SIZE * NTP_JSON_PER_SAMPLE <=
+    NTP_HISTORY_JSON_MAX, "NTP_HISTORY_JSON_MAX is too small");
+
+int ntp_get_history_json(char *buf, size_t len)
+{
+    static const uint32_t taus[] = { 64, 256, 1024, 4096 };
+    if (!state)
+    {
+        return snprintf(buf, len, "{}");
+    }
+
+    double sum_sq = 0;
+    for (int i = 0; i < state->history_count; ++i)
+    {
+        double o = history_at(i)->offset_us;
+        sum_sq += o * o;
+    }
+    double rms = state->history_count > 0 ? sqrt(sum_sq / state->history_count) : 0;
+    int64_t since = state->history_count > 0 ? (int64_t)(time_us_64() - history_at(state->history_count - 1)->local_us) / 1000000 : -1;
+
+    size_t off = snprintf(buf, len, "{\"since_s\":%lld,\"rms_offset_us\":%.0f,\"freq_ppb\":%ld,\"poll_s\":%lu,\"adev\":[",
+        since, rms, (long)clock_get_frequency_ppb(), clock_get_poll_interval_ms() / 1000);
+    for (size_t i = 0; i < count_of(taus) && off < len; ++i)
+    {
+        off += snprintf(buf + off, len - off, "%s[%lu,%.3g]", i > 0 ? "," : "", taus[i], allan_deviation(taus[i]));
+    }
+    if (off < len)
+    {
+        off += snprintf(buf + off, len - off, "],\"servers\":[");
+    }
+    for (int i = 0; i < state->server_count && off < len; ++i)
+    {
+        const NTP_SERVER_T *server = &state->servers[i];
+        off += snprintf(buf + off, len - off, "%s[\"%s\",\"%s\",%u,%u]", i > 0 ? "," : "",
+            server->name, server->resolved ? ipaddr_ntoa(&server->address) : "", server->stratum, server->reach);
+    }
+    if (off < len)
+    {
+        off += snprintf(buf + off, len - off, "],\"cols\":[\"age_s\",\"server\",\"offset_us\",\"delay_us\",\"disp_us\",\"poll\",\"freq_ppb\"],\"samples\":[");
+    }
+    uint64_t now = time_us_64();
+    for (int i = 0; i < state->history_count && off < len; ++i)
+    {
+        const NTP_HISTORY_T *h = history_at(i);
+        off += snprintf(buf + off, len - off, "%s[%lu,%d,%ld,%ld,%ld,%d,%ld]", i > 0 ? "," : "",
+            (unsigned long)((now - h->local_us) / 1000000), h->server, (long)h->offset_us, (long)h->delay_us,
+            (long)h->dispersion_us, h->poll, (long)h->freq_ppb);
+    }
+    if (off < len)
+    {
+        off += snprintf(buf + off, len - off, "]}\n");
+    }
+    return off < len ? (int)off : -1;
+}
+
+bool ntp_get_reference(NTP_REFERENCE_T *ref)
+{
+    if (!state || !state->reference_valid || !clock_is_synced())
+    {
+        return false;
+    }
+    *ref = state->reference;
+    return true;
+}
+
+absolute_time_t ntp_get_last_sync_time()
+{
+    return last_ntp_result_time;
+}
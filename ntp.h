@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include "pico/stdlib.h"
+
+// Multi server NTP client. Each poll round queries every configured server,
+// rejects falsetickers with an intersection algorithm and feeds the combined
+// offset of the survivors to the clock discipline.
+
+extern bool ntp_init();
+
+// Call regularly from the main loop, starts and times out poll rounds.
+// Returns false if a round has run well past its end, which means its
+// timer has stopped.
+extern bool ntp_poll();
+// Start a round on the next ntp_poll() rather than waiting out the poll
+// interval, must be called with the lwIP lock held
+extern void ntp_poll_soon();
+
+extern absolute_time_t ntp_get_last_sync_time();
+
+struct NTP_REFERENCE_T
+{
+    uint8_t stratum;
+    // IPv4 address of the selected server, host byte order
+    uint32_t ref_id;
+    // time_us_64() of the sample the clock was last updated from
+    uint64_t ref_local_us;
+    int64_t root_delay_us;
+    int64_t root_dispersion_us;
+};
+
+// Where our time comes from, for serving it on. Returns false until synced.
+// Must be called with the lwIP lock held.
+extern bool ntp_get_reference(NTP_REFERENCE_T *ref);
+
+// Recent sync history and statistics as JSON, returns the length or -1 if
+// it does not fit. A buffer of NTP_HISTORY_JSON_MAX always fits.
+#define NTP_HISTORY_JSON_MAX 4352
+extern int ntp_get_history_json(char *buf, size_t len);
@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include "ntp_select.h"
+
+#define NTP_MAX_CANDIDATES 8
+
+struct ENDPOINT_T
+{
+    int64_t value;
+    int type; // -1 lower, +1 upper
+};
+
+static int compare_endpoints(const void *a, const void *b)
+{
+    const ENDPOINT_T *ea = (const ENDPOINT_T *)a;
+    const ENDPOINT_T *eb = (const ENDPOINT_T *)b;
+    if (ea->value != eb->value)
+    {
+        return ea->value < eb->value ? -1 : 1;
+    }
+    return ea->type - eb->type;
+}
+
+// Intersection algorithm from RFC 5905 section 11.2.1. Find the smallest
+// interval containing points from the largest number of candidates, allowing
+// for fewer than half of them to be falsetickers. The RFC also counts
+// midpoints outside the interval as falsetickers. That rejects the whole
+// round when an honest server with a wide interval is off centre, so it is
+// left out, as Marzullo's original algorithm does.
+int ntp_select(NTP_CANDIDATE_T *candidates, int n, int64_t *offset_us)
+{
+    if (n <= 0 || n > NTP_MAX_CANDIDATES)
+    {
+        return 0;
+    }
+
+    ENDPOINT_T endpoints[2 * NTP_MAX_CANDIDATES];
+    for (int i = 0; i < n; ++i)
+    {
+        candidates[i].truechimer = false;
+        endpoints[i * 2].value = candidates[i].offset_us - candidates[i].distance_us;
+        endpoints[i * 2].type = -1;
+        endpoints[i * 2 + 1].value = candidates[i].offset_us + candidates[i].distance_us;
+        endpoints[i * 2 + 1].type = 1;
+    }
+    qsort(endpoints, 2 * n, sizeof(ENDPOINT_T), compare_endpoints);
+
+    int64_t low = 0;
+    int64_t high = 0;
+    bool found = false;
+    for (int allow = 0; 2 * allow < n && !found; ++allow)
+    {
+        int chime = 0;
+        for (int i = 0; i < 2 * n; ++i)
+        {
+            chime -= endpoints[i].type;
+            low = endpoints[i].value;
+            if (chime >= n - allow)
+            {
+                break;
+            }
+        }
+        chime = 0;
+        for (int i = 2 * n - 1; i >= 0; --i)
+        {
+            chime += endpoints[i].type;
+            high = endpoints[i].value;
+            if (chime >= n - allow)
+            {
+                break;
+            }
+        }
+        if (low <= high)
+        {
+            found = true;
+        }
+    }
+
+    if (!found)
+    {
+        return 0;
+    }
+
+    // Combine the survivors weighted by the inverse of their root distance
+    int survivors = 0;
+    double weight_sum = 0;
+    double offset_sum = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        NTP_CANDIDATE_T *c = &candidates[i];
+        c->truechimer = c->offset_us + c->distance_us >= low && c->offset_us - c->distance_us <= high;
+        if (c->truechimer)
+        {
+            double weight = 1.0 / (c->distance_us > 0 ? c->distance_us : 1);
+            weight_sum += weight;
+            offset_sum += weight * c->offset_us;
+            ++survivors;
+        }
+    }
+    *offset_us = (int64_t)(offset_sum / weight_sum);
+    return survivors;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// Pure clock selection so it can be built and exercised off target
+
+struct NTP_CANDIDATE_T
+{
+    int64_t offset_us;
+    // root distance, the half width of the correctness interval
+    int64_t distance_us;
+    bool truechimer;
+};
+
+// Servers that must agree before the first step of an unsynchronised clock,
+// when it is made before the end of the round
+#define NTP_SELECT_STEP_MIN 2
+
+// Marks the truechimers among the candidates and returns how many there are
+// along with their combined offset. Returns 0 if no majority agrees.
+extern int ntp_select(NTP_CANDIDATE_T *candidates, int n, int64_t *offset_us);
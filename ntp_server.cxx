@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "lwip/pbuf.h"
+#include "lwip/udp.h"
+
+#include "clock.h"
+#include "ntp.h"
+#include "ntp_server.h"
+#include "wifi_pm.h"
+
+#define NTP_MSG_LEN 48
+#define NTP_PORT 123
+#define NTP_DELTA 2208988800 // seconds between 1 Jan 1900 and 1 Jan 1970
+#define NTP_MODE_CLIENT 3
+#define NTP_MODE_SERVER 4
+#define NTP_LEAP_ALARM 3
+#define NTP_STRATUM_UNSYNC 16
+// log2 of the clock resolution in seconds, time_us_64() counts microseconds
+#define NTP_PRECISION -20
+// Dispersion grows at 15 ppm from the last update, as in RFC 5905
+#define NTP_PHI_PPM 15
+// Replies are built in these and each is reused once the stack lets go of it,
+// so a reply normally goes out without touching the heap
+#define NTP_SERVER_PBUFS 4
+
+static struct udp_pcb *server_pcb;
+static struct pbuf *replies[NTP_SERVER_PBUFS];
+static uint8_t *reply_data[NTP_SERVER_PBUFS];
+static uint32_t request_count;
+static uint32_t dropped_count;
+
+static void put32(uint32_t v, uint8_t *buf)
+{
+    buf[0] = v >> 24;
+    buf[1] = v >> 16;
+    buf[2] = v >> 8;
+    buf[3] = v;
+}
+
+// 32.32 fixed point seconds since 1900
+static void utc_us_to_ntp(int64_t utc_us, uint8_t *buf)
+{
+    put32((uint32_t)(utc_us / 1000000) + NTP_DELTA, buf);
+    put32((uint32_t)((((uint64_t)(utc_us % 1000000)) << 32) / 1000000), buf + 4);
+}
+
+// 16.16 fixed point seconds
+static void us_to_ntp_short(int64_t us, uint8_t *buf)
+{
+    if (us < 0)
+    {
+        us = 0;
+    }
+    put32((uint32_t)(((uint64_t)us << 16) / 1000000), buf);
+}
+
+// A free reply buffer, or -1 if they are all still queued in the stack
+static int get_reply()
+{
+    for (int i = 0; i < NTP_SERVER_PBUFS; ++i)
+    {
+        struct pbuf *p = replies[i];
+        if (p != nullptr && p->ref == 1)
+        {
+            // Sending leaves the lower layer headers in front of our data
+            size_t headers = reply_data[i] - (uint8_t *)p->payload;
+            if (headers > 0)
+            {
+                pbuf_remove_header(p, headers);
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void ntp_server_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    // Take the receive timestamp before anything else
+    uint64_t receive_local_us = time_us_64();
+    LWIP_UNUSED_ARG(arg);
+    wifi_pm_note_traffic(p->tot_len);
+    uint8_t req[NTP_MSG_LEN];
+    bool valid = p->tot_len >= NTP_MSG_LEN && pbuf_copy_partial(p, req, NTP_MSG_LEN, 0) == NTP_MSG_LEN;
+    pbuf_free(p);
+    if (!valid)
+    {
+        return;
+    }
+    uint8_t version = (req[0] >> 3) & 0x7;
+    if ((req[0] & 0x7) != NTP_MODE_CLIENT || version < 1 || version > 4)
+    {
+        return;
+    }
+    ++request_count;
+
+    int index = get_reply();
+    struct pbuf *reply = index >= 0 ? replies[index] : pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
+    if (reply == nullptr)
+    {
+        ++dropped_count;
+        return;
+    }
+
+    uint8_t *msg = (uint8_t *)reply->payload;
+    memset(msg, 0, NTP_MSG_LEN);
+    NTP_REFERENCE_T ref;
+    if (ntp_get_reference(&ref) && ref.stratum < NTP_STRATUM_UNSYNC)
+    {
+        msg[0] = version << 3 | NTP_MODE_SERVER;
+        msg[1] = ref.stratum;
+        int64_t age_us = receive_local_us - ref.ref_local_us;
+        us_to_ntp_short(ref.root_delay_us, msg + 4);
+        us_to_ntp_short(ref.root_dispersion_us + age_us * NTP_PHI_PPM / 1000000, msg + 8);
+        put32(ref.ref_id, msg + 12);
+        utc_us_to_ntp(clock_local_to_utc_us(ref.ref_local_us), msg + 16);
+    }
+    else
+    {
+        // Tell the client not to use us yet
+        msg[0] = NTP_LEAP_ALARM << 6 | version << 3 | NTP_MODE_SERVER;
+        msg[1] = NTP_STRATUM_UNSYNC;
+    }
+    msg[2] = req[2];
+    msg[3] = (uint8_t)NTP_PRECISION;
+    // The client matches the reply on its transmit timestamp
+    memcpy(msg + 24, req + 40, 8);
+    utc_us_to_ntp(clock_local_to_utc_us(receive_local_us), msg + 32);
+    utc_us_to_ntp(clock_get_utc_us(), msg + 40);
+    if (udp_sendto(pcb, reply, addr, port) != ERR_OK)
+    {
+        ++dropped_count;
+    }
+    if (index < 0)
+    {
+        pbuf_free(reply);
+    }
+}
+
+bool ntp_server_init()
+{
+    if (server_pcb != nullptr)
+    {
+        return true;
+    }
+    for (int i = 0; i < NTP_SERVER_PBUFS; ++i)
+    {
+        if (replies[i] == nullptr)
+        {
+            replies[i] = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
+        }
+        if (replies[i] == nullptr)
+        {
+            printf("failed to allocate ntp server buffers\n");
+            return false;
+        }
+        reply_data[i] = (uint8_t *)replies[i]->payload;
+    }
+    server_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+    if (server_pcb == nullptr || udp_bind(server_pcb, IP_ANY_TYPE, NTP_PORT) != ERR_OK)
+    {
+        printf("failed to start ntp server\n");
+        if (server_pcb != nullptr)
+        {
+            udp_remove(server_pcb);
+            server_pcb = nullptr;
+        }
+        return false;
+    }
+    udp_recv(server_pcb, ntp_server_recv, nullptr);
+    return true;
+}
+
+uint32_t ntp_server_get_request_count()
+{
+    return request_count;
+}
+
+uint32_t ntp_server_get_dropped_count()
+{
+    return dropped_count;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+// SNTP server on port 123 so other devices on the LAN can take their time
+// from the clock. Requests are answered from the disciplined timebase straight
+// from the receive callback.
+
+// Must be called with the lwIP lock held
+extern bool ntp_server_init();
+
+extern uint32_t ntp_server_get_request_count();
+// Requests that could not be answered for lack of memory
+extern uint32_t ntp_server_get_dropped_count();
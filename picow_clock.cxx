@@ -11,167 +11,27 @@
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
 #include "pico/unique_id.h"
-#include "hardware/rtc.h"
 #include "hardware/watchdog.h"
+#include "lwip/timeouts.h"
 
-#include "lwip/dns.h"
-#include "lwip/pbuf.h"
-#include "lwip/udp.h"
 #include "whttpd.h"
 
-#include "ht16k33.h"
+#include "boot_timeline.h"
+#include "clock.h"
+#include "display.h"
+#include "fast_boot.h"
+#include "fleet.h"
+#include "health.h"
 #include "localtime.h"
+#include "ntp.h"
+#include "ntp_server.h"
+#include "power.h"
 #include "preferences.h"
-#include "timegm.h"
+#include "sched.h"
+#include "tempco.h"
 #include "wifi_details.h"
-
-struct NTP_T
-{
-    ip_addr_t ntp_server_address;
-    bool dns_request_sent;
-    struct udp_pcb *ntp_pcb;
-    absolute_time_t ntp_test_time;
-    alarm_id_t ntp_resend_alarm;
-};
-
-#define NTP_SERVER "pool.ntp.org"
-#define NTP_MSG_LEN 48
-#define NTP_PORT 123
-#define NTP_DELTA 2208988800 // seconds between 1 Jan 1900 and 1 Jan 1970
-#define NTP_TEST_TIME (30 * 1000)
-#define NTP_RESEND_TIME (10 * 1000)
-
-// d 1-31
-// m 1-12
-static int dotw(int d, int m, int y)
-{
-    return (d += m < 3 ? y-- : y - 2, 23*m/9 + d + 4 + y/4- y/100 + y/400)%7;
-}
-
-static absolute_time_t last_ntp_result_time;
-
-// Called with results of operation
-static void ntp_result(NTP_T* state, int status, time_t *result) 
-{
-    if (status == 0 && result) 
-    {
-        struct tm *utc = gmtime(result);
-        printf("got ntp response: %02d/%02d/%04d %02d:%02d:%02d\n", utc->tm_mday, utc->tm_mon + 1, utc->tm_year + 1900,
-               utc->tm_hour, utc->tm_min, utc->tm_sec);
-
-        datetime_t t;
-        t.year  = utc->tm_year + 1900;
-        t.month = utc->tm_mon + 1;
-        t.day   = utc->tm_mday;
-        t.dotw  = dotw(t.day, t.month, t.year); // 0 is Sunday, so 5 is Friday
-        t.hour  = utc->tm_hour;
-        t.min   = utc->tm_min;
-        t.sec   = utc->tm_sec;
-
-        last_ntp_result_time = get_absolute_time();
-
-        rtc_set_datetime(&t);
-    }
-
-    if (state->ntp_resend_alarm > 0)
-    {
-        cancel_alarm(state->ntp_resend_alarm);
-        state->ntp_resend_alarm = 0;
-    }
-
-    state->ntp_test_time = make_timeout_time_ms(NTP_TEST_TIME);
-    state->dns_request_sent = false;
-}
-
-static int64_t ntp_failed_handler(alarm_id_t id, void *user_data);
-
-// Make an NTP request
-static void ntp_request(NTP_T *state) 
-{
-    // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
-    // You can omit them if you are in a callback from lwIP. Note that when using pico_cyw_arch_poll
-    // these calls are a no-op and can be omitted, but it is a good practice to use them in
-    // case you switch the cyw43_arch type later.
-    cyw43_arch_lwip_begin();
-    struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, NTP_MSG_LEN, PBUF_RAM);
-    uint8_t *req = (uint8_t *) p->payload;
-    memset(req, 0, NTP_MSG_LEN);
-    req[0] = 0x1b;
-    udp_sendto(state->ntp_pcb, p, &state->ntp_server_address, NTP_PORT);
-    pbuf_free(p);
-    cyw43_arch_lwip_end();
-}
-
-static int64_t ntp_failed_handler(alarm_id_t id, void *user_data)
-{
-    NTP_T* state = (NTP_T*)user_data;
-    printf("ntp request failed\n");
-    ntp_result(state, -1, NULL);
-    return 0;
-}
-
-// Call back with a DNS result
-static void ntp_dns_found(const char *hostname, const ip_addr_t *ipaddr, void *arg) 
-{
-    NTP_T *state = (NTP_T*)arg;
-    if (ipaddr)
-    {
-        state->ntp_server_address = *ipaddr;
-        printf("ntp address %s\n", ipaddr_ntoa(ipaddr));
-        ntp_request(state);
-    }
-    else
-    {
-        printf("ntp dns request failed\n");
-        ntp_result(state, -1, NULL);
-    }
-}
-
-// NTP data received
-static void ntp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
-{
-    NTP_T *state = (NTP_T*)arg;
-    uint8_t mode = pbuf_get_at(p, 0) & 0x7;
-    uint8_t stratum = pbuf_get_at(p, 1);
-
-    // Check the result
-    if (ip_addr_cmp(addr, &state->ntp_server_address) && port == NTP_PORT && p->tot_len == NTP_MSG_LEN &&
-        mode == 0x4 && stratum != 0)
-    {
-        uint8_t seconds_buf[4] = {0};
-        pbuf_copy_partial(p, seconds_buf, sizeof(seconds_buf), 40);
-        uint32_t seconds_since_1900 = seconds_buf[0] << 24 | seconds_buf[1] << 16 | seconds_buf[2] << 8 | seconds_buf[3];
-        uint32_t seconds_since_1970 = seconds_since_1900 - NTP_DELTA;
-        time_t epoch = seconds_since_1970;
-        ntp_result(state, 0, &epoch);
-    }
-    else
-    {
-        printf("invalid ntp response\n");
-        ntp_result(state, -1, NULL);
-    }
-    pbuf_free(p);
-}
-
-// Perform initialisation
-static NTP_T* ntp_init(void) 
-{
-    NTP_T *state = (NTP_T *)calloc(1, sizeof(NTP_T));
-    if (!state)
-    {
-        printf("failed to allocate state\n");
-        return NULL;
-    }
-    state->ntp_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
-    if (!state->ntp_pcb)
-    {
-        printf("failed to create pcb\n");
-        free(state);
-        return NULL;
-    }
-    udp_recv(state->ntp_pcb, ntp_recv, state);
-    return state;
-}
+#include "wifi_link.h"
+#include "wifi_pm.h"
 
 #if 0 // for debug
 static const char* link_status_string(int status)
@@ -196,81 +56,100 @@ static const char* link_status_string(int status)
 }
 #endif
 
-static void ntp_loop(void)
+#define WATCHDOG_TIMEOUT_MS 3000
+// Heartbeat deadlines, the lwIP one is beaten from a timer with this period
+#define LWIP_BEAT_PERIOD_MS 1000
+#define LWIP_HEALTH_DEADLINE_MS 2500
+#define NTP_HEALTH_DEADLINE_MS 5000
+
+static int lwip_beat = -1;
+static int ntp_beat = -1;
+
+// Feed the watchdog if every heartbeat is in time, noting the time so that
+// if it does fire the clock can carry on across the reboot. The reset comes
+// a timeout after the last feed, so the time is only noted when fed.
+static void feed_watchdog()
 {
-    NTP_T *state = ntp_init();
-    if (!state)
-        return;
-    bool dots = true;
-    int print_tick = 0;
-    for (;;)
+    if (health_feed())
     {
-        if (absolute_time_diff_us(get_absolute_time(), state->ntp_test_time) < 0 && !state->dns_request_sent)
-        {
-            // Set alarm in case udp requests are lost
-            state->ntp_resend_alarm = add_alarm_in_ms(NTP_RESEND_TIME, ntp_failed_handler, state, true);
+        clock_persist(WATCHDOG_TIMEOUT_MS * 1000);
+    }
+}
 
-            // cyw43_arch_lwip_begin/end should be used around calls into lwIP to ensure correct locking.
-            // You can omit them if you are in a callback from lwIP. Note that when using pico_cyw_arch_poll
-            // these calls are a no-op and can be omitted, but it is a good practice to use them in
-            // case you switch the cyw43_arch type later.
-            cyw43_arch_lwip_begin();
-            int err = dns_gethostbyname(NTP_SERVER, &state->ntp_server_address, ntp_dns_found, state);
-            cyw43_arch_lwip_end();
+// Shows the lwIP timers are running, which the web server and NTP rely on
+static void lwip_beat_timer(void *arg)
+{
+    health_beat(lwip_beat);
+    sys_timeout(LWIP_BEAT_PERIOD_MS, lwip_beat_timer, nullptr);
+}
 
-            state->dns_request_sent = true;
-            if (err == ERR_OK)
-            {
-                ntp_request(state); // Cached result
-            }
-            else if (err != ERR_INPROGRESS)
-            { // ERR_INPROGRESS means expect a callback
-                printf("dns request failed %d\n", err);
-                ntp_result(state, -1, NULL);
-            }
-        }
+// Periods of the main loop tasks
+#define NTP_PERIOD_MS 1000
+#define LINK_PERIOD_MS 1000
+#define WATCHDOG_PERIOD_MS 500
+#define STATS_PERIOD_MS (10 * 1000)
+#define POWER_PERIOD_MS 1000
+#define WIFI_PM_PERIOD_MS 1000
 
-        cyw43_arch_lwip_begin();
-        int link_status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
-        cyw43_arch_lwip_end();
-        if (link_status != CYW43_LINK_UP)
-        {
-            printf("link has gone down %d\n", link_status);
-            return;
-        }
+static void ntp_task()
+{
+    if (!fleet_wants_ntp() || ntp_poll())
+    {
+        health_beat(ntp_beat);
+    }
+}
 
-        sleep_ms(1000);
-        datetime_t t;
-        rtc_get_datetime(&t);
-        struct tm tmbuf;
-        localtime_get_time(&tmbuf);
-        char dbuf[6];
-        snprintf(dbuf, sizeof(dbuf), "%2d %02d", tmbuf.tm_hour, tmbuf.tm_min);
-        if (tmbuf.tm_hour < 8 || tmbuf.tm_hour >= 20)
-        {
-            ht16k33_set_brightness(0);
-        }
-        else
-        {
-            ht16k33_set_brightness(6);
-        }
+static void stats_task()
+{
+    auto delta = absolute_time_diff_us(ntp_get_last_sync_time(), get_absolute_time());
+    time_t now = clock_get_time();
+    struct tm t;
+    gmtime_r(&now, &t);
+    printf("UTC time: %02d/%02d/%04d %02d:%02d:%02d - last sync %lld secs ago, poll %lu secs, freq %ld ppb\n", 
+        t.tm_mday, t.tm_mon + 1, t.tm_year + 1900, t.tm_hour, t.tm_min, t.tm_sec, delta / 1000000, 
+        clock_get_poll_interval_ms() / 1000, (long)clock_get_frequency_ppb());
+    if (fleet_get_role() != FLEET_OFF)
+    {
+        printf("fleet %s, path delay %lld us, offset %lld us\n", fleet_get_role_name(),
+            fleet_get_path_delay_us(), fleet_get_last_offset_us());
+    }
+    printf("ntp server %lu requests, %lu dropped\n", (unsigned long)ntp_server_get_request_count(),
+        (unsigned long)ntp_server_get_dropped_count());
+    printf("temperature %.1fC correction %ld ppb\n", tempco_get_temperature(), (long)tempco_get_correction_ppb());
+    struct tm tmbuf;
+    localtime_get_time(&tmbuf);
+    printf("localtime says: %02d/%02d/%04d %02d:%02d:%02d\n", tmbuf.tm_mday, tmbuf.tm_mon + 1, tmbuf.tm_year + 1900,
+        tmbuf.tm_hour, tmbuf.tm_min, tmbuf.tm_sec);
+    display_print_stats();
+    sched_print_stats();
+    power_print_stats();
+    wifi_pm_print_stats();
+    wifi_link_print_stats();
+    health_print_stats();
+    clock_save_drift();
+    fast_boot_save();
+    boot_print_once();
+}
 
-        ht16k33_display_string(dbuf);
-        ht16k33_display_set(2, dots ? 0xff : 0);
-        dots = !dots;
+static void ntp_loop(void)
+{
+    if (!ntp_init() || !fleet_init())
+        return;
 
-        ++print_tick;
-        if (print_tick == 10)        
-        {
-            auto delta = absolute_time_diff_us(last_ntp_result_time, get_absolute_time());
-            printf("UTC time: %02d/%02d/%04d %02d:%02d:%02d - last sync %lld secs ago\n", t.day, t.month, t.year,
-                t.hour, t.min, t.sec, delta / 1000000);
-            printf("localtime says: %02d/%02d/%04d %02d:%02d:%02d\n", tmbuf.tm_mday, tmbuf.tm_mon + 1, tmbuf.tm_year + 1900,
-                tmbuf.tm_hour, tmbuf.tm_min, tmbuf.tm_sec);
-            print_tick = 0;
-        }
-        watchdog_update();
-    }
+    display_set_mode(DISPLAY_TIME);
+    wifi_pm_reset();
+    sched_reset();
+    sched_add("ntp", ntp_task, NTP_PERIOD_MS, 0);
+    // The link task also runs as soon as the netif callbacks see a change
+    wifi_link_watch(sched_add("link", wifi_link_task, LINK_PERIOD_MS, LINK_PERIOD_MS));
+    sched_add("watchdog", feed_watchdog, WATCHDOG_PERIOD_MS, 0);
+    sched_add("stats", stats_task, STATS_PERIOD_MS, STATS_PERIOD_MS);
+    sched_add("power", power_update, POWER_PERIOD_MS, POWER_PERIOD_MS);
+    sched_add("wifipm", wifi_pm_update, WIFI_PM_PERIOD_MS, WIFI_PM_PERIOD_MS);
+    health_set_enabled(ntp_beat, true);
+    sched_run();
+    // Nothing polls NTP while the link is being brought back
+    health_set_enabled(ntp_beat, false);
 }
 
 static uint16_t small_id;
@@ -285,24 +164,19 @@ extern "C" const char *get_net_hostname()
     return hostname;
 }
 
-// step must be 0 to 6
-static void show_busy(int step)
-{
-    uint16_t pattern = 1 << step;
-    ht16k33_display_set(0, pattern);
-    ht16k33_display_set(1, pattern);
-    ht16k33_display_set(2, 0);
-    ht16k33_display_set(3, pattern);
-    ht16k33_display_set(4, pattern);
-}
-
 int main() 
 {
+    boot_begin(BOOT_STDIO);
     stdio_init_all();
+    boot_end(BOOT_STDIO);
+    health_init();
+    clock_init();
+    tempco_init();
+
+    localtime_init();
 
-    ht16k33_init();
-    ht16k33_set_brightness(6);
-    ht16k33_display_string("-- --");
+    boot_begin(BOOT_FIRST_TIME);
+    display_start();
 
     printf("init\n");
     
@@ -316,66 +190,66 @@ int main()
         small_id += x;
     }
 
+    boot_begin(BOOT_WIFI_INIT);
     if (cyw43_arch_init())
     {
         printf("failed to initialise\n");
         return 1;
     }
+    boot_end(BOOT_WIFI_INIT);
 
-    rtc_init();
+    boot_begin(BOOT_PREFS);
     if (prefs_load())
     {
         localtime_set_zone_name(prefs.timezone);
+        if (prefs_drift_valid())
+        {
+            clock_seed_frequency(prefs.freq_ppb, prefs.freq_uncertainty_ppb, prefs.freq_time);
+        }
     }
     else
     {
         localtime_set_zone_name("America/Los_Angeles");
     }
+    boot_end(BOOT_PREFS);
 
+    boot_begin(BOOT_WIFI_CONNECT);
     cyw43_arch_enable_sta_mode();
+    wifi_link_init();
+    // After a watchdog or OTA reboot go back to the same access point and
+    // lease rather than starting from a scan
+    fast_boot_restore();
 
-    // On startup we have to wait for wifi to get a ntp request in
-    int busy_step = 0;
-    for (;;)
-    {
-        int err = cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, 10000);
-        if (err == 0)
-        {
-            break;
-        }
-        show_busy(busy_step);
-        if (++busy_step == 6)
-        {
-            busy_step = 0;
-        }
-    }
+    // On startup we have to wait for wifi to get a ntp request in. The
+    // display shows the time if it survived a reboot, otherwise a busy pattern.
+    wifi_link_connect(nullptr);
+    boot_end(BOOT_WIFI_CONNECT);
 
     printf("connected to wifi\n");
+    fast_boot_print_stats();
+    fast_boot_save();
+    boot_begin(BOOT_HTTPD);
     whttpd_init();
-    watchdog_enable(3000, 0);
-
-    busy_step = 0;
+    boot_end(BOOT_HTTPD);
+    lwip_beat = health_register("lwip", LWIP_HEALTH_DEADLINE_MS);
+    ntp_beat = health_register("ntp", NTP_HEALTH_DEADLINE_MS);
+    health_set_enabled(ntp_beat, false);
+    cyw43_arch_lwip_begin();
+    sys_timeout(LWIP_BEAT_PERIOD_MS, lwip_beat_timer, nullptr);
+    cyw43_arch_lwip_end();
+    watchdog_enable(WATCHDOG_TIMEOUT_MS, 0);
 
     for (;;)
     {
-        // ntp_loop exits if the link goes down so we wait until it is up again. 
-        int link_status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
-        if (link_status != CYW43_LINK_UP)
+        // ntp_loop exits if the link goes down, reconnect straight away
+        if (!wifi_link_is_up())
         {
             printf("wifi is down\n");
-            show_busy(busy_step);
-            for (int i = 0; i < 5; i++)
-            {
-                sleep_ms(1000);
-                watchdog_update();
-            }
-            if (++busy_step == 6)
-            {
-                busy_step = 0;
-            }
+            display_set_mode(DISPLAY_WAITING);
+            wifi_link_connect(feed_watchdog);
             continue;
         }
-        
+
         ntp_loop();
     }
 
@@ -0,0 +1,198 @@
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+#include "hardware/clocks.h"
+#include "hardware/sync.h"
+
+#include "display.h"
+#include "power.h"
+#include "wifi_details.h"
+
+#ifndef POWER_CLOCK_SCALING
+#define POWER_CLOCK_SCALING 0
+#endif
+
+// System clock at full speed and when idle, USB needs at least 48 MHz
+#define POWER_FULL_KHZ 125000
+#define POWER_LOW_KHZ 48000
+// Stay at full speed this long after a boost
+#define POWER_BOOST_HOLD_MS 5000
+// Core 0 busier than this over the last update also counts as a boost
+#define POWER_BUSY_PERCENT 25
+// Longest to wait for core 1 to finish an I2C write before a clock change,
+// a whole frame at the slowest clock is well under this
+#define POWER_BUS_HOLD_US 5000
+
+// Rough current per core in each state, for the energy estimate only. They
+// are not measured on this board, so the estimate is only as good as they
+// are. Measure the board and set these to get real figures.
+#ifndef POWER_RUN_FULL_UA
+#define POWER_RUN_FULL_UA 12000
+#endif
+#ifndef POWER_SLEEP_FULL_UA
+#define POWER_SLEEP_FULL_UA 2500
+#endif
+#ifndef POWER_RUN_LOW_UA
+#define POWER_RUN_LOW_UA 5000
+#endif
+#ifndef POWER_SLEEP_LOW_UA
+#define POWER_SLEEP_LOW_UA 1500
+#endif
+#define POWER_SUPPLY_V 3.3
+
+enum POWER_LEVEL
+{
+    POWER_LEVEL_FULL,
+    POWER_LEVEL_LOW,
+    POWER_LEVELS
+};
+
+// Time is added up when a core goes to sleep and when it wakes, so
+// interrupts taken while asleep count as sleep. Each core only writes its
+// own entry.
+struct POWER_CORE_T
+{
+    uint64_t last_us;
+    uint64_t run_us[POWER_LEVELS];
+    uint64_t sleep_us[POWER_LEVELS];
+    uint32_t wakeups;
+};
+
+static POWER_CORE_T cores[2];
+static volatile uint8_t level = POWER_LEVEL_FULL;
+static volatile uint32_t clock_generation;
+// time_us_32() deadline, a single word as power_boost() is called from
+// interrupts
+static volatile uint32_t boost_until_us;
+static uint64_t last_update_run_us;
+static uint64_t last_update_us;
+static uint32_t clock_changes;
+
+static const uint32_t run_ua[POWER_LEVELS] = { POWER_RUN_FULL_UA, POWER_RUN_LOW_UA };
+static const uint32_t sleep_ua[POWER_LEVELS] = { POWER_SLEEP_FULL_UA, POWER_SLEEP_LOW_UA };
+
+void power_idle_until(absolute_time_t due, const volatile uint32_t *wake)
+{
+    POWER_CORE_T *core = &cores[get_core_num()];
+    uint64_t now = time_us_64();
+    if (core->last_us != 0)
+    {
+        core->run_us[level] += now - core->last_us;
+    }
+
+    // Wait for an event with the timer set to send one at due. Any interrupt
+    // wakes the core too, handlers run and it goes back to sleep. WFE rather
+    // than WFI as the timer alarm belongs to core 0 and reaches core 1 as an
+    // event. An interrupt setting *wake between the test and the WFE leaves
+    // the event register set, so the WFE returns straight away.
+    while ((wake == nullptr || *wake == 0) && !best_effort_wfe_or_timeout(due))
+    {
+        ++core->wakeups;
+    }
+
+    uint64_t woke = time_us_64();
+    core->sleep_us[level] += woke - now;
+    core->last_us = woke;
+}
+
+void power_boost()
+{
+    boost_until_us = time_us_32() + POWER_BOOST_HOLD_MS * 1000;
+}
+
+uint32_t power_get_clock_generation()
+{
+    return clock_generation;
+}
+
+static uint64_t total_run_us(const POWER_CORE_T *core)
+{
+    uint64_t us = 0;
+    for (int i = 0; i < POWER_LEVELS; ++i)
+    {
+        us += core->run_us[i];
+    }
+    return us;
+}
+
+void power_update()
+{
+    uint64_t now = time_us_64();
+    uint64_t run_us = total_run_us(&cores[0]);
+    bool busy = last_update_us != 0 &&
+        (run_us - last_update_run_us) * 100 > (now - last_update_us) * POWER_BUSY_PERCENT;
+    last_update_run_us = run_us;
+    last_update_us = now;
+    if (busy)
+    {
+        power_boost();
+    }
+
+    if (!POWER_CLOCK_SCALING)
+    {
+        return;
+    }
+    // A deadline that has passed is brought up to now, so it can not come
+    // round again when the counter wraps
+    uint32_t irq = save_and_disable_interrupts();
+    uint32_t now_32 = time_us_32();
+    bool boosted = (int32_t)(boost_until_us - now_32) > 0;
+    if (!boosted)
+    {
+        boost_until_us = now_32;
+    }
+    restore_interrupts(irq);
+    uint8_t want = boosted ? POWER_LEVEL_FULL : POWER_LEVEL_LOW;
+    if (want == level)
+    {
+        return;
+    }
+
+    // An I2C write going as the clock changes would run at the wrong rate,
+    // so core 1 holds off the bus until its divider can be set again. If it
+    // does not let go in time the change waits for the next update.
+    if (!display_hold_bus(POWER_BUS_HOLD_US))
+    {
+        return;
+    }
+    // Keep the wifi driver out while its PIO clock changes under it
+    cyw43_arch_lwip_begin();
+    bool ok = set_sys_clock_khz(want == POWER_LEVEL_FULL ? POWER_FULL_KHZ : POWER_LOW_KHZ, false);
+    cyw43_arch_lwip_end();
+    if (ok)
+    {
+        level = want;
+        ++clock_changes;
+        __dmb();
+        ++clock_generation;
+    }
+    display_release_bus();
+    if (!ok)
+    {
+        printf("cannot set system clock\n");
+    }
+}
+
+void power_print_stats()
+{
+    double mj = 0;
+    for (int c = 0; c < 2; ++c)
+    {
+        const POWER_CORE_T *core = &cores[c];
+        uint64_t run_us = total_run_us(core);
+        uint64_t sleep_us = 0;
+        for (int i = 0; i < POWER_LEVELS; ++i)
+        {
+            sleep_us += core->sleep_us[i];
+            mj += POWER_SUPPLY_V * (core->run_us[i] * run_ua[i] + core->sleep_us[i] * sleep_ua[i]) / 1e9;
+        }
+        uint64_t total = run_us + sleep_us;
+        printf("core %d running %llu ms asleep %llu ms (%.1f%% idle), %lu wakeups\n", c,
+            (unsigned long long)(run_us / 1000), (unsigned long long)(sleep_us / 1000),
+            total ? sleep_us * 100.0 / total : 0.0, (unsigned long)core->wakeups);
+    }
+    printf("power %lu kHz, %lu clock changes, %.1f mJ estimated, low clock %llu ms\n",
+        (unsigned long)(clock_get_hz(clk_sys) / 1000), (unsigned long)clock_changes, mj,
+        (unsigned long long)((cores[0].run_us[POWER_LEVEL_LOW] + cores[0].sleep_us[POWER_LEVEL_LOW]) / 1000));
+}
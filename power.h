@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include "pico/stdlib.h"
+
+// Idle accounting. Each core waits out the gaps between its deadlines with
+// WFE, as the SDK's sleep_until() does, woken by its timer or any interrupt
+// such as the network's. No clocks are gated while it waits, so this saves
+// nothing over the SDK by itself. What it adds is the time each core spends
+// running and waiting at each system clock, which with the per core
+// currents in power.cxx gives an estimate of the energy used. The currents
+// are rough figures, not measured on this board.
+//
+// With POWER_CLOCK_SCALING set the system clock also drops while nothing
+// much is happening and goes back to full speed when something asks for it.
+// That is where any real saving comes from.
+
+// Wait until due, safe on either core. Returns early once *wake is set
+// non-zero by an interrupt or the other core, if wake is given.
+extern void power_idle_until(absolute_time_t due, const volatile uint32_t *wake = nullptr);
+
+// Ask for full clock speed for a while, for OTA and other bursts of work.
+// Only sets a time so it is safe from interrupts and lwIP callbacks.
+extern void power_boost();
+
+// Run periodically on core 0 to pick the system clock
+extern void power_update();
+
+// Changes each time the system clock changes, for peripherals clocked from
+// it to notice and set up their dividers again
+extern uint32_t power_get_clock_generation();
+
+extern void power_print_stats();
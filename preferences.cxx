@@ -4,12 +4,13 @@
 #include "preferences.h"
 #include "pico/stdlib.h"
 #include "hardware/flash.h" // for the flash erasing and writing
-#include "hardware/sync.h" // for the interrupts
+#include "flash_lockout.h"
 
 extern "C" uint8_t __prefs_start[4096], __flash_binary_start;
 Preferences prefs;
 
 static const uint32_t MAGIC = 0xdeafc0de;
+static const uint32_t DRIFT_MAGIC = 0xd21f7000;
 
 void prefs_save()
 {
@@ -18,19 +19,24 @@ void prefs_save()
     printf("set magic to %lx\n", MAGIC);
 
     strcpy(prefs.timezone, localtime_get_zone_name());
+    if (prefs.freq_time != 0)
+    {
+        prefs.drift_magic = DRIFT_MAGIC;
+    }
     
     int writeSize = (myDataSize / FLASH_PAGE_SIZE) + 1; // how many flash pages we're gonna need to write
     int sectorCount = ((writeSize * FLASH_PAGE_SIZE) / FLASH_SECTOR_SIZE) + 1; // how many flash sectors we're gonna need to erase
 
     uint8_t page[FLASH_PAGE_SIZE];
+    memset(page, 0xff, sizeof(page));
     memcpy(page, &prefs, sizeof(prefs));
     size_t offset = &__prefs_start[0] - &__flash_binary_start;
     printf("Programming flash target region... write size %d sector count %d\n", writeSize, sectorCount);
 
-    uint32_t interrupts = save_and_disable_interrupts();
+    uint32_t interrupts = flash_lockout_begin();
     flash_range_erase(offset, FLASH_SECTOR_SIZE * sectorCount);
     flash_range_program(offset, page, FLASH_PAGE_SIZE * writeSize);
-    restore_interrupts(interrupts);
+    flash_lockout_end(interrupts);
 
     printf("Done.\n");
 
@@ -43,8 +49,19 @@ bool prefs_load()
     if (prefs.magic == MAGIC)
     {
         printf("zone: %s\n", prefs.timezone);
+        if (!prefs_drift_valid())
+        {
+            prefs.freq_time = 0;
+        }
         return true;
     }
 
+    memset(&prefs, 0, sizeof(prefs));
     return false;
+}
+
+// Older preferences were written before the drift fields existed
+bool prefs_drift_valid()
+{
+    return prefs.magic == MAGIC && prefs.drift_magic == DRIFT_MAGIC;
 }
\ No newline at end of file
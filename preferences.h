@@ -8,9 +8,16 @@ struct Preferences
     uint32_t magic;
     char timezone[40];
     long some_long_int;
+    // Learnt crystal frequency error, only meaningful if drift_magic is set
+    uint32_t drift_magic;
+    int32_t freq_ppb;
+    int32_t freq_uncertainty_ppb;
+    int64_t freq_time;
 };
 
+// Only used from core 0, either the main loop or lwIP callbacks
 extern Preferences prefs;
 
 extern bool prefs_load();
-extern void prefs_save();
\ No newline at end of file
+extern void prefs_save();
+extern bool prefs_drift_valid();
\ No newline at end of file
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hardware/sync.h"
+
+#include "power.h"
+#include "sched.h"
+
+#define SCHED_MAX_TASKS 10
+// A task starting later than this after its deadline counts as a miss
+#define SCHED_LATE_US 2000
+
+struct SCHED_TASK_T
+{
+    const char *name;
+    SCHED_FN fn;
+    uint64_t period_us;
+    absolute_time_t due;
+    bool active;
+    uint32_t runs;
+    uint32_t misses;
+    uint32_t max_late_us;
+    uint32_t max_run_us;
+};
+
+static SCHED_TASK_T tasks[SCHED_MAX_TASKS];
+static bool stop_requested;
+// Bit per task triggered from an interrupt
+static volatile uint32_t triggered;
+
+static_assert(SCHED_MAX_TASKS <= 32, "a bit per task");
+
+void sched_reset()
+{
+    memset(tasks, 0, sizeof(tasks));
+    triggered = 0;
+}
+
+int sched_add(const char *name, SCHED_FN fn, uint32_t period_ms, uint32_t delay_ms)
+{
+    for (int i = 0; i < SCHED_MAX_TASKS; ++i)
+    {
+        SCHED_TASK_T *task = &tasks[i];
+        if (task->fn == nullptr)
+        {
+            task->name = name;
+            task->fn = fn;
+            task->period_us = (uint64_t)period_ms * 1000;
+            task->due = make_timeout_time_ms(delay_ms);
+            task->active = true;
+            return i;
+        }
+    }
+    printf("no room for task %s\n", name);
+    return -1;
+}
+
+void sched_run_at(int id, absolute_time_t due)
+{
+    if (id >= 0 && id < SCHED_MAX_TASKS && tasks[id].fn != nullptr)
+    {
+        tasks[id].due = due;
+        tasks[id].active = true;
+    }
+}
+
+void sched_trigger(int id)
+{
+    if (id >= 0 && id < SCHED_MAX_TASKS)
+    {
+        uint32_t irq = save_and_disable_interrupts();
+        triggered |= 1u << id;
+        restore_interrupts(irq);
+    }
+}
+
+void sched_stop()
+{
+    stop_requested = true;
+}
+
+// Run a due task and work out when it is next due
+static void run_task(SCHED_TASK_T *task, absolute_time_t now)
+{
+    int64_t late_us = absolute_time_diff_us(task->due, now);
+    if (late_us > SCHED_LATE_US)
+    {
+        ++task->misses;
+    }
+    if (late_us > (int64_t)task->max_late_us)
+    {
+        task->max_late_us = (uint32_t)late_us;
+    }
+
+    if (task->period_us == 0)
+    {
+        task->active = false;
+    }
+    else
+    {
+        task->due = delayed_by_us(task->due, task->period_us);
+        if (absolute_time_diff_us(now, task->due) <= 0)
+        {
+            // Fallen a whole period or more behind, the skipped runs are
+            // misses too and the task picks up again on its original phase
+            uint64_t behind = absolute_time_diff_us(task->due, now) / task->period_us + 1;
+            task->misses += (uint32_t)behind;
+            task->due = delayed_by_us(task->due, behind * task->period_us);
+        }
+    }
+
+    uint64_t start = time_us_64();
+    task->fn();
+    uint32_t run_us = (uint32_t)(time_us_64() - start);
+    ++task->runs;
+    if (run_us > task->max_run_us)
+    {
+        task->max_run_us = run_us;
+    }
+}
+
+void sched_run()
+{
+    stop_requested = false;
+    while (!stop_requested)
+    {
+        uint32_t irq = save_and_disable_interrupts();
+        uint32_t fired = triggered;
+        triggered = 0;
+        restore_interrupts(irq);
+        for (int i = 0; i < SCHED_MAX_TASKS; ++i)
+        {
+            if (fired & (1u << i))
+            {
+                sched_run_at(i, get_absolute_time());
+            }
+        }
+
+        // Run the task with the earliest deadline if it is due, otherwise
+        // sleep until it is
+        SCHED_TASK_T *next = nullptr;
+        for (int i = 0; i < SCHED_MAX_TASKS; ++i)
+        {
+            SCHED_TASK_T *task = &tasks[i];
+            if (task->active && (next == nullptr || absolute_time_diff_us(task->due, next->due) > 0))
+            {
+                next = task;
+            }
+        }
+        if (next == nullptr)
+        {
+            return;
+        }
+        absolute_time_t now = get_absolute_time();
+        if (absolute_time_diff_us(now, next->due) > 0)
+        {
+            // Go round again after sleeping in case a trigger woke us
+            power_idle_until(next->due, &triggered);
+            continue;
+        }
+        run_task(next, now);
+    }
+}
+
+void sched_print_stats()
+{
+    for (int i = 0; i < SCHED_MAX_TASKS; ++i)
+    {
+        const SCHED_TASK_T *task = &tasks[i];
+        if (task->fn != nullptr)
+        {
+            printf("task %-8s runs %lu missed %lu max late %lu us max run %lu us\n", task->name,
+                (unsigned long)task->runs, (unsigned long)task->misses,
+                (unsigned long)task->max_late_us, (unsigned long)task->max_run_us);
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include "pico/stdlib.h"
+
+// Small deadline scheduler for the main loop. Tasks are periodic or one
+// shot and each is run when it falls due, in between the loop sleeps until
+// the next deadline. Periodic tasks keep to their original phase so slow
+// runs do not make the schedule drift, and every task counts how often it
+// started late.
+
+typedef void (*SCHED_FN)();
+
+// Remove all tasks
+extern void sched_reset();
+
+// Add a task first due delay_ms from now, repeating every period_ms or just
+// once if period_ms is 0. Returns the task id or -1 if the table is full.
+extern int sched_add(const char *name, SCHED_FN fn, uint32_t period_ms, uint32_t delay_ms);
+
+// Move the next run of a task to an absolute time, periodic tasks carry on
+// from there
+extern void sched_run_at(int id, absolute_time_t due);
+
+// Run a task as soon as possible, safe from interrupts and lwIP callbacks
+// on the scheduler's core. Periodic tasks carry on from then.
+extern void sched_trigger(int id);
+
+// Run tasks until one of them calls sched_stop()
+extern void sched_run();
+extern void sched_stop();
+
+extern void sched_print_stats();
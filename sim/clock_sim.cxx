@@ -0,0 +1,226 @@
+/* Host check for the clock discipline and its saved drift seed
+
+   Builds clock.cxx on a PC against a simulated crystal that runs slow by
+   a fixed amount, and feeds it NTP samples with Gaussian network jitter at
+   whatever poll interval the clock asks for. Three runs start the same way
+   apart from the saved frequency:
+
+   unseeded    nothing saved
+   good seed   the true drift, saved a day ago
+   bad seed    a value well away from the true drift, as after the board
+               has been moved somewhere much warmer or colder
+
+   For each run it prints the worst frequency error in the first quarter
+   hour, when the estimate last strayed more than 2 ppm from the truth,
+   when a bad seed was let go of, and the worst time error over the last
+   hour. It exits non-zero if a good seed does not hold the frequency from
+   the first sample, if a bad seed is held on to for too long, if the
+   estimate never settles or if the time error at the end is out of
+   bounds.
+
+   From the top of the repository
+
+   g++ -std=c++17 -Wall -Wextra -Isim -I. sim/clock_sim.cxx clock.cxx -o clock_sim
+   ./clock_sim [drift ppm] [jitter us] [seed] [-v]
+
+   -v shows the clock's own log as well.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "preferences.h"
+#include "tempco.h"
+
+#define SIM_RUN_US (3 * 3600 * 1000000LL)
+#define SIM_EARLY_US (15 * 60 * 1000000LL)
+#define SIM_LAST_HOUR_US (3600 * 1000000LL)
+#define SIM_START_UTC_US (1760000000 * 1000000LL)
+#define SIM_DELAY_US 20000
+// How far a bad seed is from the truth
+#define SIM_BAD_SEED_PPB 10000
+#define SIM_SEED_UNCERTAINTY_PPB 300
+// Pass marks
+#define SIM_SETTLED_PPB 2000
+#define SIM_SETTLE_US (2 * 3600 * 1000000LL)
+#define SIM_GOOD_SEED_MAX_PPB 1000
+#define SIM_BAD_SEED_DROP_US (60 * 60 * 1000000LL)
+#define SIM_MAX_TIME_ERROR_US 10000
+
+enum SIM_RUN
+{
+    SIM_UNSEEDED,
+    SIM_GOOD_SEED,
+    SIM_BAD_SEED,
+    SIM_RUNS
+};
+
+static const char *run_names[SIM_RUNS] = { "unseeded", "good seed", "bad seed" };
+
+static uint64_t now_us;
+static double drift_ppm = 37;
+static double jitter_us = 2000;
+
+Preferences prefs;
+
+uint64_t time_us_64()
+{
+    return now_us;
+}
+
+bool prefs_drift_valid()
+{
+    return false;
+}
+
+void prefs_save()
+{
+}
+
+void tempco_add_frequency(int32_t, uint64_t)
+{
+}
+
+static double gaussian()
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// A slow crystal counts fewer microseconds than have really passed
+static int64_t true_utc_us(uint64_t local_us)
+{
+    return SIM_START_UTC_US + (int64_t)(local_us * (1 + drift_ppm / 1e6));
+}
+
+// Runs in its own process since the clock state can not be reset
+static int run(SIM_RUN which, FILE *out)
+{
+    int32_t true_ppb = (int32_t)(drift_ppm * 1000);
+    clock_init();
+    if (which != SIM_UNSEEDED)
+    {
+        int32_t seed_ppb = which == SIM_GOOD_SEED ? true_ppb : true_ppb - SIM_BAD_SEED_PPB;
+        clock_seed_frequency(seed_ppb, SIM_SEED_UNCERTAINTY_PPB, SIM_START_UTC_US / 1000000 - 86400);
+    }
+
+    double early_worst = 0;
+    double time_worst = 0;
+    uint64_t last_unsettled = 0;
+    // When the estimate got at least half way from a bad seed to the truth
+    int64_t dropped = -1;
+    bool first = true;
+    while (now_us < SIM_RUN_US)
+    {
+        int64_t error_us = clock_local_to_utc_us(now_us) - true_utc_us(now_us);
+        int64_t offset_us = -error_us + (int64_t)(gaussian() * jitter_us);
+        clock_update(offset_us, SIM_DELAY_US, now_us);
+
+        double freq_error = fabs((double)clock_get_frequency_ppb() - true_ppb);
+        if (!first)
+        {
+            if (now_us < SIM_EARLY_US && freq_error > early_worst)
+            {
+                early_worst = freq_error;
+            }
+            if (now_us >= SIM_RUN_US - SIM_LAST_HOUR_US && fabs((double)error_us) > time_worst)
+            {
+                time_worst = fabs((double)error_us);
+            }
+        }
+        if (freq_error > SIM_SETTLED_PPB)
+        {
+            last_unsettled = now_us;
+        }
+        if (which == SIM_BAD_SEED && dropped < 0 && freq_error < SIM_BAD_SEED_PPB / 2)
+        {
+            dropped = now_us;
+        }
+        first = false;
+        now_us += clock_get_poll_interval_ms() * 1000ull;
+    }
+
+    char dropped_min[16] = "-";
+    if (dropped >= 0)
+    {
+        snprintf(dropped_min, sizeof(dropped_min), "%.1f", dropped / 60e6);
+    }
+    fprintf(out, "%-10s %9.0f %10.1f %9s %10.0f %5d\n", run_names[which], early_worst, last_unsettled / 60e6,
+        dropped_min, time_worst, clock_get_poll_exponent());
+
+    bool ok = time_worst <= SIM_MAX_TIME_ERROR_US && last_unsettled <= (uint64_t)SIM_SETTLE_US;
+    if (which == SIM_GOOD_SEED && early_worst > SIM_GOOD_SEED_MAX_PPB)
+    {
+        ok = false;
+    }
+    if (which == SIM_BAD_SEED && (dropped < 0 || dropped > SIM_BAD_SEED_DROP_US))
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        fprintf(out, "FAIL %s\n", run_names[which]);
+    }
+    fflush(out);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    unsigned seed = 1;
+    int arg = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+        {
+            verbose = true;
+        }
+        else if (arg == 0 && ++arg)
+        {
+            drift_ppm = atof(argv[i]);
+        }
+        else if (arg == 1 && ++arg)
+        {
+            jitter_us = atof(argv[i]);
+        }
+        else
+        {
+            seed = (unsigned)atoi(argv[i]);
+        }
+    }
+
+    // The summary goes to the real stdout, the clock's log only with -v
+    FILE *out = fdopen(dup(fileno(stdout)), "w");
+    if (out == nullptr || (!verbose && freopen("/dev/null", "w", stdout) == nullptr))
+    {
+        return 1;
+    }
+    fprintf(out, "drift %.1f ppm, jitter %.0f us, %.0f hours\n", drift_ppm, jitter_us, SIM_RUN_US / 3600e6);
+    fprintf(out, "run        early ppb  2 ppm min  seed min  last hour us  poll\n");
+    fflush(out);
+
+    int failures = 0;
+    for (int r = 0; r < SIM_RUNS; ++r)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            srand(seed);
+            exit(run((SIM_RUN)r, out));
+        }
+        int status = 1;
+        if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            ++failures;
+        }
+    }
+    return failures != 0;
+}
@@ -0,0 +1,365 @@
+/* Host check for when the display changes against the second edge
+
+   Builds display.cxx on a PC with clock.cxx, animation.cxx and
+   ht16k33_i2c.cxx. The display loop that would run on core 1 runs on the
+   only thread. Its clock is a simulated crystal that runs fast and is
+   disciplined by NTP samples with Gaussian network jitter, taken whenever
+   the clock asks for them, so they often land while the loop sleeps.
+   Waking from sleep takes a random time up to half a millisecond. Part
+   way through, the true time steps back as a server correction would, so
+   the second edge moves while the loop is asleep.
+
+   The fake I2C transport works out when each write finishes on the bus
+   at 400 kHz and notes every write that toggles the colon. For each toggle
+   it works out how far from the second edge it landed, both by the clock's
+   own reckoning, which is what the display loop controls, and against the
+   true time, which adds the clock's own error.
+
+   It prints the mean and worst error of both, the longest the loop spun
+   waiting for an edge and how many seconds were missed or shown twice.
+   It exits non-zero if, once the clock has settled, a toggle lands more
+   than a millisecond from the clock's edge, shows the wrong second, a
+   second is missed, or the loop ever spins for longer than its lead. The
+   few seconds after the step are not checked.
+
+   From the top of the repository
+
+   g++ -std=c++17 -Wall -Wextra -Isim -I. sim/display_phase_sim.cxx display.cxx clock.cxx animation.cxx ht16k33_i2c.cxx -o display_phase_sim
+   ./display_phase_sim [minutes] [seed] [-v]
+
+   -v shows the clock's own log as well.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "animation.h"
+#include "boot_timeline.h"
+#include "clock.h"
+#include "display.h"
+#include "health.h"
+#include "ht16k33.h"
+#include "i2c_async.h"
+#include "localtime.h"
+#include "power.h"
+#include "preferences.h"
+#include "tempco.h"
+#include "pico/multicore.h"
+
+#define SIM_START_UTC_US (1760000000 * 1000000LL)
+#define SIM_DRIFT_PPM 37
+#define SIM_JITTER_US 500
+#define SIM_DELAY_US 20000
+// Wake up from sleep takes at least this, plus up to the jitter
+#define SIM_WAKE_MIN_US 20
+#define SIM_WAKE_JITTER_US 500
+// The true time steps back by this much, mid second, after twenty minutes
+#define SIM_STEP_AT_US (20 * 60 * 1000000ull + 300000)
+#define SIM_STEP_US -400000
+#define SIM_STEP_SKIP_US 3000000
+#define SIM_RAM_SIZE 16
+#define SIM_COLON_BYTE (ANIM_COLON_POSITION * 2)
+// Pass marks, the spin is DISPLAY_LEAD_US
+#define SIM_SETTLE_US (10 * 60 * 1000000ull)
+#define SIM_MAX_ERROR_US 1000
+#define SIM_MAX_SPIN_US 2000
+
+static uint64_t now_us;
+static uint64_t run_us = 40 * 60 * 1000000ull;
+static uint64_t next_sample_us;
+static bool step_sampled;
+static uint64_t bus_free_us;
+static int colon = -1;
+static FILE *out;
+
+// What the toggles looked like once settled
+static uint32_t checked;
+static double sum_us;
+static double true_sum_us;
+static int64_t worst_us;
+static int64_t true_worst_us;
+static int64_t last_second = -1;
+static uint32_t missed;
+static uint32_t doubled;
+static uint32_t wrong;
+static uint64_t max_spin_us;
+
+Preferences prefs;
+
+uint64_t time_us_64()
+{
+    return now_us;
+}
+
+bool prefs_drift_valid()
+{
+    return false;
+}
+
+void prefs_save()
+{
+}
+
+void tempco_add_frequency(int32_t, uint64_t)
+{
+}
+
+void tempco_sample()
+{
+}
+
+void boot_begin(BOOT_PHASE)
+{
+}
+
+void boot_end(BOOT_PHASE)
+{
+}
+
+void boot_end_at(BOOT_PHASE, uint64_t)
+{
+}
+
+int health_register(const char *, uint32_t)
+{
+    return 0;
+}
+
+void health_beat(int)
+{
+}
+
+uint32_t power_get_clock_generation()
+{
+    return 0;
+}
+
+bool localtime_get_time_at(time_t tt, struct tm *buf)
+{
+    return gmtime_r(&tt, buf) != nullptr;
+}
+
+static double gaussian()
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// A fast crystal counts more microseconds than have really passed
+static int64_t true_utc_us(uint64_t local_us)
+{
+    int64_t utc = SIM_START_UTC_US + (int64_t)(local_us / (1 + SIM_DRIFT_PPM / 1e6));
+    return local_us >= SIM_STEP_AT_US ? utc + SIM_STEP_US : utc;
+}
+
+static void finish()
+{
+    fprintf(out, "%lu toggles checked\n", (unsigned long)checked);
+    if (checked > 0)
+    {
+        fprintf(out, "clock edge mean %.0f us, worst %lld us\n", sum_us / checked, (long long)worst_us);
+        fprintf(out, "true edge mean %.0f us, worst %lld us\n", true_sum_us / checked, (long long)true_worst_us);
+    }
+    fprintf(out, "longest spin %llu us, %lu missed, %lu shown twice, %lu wrong\n",
+        (unsigned long long)max_spin_us, (unsigned long)missed, (unsigned long)doubled, (unsigned long)wrong);
+
+    bool ok = checked > 0 && llabs(worst_us) <= SIM_MAX_ERROR_US && max_spin_us <= SIM_MAX_SPIN_US &&
+        missed == 0 && doubled == 0 && wrong == 0;
+    if (!ok)
+    {
+        fprintf(out, "FAIL\n");
+    }
+    fflush(out);
+    exit(ok ? 0 : 1);
+}
+
+// Time moves on, with any NTP samples due on the way
+static void advance_to(uint64_t t)
+{
+    while (next_sample_us <= t)
+    {
+        now_us = next_sample_us > now_us ? next_sample_us : now_us;
+        int64_t error_us = clock_local_to_utc_us(now_us) - true_utc_us(now_us);
+        clock_update(-error_us + (int64_t)(gaussian() * SIM_JITTER_US), SIM_DELAY_US, now_us);
+        next_sample_us = now_us + clock_get_poll_interval_ms() * 1000ull;
+        if (!step_sampled && next_sample_us > SIM_STEP_AT_US)
+        {
+            // Sample straight after the step, while the loop is asleep
+            next_sample_us = SIM_STEP_AT_US;
+            step_sampled = true;
+        }
+    }
+    now_us = t > now_us ? t : now_us;
+    if (now_us >= run_us)
+    {
+        finish();
+    }
+}
+
+void power_idle_until(absolute_time_t due, const volatile uint32_t *)
+{
+    advance_to(due + SIM_WAKE_MIN_US + rand() % SIM_WAKE_JITTER_US);
+}
+
+void busy_wait_until(absolute_time_t t)
+{
+    if (t > now_us && t - now_us > max_spin_us)
+    {
+        max_spin_us = t - now_us;
+    }
+    advance_to(t);
+}
+
+void multicore_launch_core1(void (*entry)())
+{
+    entry();
+}
+
+static void note_toggle(bool on, uint64_t at_us)
+{
+    int64_t utc = clock_local_to_utc_us(at_us);
+    int64_t second = (utc + 500000) / 1000000;
+    int64_t error_us = utc - second * 1000000;
+    int64_t true_utc = true_utc_us(at_us);
+    int64_t true_error_us = true_utc - (true_utc + 500000) / 1000000 * 1000000;
+
+    if (at_us < SIM_SETTLE_US || (at_us >= SIM_STEP_AT_US && at_us < SIM_STEP_AT_US + SIM_STEP_SKIP_US))
+    {
+        last_second = -1;
+        return;
+    }
+    ++checked;
+    sum_us += error_us;
+    true_sum_us += true_error_us;
+    if (llabs(error_us) > llabs(worst_us))
+    {
+        worst_us = error_us;
+    }
+    if (llabs(true_error_us) > llabs(true_worst_us))
+    {
+        true_worst_us = true_error_us;
+    }
+    // The colon is lit on even seconds
+    if (on != ((second & 1) == 0))
+    {
+        ++wrong;
+    }
+    if (last_second >= 0 && second > last_second + 1)
+    {
+        missed += second - last_second - 1;
+    }
+    if (last_second >= 0 && second <= last_second)
+    {
+        ++doubled;
+    }
+    last_second = second;
+}
+
+bool i2c_async_init(i2c_inst_t *, unsigned, unsigned, unsigned)
+{
+    return true;
+}
+
+bool i2c_async_write(uint8_t addr, const uint8_t *data, size_t len, I2C_ASYNC_DONE_FN done, void *arg)
+{
+    if (len == 0 || len > I2C_ASYNC_MAX_LEN)
+    {
+        return false;
+    }
+
+    // Each byte and the address byte take 9 clocks at 400 kHz, plus start
+    // and stop
+    uint64_t write_us = ((len + 1) * 9 + 2) * 1000000ull / 400000;
+    bus_free_us = (bus_free_us > now_us ? bus_free_us : now_us) + write_us;
+
+    // Display RAM from the address in the command on
+    uint8_t cmd = data[0];
+    if (addr == HT16K33_BASE_ADDR && cmd < SIM_RAM_SIZE && cmd <= SIM_COLON_BYTE &&
+        SIM_COLON_BYTE < cmd + len - 1)
+    {
+        int on = data[SIM_COLON_BYTE - cmd + 1] != 0;
+        if (colon >= 0 && on != colon)
+        {
+            note_toggle(on, bus_free_us);
+        }
+        colon = on;
+    }
+
+    // Call back as the interrupt would, at the time the write finishes
+    if (done != nullptr)
+    {
+        uint64_t t = now_us;
+        now_us = bus_free_us;
+        done(true, arg);
+        now_us = t;
+    }
+    return true;
+}
+
+bool i2c_async_busy()
+{
+    return now_us < bus_free_us;
+}
+
+// The fake queue never fills
+int i2c_async_space()
+{
+    return 32;
+}
+
+void i2c_async_poll()
+{
+}
+
+bool i2c_async_retune()
+{
+    return true;
+}
+
+void i2c_async_get_stats(I2C_ASYNC_STATS_T *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    unsigned seed = 1;
+    int arg = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+        {
+            verbose = true;
+        }
+        else if (arg == 0 && ++arg)
+        {
+            run_us = atoi(argv[i]) * 60 * 1000000ull;
+        }
+        else
+        {
+            seed = (unsigned)atoi(argv[i]);
+        }
+    }
+    srand(seed);
+
+    // The summary goes to the real stdout, the clock's log only with -v
+    out = fdopen(dup(fileno(stdout)), "w");
+    if (out == nullptr || (!verbose && freopen("/dev/null", "w", stdout) == nullptr))
+    {
+        return 1;
+    }
+    fprintf(out, "drift %d ppm, jitter %d us, %.0f minutes, step of %d us at %.1f s\n", SIM_DRIFT_PPM,
+        SIM_JITTER_US, run_us / 60e6, SIM_STEP_US, SIM_STEP_AT_US / 1e6);
+    fflush(out);
+
+    clock_init();
+    // Never returns, finish() ends the run
+    display_start();
+    return 1;
+}
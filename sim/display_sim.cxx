@@ -0,0 +1,359 @@
+/* Host simulator for the display code
+
+   Builds ht16k33_i2c.cxx and animation.cxx on a PC against a fake I2C
+   transport. The fake decodes every HT16K33 command into the state of the
+   chip it was sent to, counts the bus traffic and works out the bus time.
+   The simulator then runs the clock for a while, with a scrolling message
+   and a fade part way through, draws each 7 segment frame in the terminal
+   as it changes and prints the bus totals at the end. Run it before and
+   after changing the display code to check what is shown and what it
+   costs in bus time.
+
+   It also checks what it sees. At every second edge outside the message
+   the time display must show that second's time, with the colon lit on
+   even seconds, at the brightness expected before or after the fade, and
+   the date display must show the date. A run of the default length must
+   also come to the bus totals below, so a change to the traffic shows up
+   even when the frames are right. Any difference is printed and the
+   simulator exits non-zero. A change that alters the traffic on purpose
+   updates the totals.
+
+   From the top of the repository
+
+   g++ -std=c++17 -Wall -Wextra -Isim -I. sim/display_sim.cxx ht16k33_i2c.cxx animation.cxx -o display_sim
+   ./display_sim [seconds] [-q]
+
+   -q prints only the totals.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "animation.h"
+#include "ht16k33.h"
+#include "i2c_async.h"
+
+#define SIM_START_SECONDS (12 * 3600 + 34 * 60 + 50)
+#define SIM_MESSAGE_AT 5
+// Edges from the message on that are not checked, it is gone well before
+#define SIM_MESSAGE_EDGES 4
+#define SIM_FADE_AT 25
+#define SIM_FADE_MS 2000
+#define SIM_BRIGHTNESS 6
+#define SIM_DATE "19 10"
+#define SIM_RAM_SIZE 16
+// Bus totals expected from a run of the default length
+#define SIM_DEFAULT_SECONDS 40
+#define SIM_GOLDEN_COMMITS 56
+#define SIM_GOLDEN_TRANSACTIONS 73
+#define SIM_GOLDEN_BYTES 301
+
+// What the chip at each address has been told
+struct SIM_CHIP_T
+{
+    bool running;
+    bool on;
+    int blink;
+    int brightness;
+    uint8_t ram[SIM_RAM_SIZE];
+};
+
+static uint64_t now_us;
+static SIM_CHIP_T chips[HT16K33_MAX_DISPLAYS];
+static SIM_CHIP_T shown[HT16K33_MAX_DISPLAYS];
+static unsigned bus_baud;
+static uint64_t bus_us;
+// When the simulated bus gets through what has been queued
+static uint64_t bus_free_us;
+static uint32_t unknown_commands;
+static uint32_t bad_frames;
+static I2C_ASYNC_STATS_T stats;
+
+uint64_t time_us_64()
+{
+    return now_us;
+}
+
+bool i2c_async_init(i2c_inst_t *, unsigned, unsigned, unsigned baud)
+{
+    bus_baud = baud;
+    return true;
+}
+
+static void decode(SIM_CHIP_T *chip, const uint8_t *data, size_t len)
+{
+    uint8_t cmd = data[0];
+    switch (cmd & 0xf0)
+    {
+        case 0x00:
+            // Display RAM from this address on, wrapping at the end
+            for (size_t i = 1; i < len; ++i)
+            {
+                chip->ram[(cmd + i - 1) % SIM_RAM_SIZE] = data[i];
+            }
+            break;
+        case 0x20:
+            chip->running = cmd & 1;
+            break;
+        case 0x80:
+            chip->on = cmd & 1;
+            chip->blink = (cmd >> 1) & 3;
+            break;
+        case 0xa0:
+            // ROW/INT output, the displays only use ROW
+            break;
+        case 0xe0:
+            chip->brightness = cmd & 0xf;
+            break;
+        default:
+            ++unknown_commands;
+            break;
+    }
+}
+
+bool i2c_async_write(uint8_t addr, const uint8_t *data, size_t len, I2C_ASYNC_DONE_FN done, void *arg)
+{
+    if (len == 0 || len > I2C_ASYNC_MAX_LEN)
+    {
+        return false;
+    }
+
+    // Each byte and the address byte take 9 clocks, plus start and stop
+    uint64_t write_us = ((len + 1) * 9 + 2) * 1000000ull / bus_baud;
+    bus_free_us = (bus_free_us > now_us ? bus_free_us : now_us) + write_us;
+    bus_us += write_us;
+
+    bool ok = addr >= HT16K33_BASE_ADDR && addr < HT16K33_BASE_ADDR + HT16K33_MAX_DISPLAYS;
+    if (ok)
+    {
+        decode(&chips[addr - HT16K33_BASE_ADDR], data, len);
+        ++stats.transactions;
+        stats.bytes += len;
+    }
+    else
+    {
+        ++stats.aborts;
+    }
+
+    // Call back as the interrupt would, at the time the write finishes
+    if (done != nullptr)
+    {
+        uint64_t t = now_us;
+        now_us = bus_free_us;
+        done(ok, arg);
+        now_us = t;
+    }
+    return true;
+}
+
+bool i2c_async_busy()
+{
+    return now_us < bus_free_us;
+}
+
+// The fake queue never fills
+int i2c_async_space()
+{
+    return 32;
+}
+
+void i2c_async_poll()
+{
+}
+
+void i2c_async_get_stats(I2C_ASYNC_STATS_T *s)
+{
+    *s = stats;
+}
+
+// Three text rows per digit, segments a to g are bits 0 to 6 and the
+// decimal point bit 7
+static void draw(int index)
+{
+    const SIM_CHIP_T *chip = &chips[index];
+    char rows[3][32];
+    int col = 0;
+    for (int pos = 0; pos < ANIM_POSITIONS; ++pos)
+    {
+        uint8_t s = chip->on ? chip->ram[pos * 2] : 0;
+        if (pos == ANIM_COLON_POSITION)
+        {
+            rows[0][col] = ' ';
+            rows[1][col] = s ? '.' : ' ';
+            rows[2][col] = s ? '.' : ' ';
+            ++col;
+            continue;
+        }
+        rows[0][col] = ' ';
+        rows[0][col + 1] = s & 0x01 ? '_' : ' ';
+        rows[0][col + 2] = ' ';
+        rows[1][col] = s & 0x20 ? '|' : ' ';
+        rows[1][col + 1] = s & 0x40 ? '_' : ' ';
+        rows[1][col + 2] = s & 0x02 ? '|' : ' ';
+        rows[2][col] = s & 0x10 ? '|' : ' ';
+        rows[2][col + 1] = s & 0x08 ? '_' : ' ';
+        rows[2][col + 2] = s & 0x04 ? '|' : ' ';
+        rows[0][col + 3] = ' ';
+        rows[1][col + 3] = ' ';
+        rows[2][col + 3] = s & 0x80 ? '.' : ' ';
+        col += 4;
+    }
+    for (int r = 0; r < 3; ++r)
+    {
+        rows[r][col] = '\0';
+    }
+    printf("%9.3f 0x%02x %s  brightness %2d%s\n", now_us / 1e6, HT16K33_BASE_ADDR + index, rows[0],
+        chip->brightness, chip->running ? "" : " standby");
+    printf("%14s %s\n%14s %s\n", "", rows[1], "", rows[2]);
+}
+
+// Whether a chip shows str, as the time display would at brightness
+static bool shows(int index, const char *str, bool colon, int brightness)
+{
+    const SIM_CHIP_T *chip = &chips[index];
+    if (!chip->running || !chip->on || chip->brightness != brightness)
+    {
+        return false;
+    }
+    for (int pos = 0; pos < ANIM_POSITIONS; ++pos)
+    {
+        uint16_t want = ht16k33_char_pattern(str[pos]);
+        if (pos == ANIM_COLON_POSITION)
+        {
+            want = colon ? 0xff : 0;
+        }
+        if (chip->ram[pos * 2] != (want & 0xff) || chip->ram[pos * 2 + 1] != want >> 8)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_edge(int s, const char *dbuf, bool colon)
+{
+    if (s >= SIM_MESSAGE_AT && s < SIM_MESSAGE_AT + SIM_MESSAGE_EDGES)
+    {
+        return;
+    }
+    int brightness = s < SIM_FADE_AT + SIM_FADE_MS / 1000 ? SIM_BRIGHTNESS : 0;
+    // Mid fade it is somewhere in between
+    if (s >= SIM_FADE_AT && s < SIM_FADE_AT + SIM_FADE_MS / 1000)
+    {
+        brightness = chips[0].brightness;
+    }
+    if (!shows(0, dbuf, colon, brightness) || !shows(1, SIM_DATE, false, brightness))
+    {
+        printf("FAIL %9.3f should show %s%s at brightness %d\n", now_us / 1e6, dbuf, colon ? " with the colon" : "",
+            brightness);
+        ++bad_frames;
+    }
+}
+
+static void draw_changes(bool quiet)
+{
+    for (int i = 0; i < HT16K33_MAX_DISPLAYS; ++i)
+    {
+        if (memcmp(&chips[i], &shown[i], sizeof(chips[i])) != 0)
+        {
+            shown[i] = chips[i];
+            if (!quiet)
+            {
+                draw(i);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = SIM_DEFAULT_SECONDS;
+    bool quiet = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            quiet = true;
+        }
+        else
+        {
+            seconds = atoi(argv[i]);
+        }
+    }
+
+    ht16k33_init();
+    HT16K33_T *time_display = ht16k33_add(HT16K33_BASE_ADDR);
+    HT16K33_T *date_display = ht16k33_add(HT16K33_BASE_ADDR + 1);
+    anim_fade_to(SIM_BRIGHTNESS, 0, now_us);
+    ht16k33_display_string(date_display, SIM_DATE);
+
+    DISPLAY_MESSAGE_T msg = {};
+    strcpy(msg.text, "Hello. 12.5");
+    msg.effect = DISPLAY_SCROLL;
+
+    uint32_t frames = 0;
+    for (int s = 0; s < seconds; ++s)
+    {
+        uint64_t edge = (s + 1) * 1000000ull;
+        // Animation frames up to the edge, as the display loop runs them
+        while (anim_next_frame_us() < edge)
+        {
+            now_us = anim_next_frame_us() > now_us ? anim_next_frame_us() : now_us;
+            anim_render(time_display, now_us);
+            frames += ht16k33_commit();
+            draw_changes(quiet);
+        }
+
+        now_us = edge;
+        int t = SIM_START_SECONDS + s + 1;
+        char dbuf[6];
+        snprintf(dbuf, sizeof(dbuf), "%2d %02d", t / 3600 % 24, t / 60 % 60);
+        uint16_t frame[ANIM_POSITIONS];
+        for (int pos = 0; pos < ANIM_POSITIONS; ++pos)
+        {
+            frame[pos] = ht16k33_char_pattern(dbuf[pos]);
+        }
+        frame[ANIM_COLON_POSITION] = (t & 1) == 0 ? 0xff : 0;
+
+        if (s == SIM_MESSAGE_AT)
+        {
+            anim_add_message(&msg, now_us);
+        }
+        if (s == SIM_FADE_AT)
+        {
+            anim_fade_to(0, SIM_FADE_MS, now_us);
+        }
+        anim_set_base(frame, now_us);
+        anim_render(time_display, now_us);
+        frames += ht16k33_commit();
+        draw_changes(quiet);
+        check_edge(s, dbuf, (t & 1) == 0);
+    }
+
+    double secs = seconds > 0 ? seconds : 1;
+    printf("%d seconds, %lu commits, %lu transactions, %lu bytes, %llu us bus time at %u kHz\n",
+        seconds, (unsigned long)frames, (unsigned long)stats.transactions, (unsigned long)stats.bytes,
+        (unsigned long long)bus_us, bus_baud / 1000);
+    printf("per second %.1f transactions, %.1f bytes, %.0f us bus time, %.3f%% bus load\n",
+        stats.transactions / secs, stats.bytes / secs, bus_us / secs, bus_us / secs / 1e4);
+    bool ok = bad_frames == 0;
+    if (stats.aborts || unknown_commands)
+    {
+        printf("%lu writes to no display, %lu unknown commands\n", (unsigned long)stats.aborts,
+            (unsigned long)unknown_commands);
+        ok = false;
+    }
+    if (seconds == SIM_DEFAULT_SECONDS && (frames != SIM_GOLDEN_COMMITS ||
+        stats.transactions != SIM_GOLDEN_TRANSACTIONS || stats.bytes != SIM_GOLDEN_BYTES))
+    {
+        printf("FAIL expected %d commits, %d transactions and %d bytes\n", SIM_GOLDEN_COMMITS,
+            SIM_GOLDEN_TRANSACTIONS, SIM_GOLDEN_BYTES);
+        ok = false;
+    }
+    if (bad_frames > 0)
+    {
+        printf("FAIL %lu frames wrong\n", (unsigned long)bad_frames);
+    }
+    return ok ? 0 : 1;
+}
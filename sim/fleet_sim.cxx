@@ -0,0 +1,734 @@
+/* Host simulation of a fleet of clocks
+
+   Runs several clocks on one machine, each in its own process with its
+   own build of fleet.cxx and clock.cxx, since both keep their state in
+   file statics. Each clock has a crystal that is out by a few tens of ppm
+   and boots at a slightly different time. The parent process plays the
+   network between them and steps them all in one simulated time, so a run
+   is the same every time for a given seed. Multicast goes to every other
+   clock and a unicast to one. Both take a base delay plus random queuing
+   and a small share is lost.
+
+   Upstream NTP is stood in for inside each clock. While fleet_wants_ntp()
+   is true it samples the true time at the clock's poll interval, with
+   network jitter, and ntp_poll_soon() brings the next sample forward.
+   Each sample counts as one upstream round.
+
+   Half way through, the leader is switched off. The run checks that:
+
+   - the fleet settles on exactly one leader, followed by every other clock;
+   - once settled only the leader goes upstream;
+   - a new leader takes over within SIM_FAILOVER_US of losing the old one;
+   - every clock stays within SIM_MAX_SPREAD_US of every other in the last
+     part of each half.
+
+   It prints the role changes, upstream rounds per clock, and the worst
+   spread and error against the true time in each half. It exits non-zero
+   if a check fails.
+
+   From the top of the repository
+
+   g++ -std=c++17 -O2 -Wall -Wextra -Isim -I. sim/fleet_sim.cxx fleet.cxx clock.cxx -o fleet_sim
+   ./fleet_sim [clocks] [minutes] [seed] [-v]
+
+   -v shows each clock's own log as well.
+*/
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "fleet.h"
+#include "ntp.h"
+#include "preferences.h"
+#include "lwip/igmp.h"
+#include "lwip/timeouts.h"
+#include "lwip/udp.h"
+#include "pico/unique_id.h"
+
+#define SIM_MAX_CLOCKS 16
+#define SIM_START_UTC_US (1760000000 * 1000000LL)
+#define SIM_MAX_DRIFT_PPM 50
+#define SIM_BOOT_SPREAD_US 5000000
+// LAN delay, one way
+#define SIM_LAN_DELAY_US 1500
+#define SIM_LAN_QUEUE_US 500
+#define SIM_LOSS_PERCENT 1
+// Upstream NTP, round trip and the jitter each sample carries
+#define SIM_NTP_RTT_US 30000
+#define SIM_NTP_JITTER_US 1000
+// How often the parent looks at every clock
+#define SIM_SAMPLE_US 10000000
+// Pass marks
+#define SIM_SETTLE_US (2 * 60 * 1000000LL)
+#define SIM_FAILOVER_US (60 * 1000000LL)
+#define SIM_MAX_SPREAD_US 5000
+#define SIM_MSG_MAX 64
+#define SIM_MAX_SENT 8
+#define SIM_MAX_TIMERS 8
+#define SIM_MAX_PENDING 4096
+
+enum SIM_COMMAND
+{
+    // Run timers due up to the time
+    SIM_RUN,
+    // Hand over a packet at the time
+    SIM_DELIVER,
+    // Report the clock's error at the time
+    SIM_SAMPLE,
+    SIM_EXIT,
+};
+
+struct SIM_PACKET_T
+{
+    // Clock index of the sender and, for unicast, the receiver, -1 for the group
+    int from;
+    int to;
+    uint16_t port;
+    uint16_t len;
+    uint8_t data[SIM_MSG_MAX];
+};
+
+struct SIM_REQUEST_T
+{
+    SIM_COMMAND command;
+    uint64_t true_us;
+    SIM_PACKET_T packet;
+};
+
+struct SIM_REPLY_T
+{
+    // True time of the next timer, UINT64_MAX for none
+    uint64_t next_us;
+    FLEET_ROLE role;
+    int64_t error_us;
+    uint32_t ntp_rounds;
+    int sent_count;
+    SIM_PACKET_T sent[SIM_MAX_SENT];
+};
+
+struct SIM_TIMER_T
+{
+    uint64_t due_local_us;
+    sys_timeout_handler handler;
+    void *arg;
+};
+
+// Each clock's view, in its own process
+static int index_;
+static uint64_t boot_us;
+static double drift_ppm;
+static uint64_t now_us;
+static SIM_TIMER_T timers[SIM_MAX_TIMERS];
+static int timer_count;
+static udp_recv_fn fleet_recv_fn;
+static SIM_REPLY_T reply;
+static bool have_reference;
+static NTP_REFERENCE_T reference;
+static uint64_t next_ntp_us;
+static uint32_t ntp_rounds;
+static bool ntp_pending;
+
+const ip_addr_t ip_addr_any = { 0 };
+Preferences prefs;
+
+uint64_t time_us_64()
+{
+    return now_us;
+}
+
+static uint64_t local_at(uint64_t true_us)
+{
+    return (uint64_t)((true_us - boot_us) * (1 + drift_ppm / 1e6));
+}
+
+static uint64_t true_at(uint64_t local_us)
+{
+    return boot_us + (uint64_t)ceil(local_us / (1 + drift_ppm / 1e6));
+}
+
+static int64_t true_utc_us(uint64_t true_us)
+{
+    return SIM_START_UTC_US + (int64_t)true_us;
+}
+
+bool prefs_drift_valid()
+{
+    return false;
+}
+
+void prefs_save()
+{
+}
+
+void tempco_add_frequency(int32_t, uint64_t)
+{
+}
+
+void wifi_pm_note_traffic(uint32_t)
+{
+}
+
+void pico_get_unique_board_id(pico_unique_board_id_t *id_out)
+{
+    memset(id_out, 0, sizeof(*id_out));
+    id_out->id[0] = (uint8_t)index_;
+    id_out->id[7] = 0x5a;
+}
+
+int ipaddr_aton(const char *, ip_addr_t *addr)
+{
+    addr->addr = 0xefff434c;
+    return 1;
+}
+
+const char *ipaddr_ntoa(const ip_addr_t *addr)
+{
+    static char buf[24];
+    snprintf(buf, sizeof(buf), "clock %d", (int)addr->addr - 1);
+    return buf;
+}
+
+err_t igmp_joingroup(const ip4_addr_t *, const ip4_addr_t *)
+{
+    return ERR_OK;
+}
+
+struct pbuf *pbuf_alloc(pbuf_layer, u16_t length, pbuf_type)
+{
+    struct pbuf *p = (struct pbuf *)calloc(1, sizeof(struct pbuf) + length);
+    p->payload = p + 1;
+    p->len = p->tot_len = length;
+    p->ref = 1;
+    return p;
+}
+
+u8_t pbuf_free(struct pbuf *p)
+{
+    if (--p->ref == 0)
+    {
+        free(p);
+        return 1;
+    }
+    return 0;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset)
+{
+    if (offset >= p->len)
+    {
+        return 0;
+    }
+    u16_t n = p->len - offset < len ? p->len - offset : len;
+    memcpy(dataptr, (const uint8_t *)p->payload + offset, n);
+    return n;
+}
+
+u8_t pbuf_remove_header(struct pbuf *, size_t)
+{
+    return 0;
+}
+
+struct udp_pcb *udp_new_ip_type(u8_t)
+{
+    return (struct udp_pcb *)&fleet_recv_fn;
+}
+
+err_t udp_bind(struct udp_pcb *, const ip_addr_t *, u16_t)
+{
+    return ERR_OK;
+}
+
+void udp_recv(struct udp_pcb *, udp_recv_fn recv, void *)
+{
+    fleet_recv_fn = recv;
+}
+
+void udp_remove(struct udp_pcb *)
+{
+}
+
+err_t udp_sendto(struct udp_pcb *, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port)
+{
+    if (reply.sent_count < SIM_MAX_SENT && p->len <= SIM_MSG_MAX)
+    {
+        SIM_PACKET_T *s = &reply.sent[reply.sent_count++];
+        s->from = index_;
+        s->to = dst_ip->addr == 0xefff434c ? -1 : (int)dst_ip->addr - 1;
+        s->port = dst_port;
+        s->len = p->len;
+        memcpy(s->data, p->payload, p->len);
+    }
+    return ERR_OK;
+}
+
+void sys_timeout(u32_t msecs, sys_timeout_handler handler, void *arg)
+{
+    if (timer_count < SIM_MAX_TIMERS)
+    {
+        timers[timer_count++] = { now_us + msecs * 1000ull, handler, arg };
+    }
+}
+
+bool ntp_get_reference(NTP_REFERENCE_T *ref)
+{
+    if (!have_reference || !clock_is_synced())
+    {
+        return false;
+    }
+    *ref = reference;
+    return true;
+}
+
+void ntp_poll_soon()
+{
+    next_ntp_us = now_us;
+}
+
+static double gaussian()
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// The main loop's ntp_task() and the reply to the round it starts
+static void ntp_model(void *)
+{
+    if (ntp_pending)
+    {
+        ntp_pending = false;
+        // The offset as measured at the middle of the round trip
+        uint64_t mid_us = now_us - SIM_NTP_RTT_US / 2;
+        int64_t offset = true_utc_us(true_at(mid_us)) - clock_local_to_utc_us(mid_us) +
+            (int64_t)(gaussian() * SIM_NTP_JITTER_US);
+        clock_update(offset, SIM_NTP_RTT_US, mid_us);
+        have_reference = true;
+        reference.stratum = 2;
+        reference.ref_id = 0x0a000001;
+        reference.ref_local_us = now_us;
+        reference.root_delay_us = SIM_NTP_RTT_US;
+        reference.root_dispersion_us = 1000;
+        next_ntp_us = now_us + clock_get_poll_interval_ms() * 1000ull;
+    }
+    else if (fleet_wants_ntp() && (int64_t)(now_us - next_ntp_us) >= 0)
+    {
+        ++ntp_rounds;
+        ntp_pending = true;
+        sys_timeout(SIM_NTP_RTT_US / 1000, ntp_model, nullptr);
+        return;
+    }
+    sys_timeout(1000, ntp_model, nullptr);
+}
+
+static void run_timers(uint64_t until_true_us)
+{
+    while (true)
+    {
+        int first = -1;
+        for (int i = 0; i < timer_count; ++i)
+        {
+            if (first < 0 || timers[i].due_local_us < timers[first].due_local_us)
+            {
+                first = i;
+            }
+        }
+        if (first < 0 || true_at(timers[first].due_local_us) > until_true_us)
+        {
+            return;
+        }
+        SIM_TIMER_T t = timers[first];
+        timers[first] = timers[--timer_count];
+        now_us = t.due_local_us;
+        t.handler(t.arg);
+    }
+}
+
+static void fill_reply(uint64_t true_us)
+{
+    reply.role = fleet_get_role();
+    reply.error_us = clock_local_to_utc_us(local_at(true_us)) - true_utc_us(true_us);
+    reply.ntp_rounds = ntp_rounds;
+    reply.next_us = UINT64_MAX;
+    for (int i = 0; i < timer_count; ++i)
+    {
+        uint64_t due = true_at(timers[i].due_local_us);
+        if (due < reply.next_us)
+        {
+            reply.next_us = due;
+        }
+    }
+}
+
+static void clock_process(int fd)
+{
+    clock_init();
+    now_us = 0;
+    if (!fleet_init() || fleet_get_role() == FLEET_OFF)
+    {
+        fprintf(stderr, "fleet mode is off, see sim/wifi_details.h\n");
+        exit(1);
+    }
+    sys_timeout(1000, ntp_model, nullptr);
+
+    SIM_REQUEST_T req;
+    while (read(fd, &req, sizeof(req)) == (ssize_t)sizeof(req) && req.command != SIM_EXIT)
+    {
+        reply.sent_count = 0;
+        run_timers(req.true_us);
+        now_us = local_at(req.true_us);
+        if (req.command == SIM_DELIVER)
+        {
+            struct pbuf *p = pbuf_alloc(PBUF_TRANSPORT, req.packet.len, PBUF_RAM);
+            memcpy(p->payload, req.packet.data, req.packet.len);
+            ip_addr_t from = { (uint32_t)req.packet.from + 1 };
+            fleet_recv_fn(nullptr, nullptr, p, &from, req.packet.port);
+        }
+        fill_reply(req.true_us);
+        if (write(fd, &reply, sizeof(reply)) != (ssize_t)sizeof(reply))
+        {
+            break;
+        }
+    }
+    exit(0);
+}
+
+// The parent's side
+
+struct SIM_CLOCK_T
+{
+    int fd;
+    pid_t pid;
+    bool alive;
+    SIM_REPLY_T last;
+};
+
+struct SIM_PENDING_T
+{
+    uint64_t at_us;
+    int to;
+    SIM_PACKET_T packet;
+};
+
+static const char *role_names[] = { "off", "listen", "candidate", "leader", "follower" };
+static SIM_CLOCK_T clocks[SIM_MAX_CLOCKS];
+static int clock_count = 6;
+static SIM_PENDING_T pending[SIM_MAX_PENDING];
+static int pending_count;
+static int failures;
+// The real stdout, the clocks' own logs go to stdout only with -v
+static FILE *out;
+
+static void check(bool ok, const char *what, uint64_t true_us)
+{
+    if (!ok)
+    {
+        fprintf(out, "FAIL at %.1f s: %s\n", true_us / 1e6, what);
+        ++failures;
+    }
+}
+
+static int uniform(int lo, int hi)
+{
+    return lo + (int)(rand() / (RAND_MAX + 1.0) * (hi - lo + 1));
+}
+
+static void queue_packet(const SIM_PACKET_T *packet, int to, uint64_t sent_us)
+{
+    if (!clocks[to].alive || pending_count >= SIM_MAX_PENDING || uniform(0, 99) < SIM_LOSS_PERCENT)
+    {
+        return;
+    }
+    double queue = -SIM_LAN_QUEUE_US * log((rand() + 1.0) / (RAND_MAX + 2.0));
+    pending[pending_count++] = { sent_us + SIM_LAN_DELAY_US + (uint64_t)queue, to, *packet };
+}
+
+static void request(int c, SIM_COMMAND command, uint64_t true_us, const SIM_PACKET_T *packet)
+{
+    SIM_REQUEST_T req = {};
+    req.command = command;
+    req.true_us = true_us;
+    if (packet != nullptr)
+    {
+        req.packet = *packet;
+    }
+    SIM_CLOCK_T *clk = &clocks[c];
+    if (write(clk->fd, &req, sizeof(req)) != (ssize_t)sizeof(req) ||
+        read(clk->fd, &clk->last, sizeof(clk->last)) != (ssize_t)sizeof(clk->last))
+    {
+        fprintf(out, "clock %d stopped\n", c);
+        exit(1);
+    }
+    for (int i = 0; i < clk->last.sent_count; ++i)
+    {
+        const SIM_PACKET_T *s = &clk->last.sent[i];
+        for (int to = 0; to < clock_count; ++to)
+        {
+            if (to != c && (s->to < 0 || s->to == to))
+            {
+                queue_packet(s, to, true_us);
+            }
+        }
+    }
+}
+
+static int leader_count(int *leader)
+{
+    int n = 0;
+    for (int c = 0; c < clock_count; ++c)
+    {
+        if (clocks[c].alive && clocks[c].last.role == FLEET_LEADER)
+        {
+            *leader = c;
+            ++n;
+        }
+    }
+    return n;
+}
+
+// One leader, everyone else following and only the leader going upstream
+static bool settled()
+{
+    int leader = -1;
+    if (leader_count(&leader) != 1)
+    {
+        return false;
+    }
+    for (int c = 0; c < clock_count; ++c)
+    {
+        if (clocks[c].alive && c != leader && clocks[c].last.role != FLEET_FOLLOWER)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool verbose = false;
+    int minutes = 30;
+    unsigned seed = 1;
+    int arg = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-v") == 0)
+        {
+            verbose = true;
+        }
+        else if (arg == 0 && ++arg)
+        {
+            clock_count = atoi(argv[i]);
+        }
+        else if (arg == 1 && ++arg)
+        {
+            minutes = atoi(argv[i]);
+        }
+        else
+        {
+            seed = (unsigned)atoi(argv[i]);
+        }
+    }
+    if (clock_count < 2 || clock_count > SIM_MAX_CLOCKS || minutes < 10)
+    {
+        printf("usage: fleet_sim [clocks 2 to %d] [minutes, at least 10] [seed] [-v]\n", SIM_MAX_CLOCKS);
+        return 1;
+    }
+    srand(seed);
+
+    out = fdopen(dup(fileno(stdout)), "w");
+    if (out == nullptr || (!verbose && freopen("/dev/null", "w", stdout) == nullptr))
+    {
+        return 1;
+    }
+    fflush(stdout);
+    for (int c = 0; c < clock_count; ++c)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            return 1;
+        }
+        index_ = c;
+        boot_us = (uint64_t)uniform(0, SIM_BOOT_SPREAD_US);
+        drift_ppm = uniform(-SIM_MAX_DRIFT_PPM * 10, SIM_MAX_DRIFT_PPM * 10) / 10.0;
+        unsigned child_seed = (unsigned)rand();
+        fflush(out);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            srand(child_seed);
+            clock_process(fds[1]);
+        }
+        close(fds[1]);
+        clocks[c] = { fds[0], pid, true, {} };
+        fprintf(out, "clock %d boots at %.2f s, crystal %+.1f ppm\n", c, boot_us / 1e6, drift_ppm);
+    }
+    for (int c = 0; c < clock_count; ++c)
+    {
+        request(c, SIM_RUN, 0, nullptr);
+    }
+
+    uint64_t end_us = minutes * 60 * 1000000ull;
+    uint64_t kill_us = end_us / 2;
+    uint64_t next_sample_us = SIM_SAMPLE_US;
+    uint64_t settled_at = 0;
+    uint64_t first_settled_at = 0;
+    uint64_t lost_at = 0;
+    int64_t worst_spread[2] = { 0, 0 };
+    int64_t worst_error[2] = { 0, 0 };
+    uint32_t rounds_at_settle[SIM_MAX_CLOCKS] = {};
+    bool killed = false;
+    while (true)
+    {
+        // The earliest of a timer, a delivery or a sample
+        uint64_t at = next_sample_us;
+        int which = -1;
+        int delivery = -1;
+        for (int c = 0; c < clock_count; ++c)
+        {
+            if (clocks[c].alive && clocks[c].last.next_us < at)
+            {
+                at = clocks[c].last.next_us;
+                which = c;
+            }
+        }
+        for (int i = 0; i < pending_count; ++i)
+        {
+            if (pending[i].at_us < at)
+            {
+                at = pending[i].at_us;
+                delivery = i;
+                which = -1;
+            }
+        }
+        if (at >= end_us)
+        {
+            break;
+        }
+        if (!killed && at >= kill_us)
+        {
+            int leader = -1;
+            leader_count(&leader);
+            if (leader >= 0)
+            {
+                clocks[leader].alive = false;
+                fprintf(out, "%7.1f s clock %d switched off\n", kill_us / 1e6, leader);
+                lost_at = kill_us;
+                settled_at = 0;
+            }
+            killed = true;
+        }
+
+        if (delivery >= 0)
+        {
+            SIM_PENDING_T d = pending[delivery];
+            pending[delivery] = pending[--pending_count];
+            if (clocks[d.to].alive)
+            {
+                request(d.to, SIM_DELIVER, d.at_us, &d.packet);
+            }
+        }
+        else if (which >= 0)
+        {
+            request(which, SIM_RUN, at, nullptr);
+        }
+        else
+        {
+            next_sample_us += SIM_SAMPLE_US;
+            int64_t lo = INT64_MAX;
+            int64_t hi = INT64_MIN;
+            int half = killed ? 1 : 0;
+            for (int c = 0; c < clock_count; ++c)
+            {
+                if (!clocks[c].alive)
+                {
+                    continue;
+                }
+                request(c, SIM_SAMPLE, at, nullptr);
+                int64_t e = clocks[c].last.error_us;
+                lo = e < lo ? e : lo;
+                hi = e > hi ? e : hi;
+            }
+            bool was_settled = settled_at != 0;
+            if (!was_settled && settled())
+            {
+                settled_at = at;
+                int leader = -1;
+                leader_count(&leader);
+                fprintf(out, "%7.1f s settled, clock %d leads\n", at / 1e6, leader);
+                for (int c = 0; c < clock_count; ++c)
+                {
+                    rounds_at_settle[c] = clocks[c].last.ntp_rounds;
+                }
+                if (lost_at != 0)
+                {
+                    check(at - lost_at <= SIM_FAILOVER_US, "failover took too long", at);
+                }
+                else
+                {
+                    first_settled_at = at;
+                    check(at <= SIM_SETTLE_US, "first election took too long", at);
+                }
+            }
+            else if (was_settled && !settled())
+            {
+                check(false, "the fleet came apart", at);
+                settled_at = 0;
+            }
+            // The spread over the last third of each half, once settled
+            uint64_t half_end = killed ? end_us : kill_us;
+            uint64_t half_start = killed ? kill_us : 0;
+            if (settled_at != 0 && at >= half_start + (half_end - half_start) * 2 / 3)
+            {
+                worst_spread[half] = hi - lo > worst_spread[half] ? hi - lo : worst_spread[half];
+                int64_t e = llabs(lo) > llabs(hi) ? llabs(lo) : llabs(hi);
+                worst_error[half] = e > worst_error[half] ? e : worst_error[half];
+            }
+        }
+        if (failures > 20)
+        {
+            break;
+        }
+    }
+    check(first_settled_at != 0, "no leader was ever agreed", end_us);
+
+    fprintf(out, "clock  role      upstream rounds  after settling\n");
+    for (int c = 0; c < clock_count; ++c)
+    {
+        uint32_t after = clocks[c].last.ntp_rounds - rounds_at_settle[c];
+        fprintf(out, "%5d  %-9s %15u %15u\n", c, clocks[c].alive ? role_names[clocks[c].last.role] : "off",
+            clocks[c].last.ntp_rounds, after);
+        if (clocks[c].alive && clocks[c].last.role != FLEET_LEADER && settled_at != 0)
+        {
+            check(after == 0, "a follower went upstream", end_us);
+        }
+    }
+    for (int h = 0; h < 2; ++h)
+    {
+        fprintf(out, "%s half: worst spread %lld us, worst error %lld us\n", h ? "second" : "first",
+            (long long)worst_spread[h], (long long)worst_error[h]);
+        check(worst_spread[h] <= SIM_MAX_SPREAD_US, "clocks too far apart", end_us);
+    }
+    check(settled_at != 0, "not settled at the end", end_us);
+
+    for (int c = 0; c < clock_count; ++c)
+    {
+        SIM_REQUEST_T req = {};
+        req.command = SIM_EXIT;
+        if (write(clocks[c].fd, &req, sizeof(req)) < 0)
+        {
+            kill(clocks[c].pid, SIGKILL);
+        }
+        waitpid(clocks[c].pid, nullptr, 0);
+    }
+    fflush(out);
+    return failures != 0;
+}
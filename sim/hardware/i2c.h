@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct i2c_inst i2c_inst_t;
+
+#define i2c_default ((i2c_inst_t *)nullptr)
+#define PICO_DEFAULT_I2C_SDA_PIN 4
+#define PICO_DEFAULT_I2C_SCL_PIN 5
+#define GPIO_FUNC_I2C 3
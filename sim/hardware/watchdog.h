@@ -0,0 +1,7 @@
+#pragma once
+
+// Every simulated run starts from power on
+static inline bool watchdog_caused_reboot()
+{
+    return false;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+// Just enough of lwIP for the NTP server to build on a host, see
+// ntp_server_sim.cxx
+
+#include <stdint.h>
+
+typedef int8_t err_t;
+typedef uint8_t u8_t;
+typedef uint16_t u16_t;
+typedef uint32_t u32_t;
+
+#define LWIP_UNUSED_ARG(x) (void)x
+
+#define ERR_OK 0
+#define ERR_MEM -1
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "lwip/ip_addr.h"
+
+// Provided by the simulator, which delivers to every member of the group
+extern err_t igmp_joingroup(const ip4_addr_t *ifaddr, const ip4_addr_t *groupaddr);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "lwip/err.h"
+
+// IPv4 only, host byte order
+struct ip_addr_t
+{
+    uint32_t addr;
+};
+typedef ip_addr_t ip4_addr_t;
+
+#define IPADDR_TYPE_ANY 46
+extern const ip_addr_t ip_addr_any;
+#define IP_ANY_TYPE (&ip_addr_any)
+#define IP4_ADDR_ANY4 (&ip_addr_any)
+#define ip_2_ip4(ipaddr) (ipaddr)
+
+// Provided by the simulators that need them
+extern int ipaddr_aton(const char *cp, ip_addr_t *addr);
+extern const char *ipaddr_ntoa(const ip_addr_t *addr);
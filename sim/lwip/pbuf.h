@@ -0,0 +1,29 @@
+#pragma once
+
+#include "lwip/err.h"
+
+// Single buffer pbufs only, which is all the NTP server uses
+struct pbuf
+{
+    struct pbuf *next;
+    void *payload;
+    u16_t tot_len;
+    u16_t len;
+    u8_t ref;
+};
+
+enum pbuf_layer
+{
+    PBUF_TRANSPORT
+};
+
+enum pbuf_type
+{
+    PBUF_RAM
+};
+
+// Provided by the simulator, which counts what is allocated
+extern struct pbuf *pbuf_alloc(pbuf_layer layer, u16_t length, pbuf_type type);
+extern u8_t pbuf_free(struct pbuf *p);
+extern u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset);
+extern u8_t pbuf_remove_header(struct pbuf *p, size_t header_size);
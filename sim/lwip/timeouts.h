@@ -0,0 +1,8 @@
+#pragma once
+
+#include "lwip/err.h"
+
+typedef void (*sys_timeout_handler)(void *arg);
+
+// Provided by the simulator, which runs the timers in simulated time
+extern void sys_timeout(u32_t msecs, sys_timeout_handler handler, void *arg);
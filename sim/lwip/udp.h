@@ -0,0 +1,16 @@
+#pragma once
+
+#include "lwip/ip_addr.h"
+#include "lwip/pbuf.h"
+
+struct udp_pcb;
+
+typedef void (*udp_recv_fn)(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port);
+
+// Provided by the simulator, which plays the network
+extern struct udp_pcb *udp_new_ip_type(u8_t type);
+extern err_t udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port);
+extern void udp_recv(struct udp_pcb *pcb, udp_recv_fn recv, void *recv_arg);
+extern void udp_remove(struct udp_pcb *pcb);
+static inline void udp_set_multicast_ttl(struct udp_pcb *, u8_t) {}
+extern err_t udp_sendto(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_ip, u16_t dst_port);
@@ -0,0 +1,231 @@
+/* Host check for the first NTP step under packet loss
+
+   Models the start up burst of ntp.cxx on a PC: each server gets four
+   requests 2 s apart, sent from the 100 ms round tick, a request with no
+   reply after 500 ms is sent again and up to two retries are allowed per
+   server in a 12 s round. Replies take 15 to 80 ms and a share of them is
+   dropped. After each reply the lowest delay sample from every server so
+   far goes through ntp_select.cxx, and the clock is stepped once
+   NTP_SELECT_STEP_MIN servers agree, as ntp_recv() does. A round that
+   ends without that falls back to selection over whatever replied.
+
+   Each loss rate is run with and without a falseticker one and a half
+   seconds out. The table gives the time to the first step and how many
+   rounds had to wait for the end of the round or failed. It exits
+   non-zero if any step is further from the true time than the worst
+   honest root distance, which is what a falseticker winning looks like.
+   Servers are taken to be resolved already.
+
+   From the top of the repository
+
+   g++ -std=c++17 -Wall -Wextra -I. sim/ntp_burst_sim.cxx ntp_select.cxx -o ntp_burst_sim
+   ./ntp_burst_sim [rounds] [seed]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ntp_select.h"
+
+// The same schedule as ntp.cxx, in ms
+#define SIM_TICK 100
+#define SIM_REQUEST_TIMEOUT 500
+#define SIM_BURST_COUNT 4
+#define SIM_BURST_SPACING 2000
+#define SIM_RETRIES 2
+#define SIM_ROUND_TIME 12000
+
+#define SIM_SERVERS 4
+#define SIM_MIN_RTT 15
+#define SIM_MAX_RTT 80
+// Reply root dispersion as the servers report it
+#define SIM_DISPERSION_US 1000
+// How far out the unsynchronised clock starts
+#define SIM_TRUE_OFFSET_US 3700000
+#define SIM_FALSE_ERROR_US 1500000
+// Steps further out than this came from a falseticker
+#define SIM_MAX_ERROR_US ((SIM_MAX_RTT / 2) * 1000 + SIM_DISPERSION_US)
+
+struct SIM_SERVER_T
+{
+    bool falseticker;
+    int attempts;
+    int replies;
+    bool request_sent;
+    int request_at;
+    // When the outstanding reply lands, -1 if it was lost
+    int reply_at;
+    int rtt;
+    NTP_CANDIDATE_T best;
+};
+
+struct SIM_RESULT_T
+{
+    // ms to the first step, -1 if none
+    int step_ms;
+    bool at_round_end;
+    int64_t error_us;
+};
+
+static int uniform(int lo, int hi)
+{
+    return lo + (int)(rand() / (RAND_MAX + 1.0) * (hi - lo + 1));
+}
+
+static int select_servers(SIM_SERVER_T *servers, int64_t *offset_us)
+{
+    NTP_CANDIDATE_T c[SIM_SERVERS];
+    int n = 0;
+    for (int i = 0; i < SIM_SERVERS; ++i)
+    {
+        if (servers[i].replies > 0)
+        {
+            c[n++] = servers[i].best;
+        }
+    }
+    return ntp_select(c, n, offset_us);
+}
+
+static SIM_RESULT_T run_round(int loss_percent, bool with_falseticker)
+{
+    SIM_SERVER_T servers[SIM_SERVERS] = {};
+    servers[0].falseticker = with_falseticker;
+    SIM_RESULT_T result = { -1, false, 0 };
+    int64_t offset_us;
+
+    for (int now = 0; now < SIM_ROUND_TIME; ++now)
+    {
+        for (int i = 0; i < SIM_SERVERS; ++i)
+        {
+            SIM_SERVER_T *s = &servers[i];
+            if (!s->request_sent || s->reply_at != now)
+            {
+                continue;
+            }
+            // Sample as ntp_recv() works it out, path asymmetry shows up
+            // as an offset error of up to half the round trip
+            int64_t asymmetry_us = uniform(-s->rtt * 500, s->rtt * 500);
+            NTP_CANDIDATE_T sample;
+            sample.offset_us = SIM_TRUE_OFFSET_US + (s->falseticker ? SIM_FALSE_ERROR_US : 0) + asymmetry_us;
+            sample.distance_us = s->rtt * 500 + SIM_DISPERSION_US;
+            if (s->replies == 0 || sample.distance_us < s->best.distance_us)
+            {
+                s->best = sample;
+            }
+            ++s->replies;
+            s->request_sent = false;
+
+            if (select_servers(servers, &offset_us) >= NTP_SELECT_STEP_MIN)
+            {
+                result.step_ms = now;
+                result.error_us = offset_us - SIM_TRUE_OFFSET_US;
+                return result;
+            }
+        }
+
+        if (now % SIM_TICK != 0)
+        {
+            continue;
+        }
+        // ntp_round_step()
+        for (int i = 0; i < SIM_SERVERS; ++i)
+        {
+            SIM_SERVER_T *s = &servers[i];
+            if (s->replies >= SIM_BURST_COUNT)
+            {
+                continue;
+            }
+            bool lost = false;
+            if (s->request_sent)
+            {
+                if (now - s->request_at < SIM_REQUEST_TIMEOUT)
+                {
+                    continue;
+                }
+                s->request_sent = false;
+                lost = true;
+            }
+            if (s->attempts >= SIM_BURST_COUNT + SIM_RETRIES)
+            {
+                continue;
+            }
+            if (s->attempts == 0 || lost || now - s->request_at >= SIM_BURST_SPACING)
+            {
+                s->request_sent = true;
+                s->request_at = now;
+                s->rtt = uniform(SIM_MIN_RTT, SIM_MAX_RTT);
+                s->reply_at = uniform(0, 99) < loss_percent ? -1 : now + s->rtt;
+                ++s->attempts;
+            }
+        }
+    }
+
+    // ntp_round_finished() takes whatever agrees
+    if (select_servers(servers, &offset_us) > 0)
+    {
+        result.step_ms = SIM_ROUND_TIME;
+        result.at_round_end = true;
+        result.error_us = offset_us - SIM_TRUE_OFFSET_US;
+    }
+    return result;
+}
+
+static int compare_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+int main(int argc, char **argv)
+{
+    static const int losses[] = { 0, 10, 30, 50 };
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    if (rounds <= 0)
+    {
+        return 1;
+    }
+    int *times = (int *)malloc(rounds * sizeof(int));
+    int bad_steps = 0;
+
+    printf("loss falseticker  median ms  90%% ms  round end  failed  worst error us\n");
+    for (int f = 0; f < 2; ++f)
+    {
+        for (size_t l = 0; l < sizeof(losses) / sizeof(losses[0]); ++l)
+        {
+            int ended = 0;
+            int failed = 0;
+            int64_t worst = 0;
+            for (int r = 0; r < rounds; ++r)
+            {
+                SIM_RESULT_T result = run_round(losses[l], f == 1);
+                times[r] = result.step_ms >= 0 ? result.step_ms : SIM_ROUND_TIME;
+                ended += result.at_round_end;
+                if (result.step_ms < 0)
+                {
+                    ++failed;
+                    continue;
+                }
+                int64_t error = llabs(result.error_us);
+                if (error > worst)
+                {
+                    worst = error;
+                }
+                if (error > SIM_MAX_ERROR_US)
+                {
+                    ++bad_steps;
+                }
+            }
+            qsort(times, rounds, sizeof(int), compare_int);
+            printf("%3d%% %-11s %10d %7d %9.1f%% %6.1f%% %15lld\n", losses[l], f ? "yes" : "no",
+                times[rounds / 2], times[rounds * 9 / 10], 100.0 * ended / rounds, 100.0 * failed / rounds,
+                (long long)worst);
+        }
+    }
+    free(times);
+    if (bad_steps > 0)
+    {
+        printf("FAIL %d steps followed a falseticker\n", bad_steps);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+/* Host check for NTP server selection
+
+   Builds ntp_select.cxx on a PC and feeds it rounds of replies from
+   stand-in servers. Truechimers report the true offset plus jitter within
+   their root distance, falsetickers are a fixed error away. Each round
+   checks that every falseticker was dropped, every truechimer kept, and
+   that the combined offset is within the survivors' root distance. A few
+   fixed cases cover no majority and a single server. Run it after changing
+   the selection code.
+
+   From the top of the repository
+
+   g++ -std=c++17 -Wall -Wextra -I. sim/ntp_select_sim.cxx ntp_select.cxx -o ntp_select_sim
+   ./ntp_select_sim [rounds] [seed]
+
+   Exits non-zero if any check fails.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ntp_select.h"
+
+#define SIM_MAX_SERVERS 8
+// The true offset of the local clock in every round
+#define SIM_TRUE_OFFSET_US 12345
+// A falseticker is at least this far out, well past any root distance
+#define SIM_FALSE_ERROR_US 200000
+
+static int failures;
+
+static void check(bool ok, const char *what, int round)
+{
+    if (!ok)
+    {
+        printf("FAIL round %d: %s\n", round, what);
+        ++failures;
+    }
+}
+
+static int64_t uniform(int64_t lo, int64_t hi)
+{
+    return lo + (int64_t)(rand() / (RAND_MAX + 1.0) * (hi - lo + 1));
+}
+
+// A random round, fewer than half the servers are falsetickers
+static void random_round(int round)
+{
+    NTP_CANDIDATE_T c[SIM_MAX_SERVERS];
+    bool falseticker[SIM_MAX_SERVERS];
+    int n = (int)uniform(3, SIM_MAX_SERVERS);
+    int bad = (int)uniform(0, (n - 1) / 2);
+    // Falsetickers may agree with each other, as servers behind one broken
+    // upstream would
+    int64_t shared_error = uniform(0, 1) ? SIM_FALSE_ERROR_US : -SIM_FALSE_ERROR_US;
+    bool agree = uniform(0, 1);
+    int64_t max_distance = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        c[i].distance_us = uniform(1000, 40000);
+        falseticker[i] = i < bad;
+        if (falseticker[i])
+        {
+            int64_t error = agree ? shared_error : uniform(SIM_FALSE_ERROR_US, 5 * SIM_FALSE_ERROR_US) *
+                (uniform(0, 1) ? 1 : -1);
+            c[i].offset_us = SIM_TRUE_OFFSET_US + error + uniform(-1000, 1000);
+        }
+        else
+        {
+            c[i].offset_us = SIM_TRUE_OFFSET_US + uniform(-c[i].distance_us / 2, c[i].distance_us / 2);
+            if (c[i].distance_us > max_distance)
+            {
+                max_distance = c[i].distance_us;
+            }
+        }
+    }
+
+    int64_t offset = 0;
+    int survivors = ntp_select(c, n, &offset);
+    check(survivors == n - bad, "survivors are exactly the truechimers", round);
+    for (int i = 0; i < n; ++i)
+    {
+        check(c[i].truechimer != falseticker[i], falseticker[i] ? "falseticker kept" : "truechimer dropped", round);
+    }
+    check(llabs(offset - SIM_TRUE_OFFSET_US) <= max_distance, "offset outside the survivors' distance", round);
+}
+
+static void fixed_cases()
+{
+    // Two pairs that disagree, neither is a majority
+    NTP_CANDIDATE_T split[4] = {
+        { 0, 1000, false }, { 500, 1000, false }, { 100000, 1000, false }, { 100400, 1000, false },
+    };
+    int64_t offset = 0;
+    check(ntp_select(split, 4, &offset) == 0, "no majority of two against two", -1);
+
+    // One server is trusted on its own
+    NTP_CANDIDATE_T one[1] = { { 7000, 2000, false } };
+    check(ntp_select(one, 1, &offset) == 1 && offset == 7000 && one[0].truechimer, "single server", -2);
+
+    // The closer server is weighted more heavily
+    NTP_CANDIDATE_T weighted[3] = { { 0, 1000, false }, { 3000, 4000, false }, { 1000, 2000, false } };
+    check(ntp_select(weighted, 3, &offset) == 3 && offset < 1000, "weighted by inverse distance", -3);
+
+    check(ntp_select(one, 0, &offset) == 0, "no servers", -4);
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 10000;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    fixed_cases();
+    for (int r = 0; r < rounds; ++r)
+    {
+        random_round(r);
+    }
+    printf("%d rounds, %d failures\n", rounds, failures);
+    return failures != 0;
+}
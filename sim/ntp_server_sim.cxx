@@ -0,0 +1,449 @@
+/* Host load test for the SNTP server
+
+   Builds ntp_server.cxx and clock.cxx on a PC against a stand-in for the
+   parts of lwIP the server uses, and plays a LAN of clients sending it
+   requests at a range of rates. Requests arrive at random, as from many
+   clients polling independently, and are handled one at a time in the
+   lwIP context the way the CYW43 driver hands them over. Each reply is
+   copied out to the radio before udp_sendto() returns, which takes
+   SIM_SEND_US of core 0. A reply to a client that has dropped out of
+   the ARP table is held by the stack until the ARP answer comes back, and
+   that is what ties up the preallocated reply buffers.
+
+   Every reply is checked: mode, stratum, the client's transmit timestamp
+   echoed back, the receive and transmit timestamps against the true time
+   the request was handled, and the unsynchronised alarm before the clock
+   has a reference. The handler must never take a lock, since core 1
+   reads the same timebase to drive the display and a lock there is the
+   only way the server could hold up the display loop.
+
+   For each rate the table gives the share of core 0 taken, how long
+   requests waited to be handled, which is how far late the receive
+   timestamp is, the share of replies that needed the heap, and drops.
+   It exits non-zero if a reply is wrong, the lock is taken, or anything
+   is dropped at or below SIM_PASS_RATE requests a second.
+
+   The send time and ARP figures are estimates, not measured on a board.
+   The host time per request is printed to compare builds, not as a
+   figure for the RP2040.
+
+   From the top of the repository
+
+   g++ -std=c++17 -O2 -Wall -Wextra -Isim -I. sim/ntp_server_sim.cxx ntp_server.cxx clock.cxx -o ntp_server_sim
+   ./ntp_server_sim [seconds] [seed] [arp entries]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "ntp.h"
+#include "ntp_server.h"
+#include "pico/critical_section.h"
+#include "preferences.h"
+#include "lwip/udp.h"
+
+#define SIM_START_UTC_US (1760000000 * 1000000LL)
+#define NTP_DELTA 2208988800u
+#define NTP_MSG_LEN 48
+// Time to copy a reply out to the radio over SPI
+#define SIM_SEND_US 60
+#define SIM_CLIENTS 50
+// ARP_TABLE_SIZE in lwipopts.h and a round trip to resolve a client
+#define SIM_ARP_ENTRIES 64
+#define SIM_ARP_US 3000
+// Room left on the lwIP heap for replies that miss the preallocated ones
+#define SIM_HEAP_PBUFS 16
+// Space in front of a pbuf for the UDP, IP and Ethernet headers
+#define SIM_HEADROOM 42
+// Requests before the clock has a reference get the alarm
+#define SIM_UNSYNCED_US 100000
+#define SIM_PASS_RATE 2000
+#define SIM_MAX_WAITS 1000000
+
+struct SIM_PBUF_T
+{
+    struct pbuf p;
+    uint8_t data[SIM_HEADROOM + NTP_MSG_LEN];
+    bool heap;
+};
+
+// A reply held by the stack until its client's ARP entry is back
+struct SIM_HELD_T
+{
+    struct pbuf *p;
+    uint64_t until_us;
+};
+
+struct SIM_STATS_T
+{
+    uint32_t requests;
+    uint32_t replies;
+    uint32_t heap_replies;
+    uint32_t bad_replies;
+    uint64_t busy_us;
+    uint32_t waits;
+};
+
+const ip_addr_t ip_addr_any = { 0 };
+
+static uint64_t now_us;
+// The server's own buffers are allocated at start up and kept
+static bool preallocating;
+static udp_recv_fn server_recv;
+static struct udp_pcb *server_pcb = (struct udp_pcb *)&server_recv;
+static int heap_in_use;
+static SIM_HELD_T held[SIM_HEAP_PBUFS + 8];
+static int held_count;
+static int arp_entries = SIM_ARP_ENTRIES;
+static uint32_t arp_clients[256];
+static uint64_t arp_used[256];
+static bool synced;
+// What the reply being sent should hold
+static uint64_t expect_origin;
+static int64_t expect_utc_us;
+static SIM_STATS_T stats;
+static uint32_t waits_us[SIM_MAX_WAITS];
+
+Preferences prefs;
+
+uint64_t time_us_64()
+{
+    return now_us;
+}
+
+bool prefs_drift_valid()
+{
+    return false;
+}
+
+void prefs_save()
+{
+}
+
+void tempco_add_frequency(int32_t, uint64_t)
+{
+}
+
+void wifi_pm_note_traffic(uint32_t)
+{
+}
+
+bool ntp_get_reference(NTP_REFERENCE_T *ref)
+{
+    if (!synced)
+    {
+        return false;
+    }
+    ref->stratum = 2;
+    ref->ref_id = 0xc0a80101;
+    ref->ref_local_us = SIM_UNSYNCED_US;
+    ref->root_delay_us = 20000;
+    ref->root_dispersion_us = 5000;
+    return true;
+}
+
+struct pbuf *pbuf_alloc(pbuf_layer, u16_t length, pbuf_type)
+{
+    if (length > NTP_MSG_LEN || (!preallocating && heap_in_use >= SIM_HEAP_PBUFS))
+    {
+        return nullptr;
+    }
+    SIM_PBUF_T *b = (SIM_PBUF_T *)calloc(1, sizeof(SIM_PBUF_T));
+    b->p.payload = b->data + SIM_HEADROOM;
+    b->p.len = b->p.tot_len = length;
+    b->p.ref = 1;
+    b->heap = !preallocating;
+    heap_in_use += b->heap;
+    return &b->p;
+}
+
+u8_t pbuf_free(struct pbuf *p)
+{
+    if (--p->ref == 0)
+    {
+        --heap_in_use;
+        free(p);
+        return 1;
+    }
+    return 0;
+}
+
+u16_t pbuf_copy_partial(const struct pbuf *p, void *dataptr, u16_t len, u16_t offset)
+{
+    if (offset >= p->len)
+    {
+        return 0;
+    }
+    u16_t n = p->len - offset < len ? p->len - offset : len;
+    memcpy(dataptr, (const uint8_t *)p->payload + offset, n);
+    return n;
+}
+
+u8_t pbuf_remove_header(struct pbuf *p, size_t header_size)
+{
+    p->payload = (uint8_t *)p->payload + header_size;
+    p->len -= header_size;
+    p->tot_len -= header_size;
+    return 0;
+}
+
+struct udp_pcb *udp_new_ip_type(u8_t)
+{
+    return server_pcb;
+}
+
+err_t udp_bind(struct udp_pcb *, const ip_addr_t *, u16_t)
+{
+    return ERR_OK;
+}
+
+void udp_recv(struct udp_pcb *, udp_recv_fn recv, void *)
+{
+    server_recv = recv;
+}
+
+void udp_remove(struct udp_pcb *)
+{
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int64_t ntp_to_utc_us(const uint8_t *p)
+{
+    return (int64_t)(get32(p) - NTP_DELTA) * 1000000 + (int64_t)(((uint64_t)get32(p + 4) * 1000000) >> 32);
+}
+
+static bool check_reply(const uint8_t *msg)
+{
+    if ((msg[0] & 0x7) != 4 || msg[3] != (uint8_t)-20)
+    {
+        return false;
+    }
+    uint64_t origin = (uint64_t)get32(msg + 24) << 32 | get32(msg + 28);
+    if (origin != expect_origin)
+    {
+        return false;
+    }
+    if (!synced)
+    {
+        return msg[0] >> 6 == 3 && msg[1] == 16;
+    }
+    // Truncation to NTP fractions can lose up to a microsecond
+    int64_t receive = ntp_to_utc_us(msg + 32);
+    int64_t transmit = ntp_to_utc_us(msg + 40);
+    return msg[0] >> 6 == 0 && msg[1] == 2 && get32(msg + 12) == 0xc0a80101 &&
+        llabs(receive - expect_utc_us) <= 1 && transmit >= receive && transmit - receive <= 1;
+}
+
+static bool arp_lookup(uint32_t client)
+{
+    int oldest = 0;
+    for (int i = 0; i < arp_entries; ++i)
+    {
+        if (arp_clients[i] == client)
+        {
+            arp_used[i] = now_us;
+            return true;
+        }
+        if (arp_used[i] < arp_used[oldest])
+        {
+            oldest = i;
+        }
+    }
+    arp_clients[oldest] = client;
+    arp_used[oldest] = now_us;
+    return false;
+}
+
+err_t udp_sendto(struct udp_pcb *, struct pbuf *p, const ip_addr_t *dst_ip, u16_t)
+{
+    if (held_count >= (int)(sizeof(held) / sizeof(held[0])))
+    {
+        return ERR_MEM;
+    }
+    ++stats.replies;
+    if (!check_reply((const uint8_t *)p->payload))
+    {
+        ++stats.bad_replies;
+    }
+    if (((SIM_PBUF_T *)p)->heap)
+    {
+        ++stats.heap_replies;
+    }
+    // The headers go on in front, as lwIP does when there is room
+    p->payload = (uint8_t *)p->payload - SIM_HEADROOM;
+    p->len += SIM_HEADROOM;
+    p->tot_len += SIM_HEADROOM;
+    stats.busy_us += SIM_SEND_US;
+    if (!arp_lookup(dst_ip->addr))
+    {
+        ++p->ref;
+        held[held_count++] = { p, now_us + SIM_ARP_US };
+    }
+    return ERR_OK;
+}
+
+static void release_held(uint64_t until_us)
+{
+    for (int i = 0; i < held_count;)
+    {
+        if (held[i].until_us <= until_us)
+        {
+            pbuf_free(held[i].p);
+            held[i] = held[--held_count];
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+static double exponential(double mean)
+{
+    return -mean * log((rand() + 1.0) / (RAND_MAX + 2.0));
+}
+
+static void request(uint32_t client)
+{
+    SIM_PBUF_T b = {};
+    b.p.payload = b.data + SIM_HEADROOM;
+    b.p.len = b.p.tot_len = NTP_MSG_LEN;
+    b.p.ref = 2;
+    uint8_t *req = b.data + SIM_HEADROOM;
+    req[0] = 4 << 3 | 3;
+    expect_origin = (uint64_t)rand() << 32 | (uint32_t)rand();
+    for (int i = 0; i < 8; ++i)
+    {
+        req[40 + i] = (uint8_t)(expect_origin >> (56 - 8 * i));
+    }
+    expect_utc_us = clock_local_to_utc_us(now_us);
+    ip_addr_t addr = { client };
+    ++stats.requests;
+    server_recv(nullptr, server_pcb, &b.p, &addr, 123);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Requests at rate a second for seconds, returns false on a failed check
+static bool run(int rate, int seconds, double *host_ns)
+{
+    memset(&stats, 0, sizeof(stats));
+    uint32_t dropped = ntp_server_get_dropped_count();
+    uint64_t start = now_us;
+    uint64_t end = start + seconds * 1000000ull;
+    double next = (double)start;
+    // When the lwIP context is free to take the next request
+    uint64_t free_us = start;
+    int locks = sim_critical_section_entries;
+    clock_t host = clock();
+    while (true)
+    {
+        next += exponential(1e6 / rate);
+        if (next >= end)
+        {
+            break;
+        }
+        uint64_t arrive = (uint64_t)next;
+        now_us = arrive > free_us ? arrive : free_us;
+        release_held(now_us);
+        if (stats.waits < SIM_MAX_WAITS)
+        {
+            waits_us[stats.waits++] = (uint32_t)(now_us - arrive);
+        }
+        request((uint32_t)rand() % SIM_CLIENTS + 1);
+        free_us = now_us + SIM_SEND_US;
+    }
+    *host_ns = (double)(clock() - host) / CLOCKS_PER_SEC * 1e9 / (stats.requests ? stats.requests : 1);
+    now_us = end;
+    release_held(UINT64_MAX);
+
+    dropped = ntp_server_get_dropped_count() - dropped;
+    qsort(waits_us, stats.waits, sizeof(uint32_t), compare_u32);
+    uint32_t median = stats.waits ? waits_us[stats.waits / 2] : 0;
+    uint32_t p99 = stats.waits ? waits_us[stats.waits * 99 / 100] : 0;
+    printf("%6d %8.1f%% %10u %9u %8.2f%% %7u %8.0f\n", rate, 100.0 * stats.busy_us / (end - start), median, p99,
+        100.0 * stats.heap_replies / (stats.replies ? stats.replies : 1), dropped, *host_ns);
+
+    bool ok = true;
+    if (stats.bad_replies > 0)
+    {
+        printf("FAIL %u bad replies\n", stats.bad_replies);
+        ok = false;
+    }
+    if (sim_critical_section_entries != locks)
+    {
+        printf("FAIL the request path took a lock\n");
+        ok = false;
+    }
+    if (rate <= SIM_PASS_RATE && dropped > 0)
+    {
+        printf("FAIL %u dropped at %d a second\n", dropped, rate);
+        ok = false;
+    }
+    if (heap_in_use != 0)
+    {
+        printf("FAIL %d heap replies never freed\n", heap_in_use);
+        ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    static const int rates[] = { 100, 500, 1000, 2000, 5000, 10000 };
+    int seconds = argc > 1 ? atoi(argv[1]) : 20;
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+    if (argc > 3)
+    {
+        arp_entries = atoi(argv[3]);
+    }
+    if (seconds <= 0 || arp_entries <= 0 || arp_entries > 256)
+    {
+        return 1;
+    }
+
+    clock_init();
+    preallocating = true;
+    if (!ntp_server_init())
+    {
+        return 1;
+    }
+    preallocating = false;
+
+    // Before the clock is set every reply is the alarm
+    double host_ns;
+    bool ok = true;
+    while (now_us < SIM_UNSYNCED_US)
+    {
+        request(1);
+        now_us += 1000;
+    }
+    ok = stats.bad_replies == 0;
+    if (!ok)
+    {
+        printf("FAIL %u bad replies before the clock was set\n", stats.bad_replies);
+    }
+    clock_update(SIM_START_UTC_US, 20000, now_us);
+    synced = true;
+
+    printf("send %d us, %d clients, %d ARP entries, %d s a rate\n", SIM_SEND_US, SIM_CLIENTS, arp_entries, seconds);
+    printf("req/s  core 0  median wait us  99%% us  heap  dropped  host ns\n");
+    for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); ++r)
+    {
+        ok = run(rates[r], seconds, &host_ns) && ok;
+    }
+    return !ok;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+#define bi_decl(x)
+#define bi_2pins_with_func(a, b, f) 0
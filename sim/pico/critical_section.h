@@ -0,0 +1,18 @@
+#pragma once
+
+// The simulators are single threaded, see clock_sim.cxx
+
+struct critical_section
+{
+    int unused;
+};
+
+static inline void critical_section_init(critical_section *) {}
+// Counted so a simulator can check that a path never takes a lock
+inline int sim_critical_section_entries;
+
+static inline void critical_section_enter_blocking(critical_section *)
+{
+    ++sim_critical_section_entries;
+}
+static inline void critical_section_exit(critical_section *) {}
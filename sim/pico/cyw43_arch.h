@@ -0,0 +1,6 @@
+#pragma once
+
+// Each simulated clock runs in its own process with no radio, see fleet_sim.cxx
+
+static inline void cyw43_arch_lwip_begin() {}
+static inline void cyw43_arch_lwip_end() {}
@@ -0,0 +1,8 @@
+#pragma once
+
+// The simulators run what would be on core 1 on their only thread, see
+// display_phase_sim.cxx
+
+static inline void multicore_lockout_victim_init() {}
+
+extern void multicore_launch_core1(void (*entry)());
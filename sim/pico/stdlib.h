@@ -0,0 +1,26 @@
+#pragma once
+
+// Just enough of the Pico SDK for the display and clock code to build on a
+// host, see display_sim.cxx, clock_sim.cxx, ntp_server_sim.cxx and
+// display_phase_sim.cxx
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint64_t absolute_time_t;
+
+// Simulated time, moved on by the simulator
+extern uint64_t time_us_64();
+
+static inline void tight_loop_contents() {}
+
+static inline absolute_time_t from_us_since_boot(uint64_t us)
+{
+    return us;
+}
+
+// Moves simulated time on, see display_phase_sim.cxx
+extern void busy_wait_until(absolute_time_t t);
+
+#define __uninitialized_ram(name) name
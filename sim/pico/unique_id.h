@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+struct pico_unique_board_id_t
+{
+    uint8_t id[8];
+};
+
+// Provided by the simulator, different for each simulated board
+extern void pico_get_unique_board_id(pico_unique_board_id_t *id_out);
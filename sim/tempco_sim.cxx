@@ -0,0 +1,210 @@
+/* Host check for the crystal temperature fit
+
+   Builds tempco_fit.cxx on a PC and feeds it synthetic temperature traces
+   the way tempco.cxx does: the frequency measured over each NTP interval,
+   with the network jitter at both ends, paired with the mean temperature
+   over the same interval. The crystal follows a quadratic curve around
+   25 C. Each trace runs for five days and from the second day on the
+   correction is compared with the crystal's true frequency relative to
+   the clock's own estimate. That is the average over a baseline that
+   grows from two to four hours and then moves on, as in clock.cxx.
+
+   flat      25 C with sensor noise, no correction should be made
+   daily     a day and night swing of 4 C, a linear fit
+   seasons   10 to 40 C over two days, a quadratic fit
+   warm up   a step from 18 to 30 C at a day and a half as an enclosure
+             heats up
+
+   Per trace it prints the order of the fit, the RMS frequency error left
+   with and without the correction, and the worst error with it. It exits
+   non-zero if a flat trace gets a correction, if the correction does not
+   at least halve the error on the daily and seasonal traces, or if it
+   makes the warm up worse than no correction at all.
+
+   From the top of the repository
+
+   g++ -std=c++17 -Wall -Wextra -I. sim/tempco_sim.cxx tempco_fit.cxx -o tempco_sim
+   ./tempco_sim [jitter us] [seed]
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tempco_fit.h"
+
+#define SIM_DAYS 5
+#define SIM_DAY_S 86400
+// Interval between frequency measurements, the clock's poll interval
+#define SIM_INTERVAL_S 1024
+// Crystal, ppb = F0 + F1 * x + F2 * x * x with x = temperature - 25 C
+#define SIM_F0_PPB 12000.0
+#define SIM_F1_PPB -300.0
+#define SIM_F2_PPB -35.0
+#define SIM_SENSOR_NOISE_C 0.3
+// Smoothing of the once a second readings, as TEMPCO_SMOOTHING
+#define SIM_SMOOTHING 16
+// The clock's frequency baseline, see CLOCK_FREQ_WINDOW_US and
+// CLOCK_FREQ_MIN_BASELINE_US
+#define SIM_WINDOW_S (4 * 3600)
+#define SIM_MIN_BASELINE_S 60
+// Pass marks
+#define SIM_FLAT_MAX_PPB 50
+#define SIM_MIN_IMPROVEMENT 2
+
+enum SIM_TRACE
+{
+    SIM_FLAT,
+    SIM_DAILY,
+    SIM_SEASONS,
+    SIM_WARM_UP,
+    SIM_TRACES
+};
+
+static const char *trace_names[SIM_TRACES] = { "flat", "daily", "seasons", "warm up" };
+static double jitter_us = 500;
+
+static double gaussian()
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static double temperature_at(SIM_TRACE trace, int t)
+{
+    switch (trace)
+    {
+        case SIM_DAILY:
+            return 24 + 2 * sin(2 * M_PI * t / SIM_DAY_S);
+        case SIM_SEASONS:
+            return 25 + 15 * sin(2 * M_PI * t / (2.0 * SIM_DAY_S));
+        case SIM_WARM_UP:
+            return t < 3 * SIM_DAY_S / 2 ? 18 : 30 - 12 * exp(-(t - 3 * SIM_DAY_S / 2) / 3600.0);
+        default:
+            return 25;
+    }
+}
+
+static double crystal_ppb(double temperature_c)
+{
+    double x = temperature_c - 25;
+    return SIM_F0_PPB + SIM_F1_PPB * x + SIM_F2_PPB * x * x;
+}
+
+// Running sum of the true frequency, for the clock's average over its baseline
+static double freq_sums[SIM_DAYS * SIM_DAY_S + 1];
+
+static bool run(SIM_TRACE trace)
+{
+    TEMPCO_FIT_T fit;
+    tempco_fit_init(&fit);
+
+    double smoothed_c = temperature_at(trace, 0);
+    // The clock's anchors and its estimate, in seconds, updated at each sample
+    int anchor = 0;
+    int next_anchor = -1;
+    bool have_estimate = false;
+    double estimate_ppb = 0;
+    int window_from = 0;
+    int window_to = 0;
+    double sum_sq = 0;
+    double raw_sum_sq = 0;
+    double worst = 0;
+    int checked = 0;
+    for (int start = 0; start + SIM_INTERVAL_S <= SIM_DAYS * SIM_DAY_S; start += SIM_INTERVAL_S)
+    {
+        double temp_sum = 0;
+        double freq_sum = 0;
+        for (int t = start; t < start + SIM_INTERVAL_S; ++t)
+        {
+            double true_c = temperature_at(trace, t);
+            double true_ppb = crystal_ppb(true_c);
+            smoothed_c += (true_c + gaussian() * SIM_SENSOR_NOISE_C - smoothed_c) / SIM_SMOOTHING;
+            temp_sum += smoothed_c;
+            freq_sum += true_ppb;
+            freq_sums[t + 1] = freq_sums[t] + true_ppb;
+            tempco_fit_track(&fit, smoothed_c);
+
+            // The correction on top of the clock's estimate, as tempco_sample()
+            // applies it
+            if (start >= SIM_DAY_S && have_estimate && t % 60 == 0)
+            {
+                double wanted = true_ppb - estimate_ppb;
+                double error = wanted -
+                    tempco_fit_correction_ppb(&fit, smoothed_c, t - window_from, window_to - window_from);
+                sum_sq += error * error;
+                raw_sum_sq += wanted * wanted;
+                worst = fmax(worst, fabs(error));
+                ++checked;
+            }
+        }
+
+        // A sample at the end of the interval, update_frequency() in clock.cxx
+        int now = start + SIM_INTERVAL_S;
+        if (now - anchor >= SIM_MIN_BASELINE_S)
+        {
+            have_estimate = true;
+            estimate_ppb = (freq_sums[now] - freq_sums[anchor]) / (now - anchor);
+            window_from = anchor;
+            window_to = now;
+        }
+        if (now - anchor >= SIM_WINDOW_S && next_anchor >= 0)
+        {
+            anchor = next_anchor;
+            next_anchor = -1;
+        }
+        else if (now - anchor >= SIM_WINDOW_S / 2 && next_anchor < 0)
+        {
+            next_anchor = now;
+        }
+
+        // Both ends of the interval are out by the network jitter
+        double measured_ppb = freq_sum / SIM_INTERVAL_S +
+            (gaussian() - gaussian()) * jitter_us * 1000 / SIM_INTERVAL_S;
+        tempco_fit_add(&fit, temp_sum / SIM_INTERVAL_S, measured_ppb, SIM_INTERVAL_S * 1e6 / 1e9);
+    }
+
+    double rms = sqrt(sum_sq / checked);
+    double raw_rms = sqrt(raw_sum_sq / checked);
+    printf("%-8s %5d %9.0f %10.0f %9.0f\n", trace_names[trace], fit.order, raw_rms, rms, worst);
+
+    bool ok;
+    switch (trace)
+    {
+        case SIM_FLAT:
+            ok = worst <= SIM_FLAT_MAX_PPB;
+            break;
+        case SIM_WARM_UP:
+            // The first warm up is being learnt as it happens, the fit can
+            // only be expected not to make it worse
+            ok = rms <= raw_rms;
+            break;
+        default:
+            ok = rms * SIM_MIN_IMPROVEMENT <= raw_rms;
+            break;
+    }
+    if (!ok)
+    {
+        printf("FAIL %s\n", trace_names[trace]);
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        jitter_us = atof(argv[1]);
+    }
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    printf("jitter %.0f us, %d days, measured every %d s\n", jitter_us, SIM_DAYS, SIM_INTERVAL_S);
+    printf("trace    order  raw ppb  fitted ppb  worst ppb\n");
+    int failures = 0;
+    for (int t = 0; t < SIM_TRACES; ++t)
+    {
+        failures += !run((SIM_TRACE)t);
+    }
+    return failures != 0;
+}
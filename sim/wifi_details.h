@@ -0,0 +1,6 @@
+#pragma once
+
+// Stand-in for the private settings described in README.md, for the host
+// simulators. A wifi_details.h at the top of the repository is found first.
+
+#define FLEET_MODE 1
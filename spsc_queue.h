@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include "hardware/sync.h"
+
+// Lock free queue for passing messages between the cores. Exactly one core
+// pushes and exactly one other core pops. N must be a power of two.
+template <typename T, uint32_t N>
+struct SPSC_QUEUE_T
+{
+    static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+    T items[N];
+    // head is only written by the producer, tail only by the consumer
+    volatile uint32_t head;
+    volatile uint32_t tail;
+
+    bool push(const T &item)
+    {
+        uint32_t h = head;
+        if (h - tail == N)
+        {
+            return false;
+        }
+        items[h % N] = item;
+        // The item must be visible before the new head
+        __dmb();
+        head = h + 1;
+        return true;
+    }
+
+    bool pop(T *item)
+    {
+        uint32_t t = tail;
+        if (t == head)
+        {
+            return false;
+        }
+        __dmb();
+        *item = items[t % N];
+        // Finish reading the item before the producer can reuse the slot
+        __dmb();
+        tail = t + 1;
+        return true;
+    }
+};
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include "clock.h"
+#include "tempco.h"
+#include "tempco_fit.h"
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "hardware/adc.h"
+
+#define TEMPCO_ADC_INPUT 4
+#define TEMPCO_READS 8
+// Smoothing of the once a second readings, the sensor is noisy
+#define TEMPCO_SMOOTHING 16
+
+struct TEMPCO_PENDING_T
+{
+    bool valid;
+    int32_t freq_ppb;
+    uint64_t interval_us;
+    float temperature_c;
+};
+
+static TEMPCO_FIT_T fit;
+static critical_section cs;
+static bool have_temperature;
+static float temperature_c;
+static float temperature_sum;
+static int temperature_count;
+static TEMPCO_PENDING_T pending;
+static int32_t correction_ppb;
+
+void tempco_init()
+{
+    critical_section_init(&cs);
+    tempco_fit_init(&fit);
+    adc_init();
+    adc_set_temp_sensor_enabled(true);
+}
+
+static float read_temperature()
+{
+    adc_select_input(TEMPCO_ADC_INPUT);
+    uint32_t raw = 0;
+    for (int i = 0; i < TEMPCO_READS; ++i)
+    {
+        raw += adc_read();
+    }
+    // From the RP2040 datasheet, 12 bit conversion against 3.3V
+    float volts = raw * 3.3f / (4096 * TEMPCO_READS);
+    return 27.0f - (volts - 0.706f) / 0.001721f;
+}
+
+void tempco_sample()
+{
+    float t = read_temperature();
+    if (!have_temperature)
+    {
+        temperature_c = t;
+        have_temperature = true;
+    }
+    else
+    {
+        temperature_c += (t - temperature_c) / TEMPCO_SMOOTHING;
+    }
+
+    critical_section_enter_blocking(&cs);
+    temperature_sum += temperature_c;
+    ++temperature_count;
+    TEMPCO_PENDING_T p = pending;
+    pending.valid = false;
+    critical_section_exit(&cs);
+
+    if (p.valid)
+    {
+        // Longer intervals are less affected by network jitter
+        tempco_fit_add(&fit, p.temperature_c, p.freq_ppb, p.interval_us / 1e9);
+        printf("tempco %.2fC %ld ppb, fit order %d\n", p.temperature_c, (long)p.freq_ppb, fit.order);
+    }
+
+    tempco_fit_track(&fit, temperature_c);
+    uint32_t age_s;
+    uint32_t length_s;
+    int32_t correction = 0;
+    if (clock_get_frequency_window(&age_s, &length_s))
+    {
+        correction = tempco_fit_correction_ppb(&fit, temperature_c, age_s, length_s);
+    }
+    if (correction != correction_ppb)
+    {
+        correction_ppb = correction;
+        clock_set_compensation_ppb(correction);
+    }
+}
+
+void tempco_add_frequency(int32_t freq_ppb, uint64_t interval_us)
+{
+    critical_section_enter_blocking(&cs);
+    if (temperature_count > 0)
+    {
+        pending.valid = true;
+        pending.freq_ppb = freq_ppb;
+        pending.interval_us = interval_us;
+        pending.temperature_c = temperature_sum / temperature_count;
+    }
+    temperature_sum = 0;
+    temperature_count = 0;
+    critical_section_exit(&cs);
+}
+
+float tempco_get_temperature()
+{
+    return temperature_c;
+}
+
+int32_t tempco_get_correction_ppb()
+{
+    return correction_ppb;
+}
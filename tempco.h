@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+
+// Temperature compensation of the crystal using the RP2040's on die sensor.
+// The frequency measured between NTP updates is fitted against the mean
+// temperature over the same time and the fit is fed forward into the clock.
+
+extern void tempco_init();
+
+// Call once a second from the main loop
+extern void tempco_sample();
+
+// Frequency error measured over the last interval_us, from the clock discipline
+extern void tempco_add_frequency(int32_t freq_ppb, uint64_t interval_us);
+
+extern float tempco_get_temperature();
+extern int32_t tempco_get_correction_ppb();
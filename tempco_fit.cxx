@@ -0,0 +1,179 @@
+#include <math.h>
+#include <string.h>
+#include "tempco_fit.h"
+
+#define TEMPCO_CENTRE_C 25.0
+// Each new sample scales down the weight of the older ones
+#define TEMPCO_FORGET 0.995
+// Samples needed before any correction is made
+#define TEMPCO_MIN_SAMPLES 12
+// Spread of temperatures, as a standard deviation, needed for a linear fit.
+// A quadratic fit needs the spread of x * x left over once the part that
+// follows x in a straight line is taken out, in C squared. Readings at only
+// two temperatures, as when an enclosure warms up once, have none.
+#define TEMPCO_LINEAR_SPREAD_C 0.5
+#define TEMPCO_QUADRATIC_SPREAD_C2 9.0
+// Never correct by more than this
+#define TEMPCO_MAX_CORRECTION_PPB 20000
+
+void tempco_fit_init(TEMPCO_FIT_T *fit)
+{
+    memset(fit, 0, sizeof(*fit));
+}
+
+static double det3(const double m[3][3])
+{
+    return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+         - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+         + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+}
+
+// Solve the normal equations by Cramer's rule, there are only three unknowns
+static bool solve_quadratic(TEMPCO_FIT_T *fit)
+{
+    double a[3][3] = {
+        { fit->sw,    fit->sx[0], fit->sx[1] },
+        { fit->sx[0], fit->sx[1], fit->sx[2] },
+        { fit->sx[1], fit->sx[2], fit->sx[3] },
+    };
+    double b[3] = { fit->sy, fit->sxy[0], fit->sxy[1] };
+    double d = det3(a);
+    if (fabs(d) < 1e-9)
+    {
+        return false;
+    }
+    for (int k = 0; k < 3; ++k)
+    {
+        double m[3][3];
+        memcpy(m, a, sizeof(m));
+        for (int i = 0; i < 3; ++i)
+        {
+            m[i][k] = b[i];
+        }
+        fit->c[k] = det3(m) / d;
+    }
+    return true;
+}
+
+static bool solve_linear(TEMPCO_FIT_T *fit)
+{
+    double d = fit->sw * fit->sx[1] - fit->sx[0] * fit->sx[0];
+    if (fabs(d) < 1e-9)
+    {
+        return false;
+    }
+    fit->c[0] = (fit->sy * fit->sx[1] - fit->sx[0] * fit->sxy[0]) / d;
+    fit->c[1] = (fit->sw * fit->sxy[0] - fit->sx[0] * fit->sy) / d;
+    fit->c[2] = 0;
+    return true;
+}
+
+void tempco_fit_add(TEMPCO_FIT_T *fit, double temperature_c, double freq_ppb, double weight)
+{
+    double x = temperature_c - TEMPCO_CENTRE_C;
+    fit->sw = fit->sw * TEMPCO_FORGET + weight;
+    double xp = 1;
+    for (int i = 0; i < 4; ++i)
+    {
+        xp *= x;
+        fit->sx[i] = fit->sx[i] * TEMPCO_FORGET + weight * xp;
+    }
+    fit->sy = fit->sy * TEMPCO_FORGET + weight * freq_ppb;
+    fit->sxy[0] = fit->sxy[0] * TEMPCO_FORGET + weight * x * freq_ppb;
+    fit->sxy[1] = fit->sxy[1] * TEMPCO_FORGET + weight * x * x * freq_ppb;
+    if (fit->samples == 0 || x < fit->min_x)
+    {
+        fit->min_x = x;
+    }
+    if (fit->samples == 0 || x > fit->max_x)
+    {
+        fit->max_x = x;
+    }
+    ++fit->samples;
+
+    double mean = fit->sx[0] / fit->sw;
+    double mean2 = fit->sx[1] / fit->sw;
+    double var = fmax(mean2 - mean * mean, 0);
+    double spread = sqrt(var);
+    double cov = fit->sx[2] / fit->sw - mean * mean2;
+    double var2 = fit->sx[3] / fit->sw - mean2 * mean2;
+    double spread2 = var > 0 ? sqrt(fmax(var2 - cov * cov / var, 0)) : 0;
+    fit->order = 0;
+    if (fit->samples < TEMPCO_MIN_SAMPLES)
+    {
+        return;
+    }
+    if (spread2 >= TEMPCO_QUADRATIC_SPREAD_C2 && solve_quadratic(fit))
+    {
+        fit->order = 2;
+    }
+    else if (spread >= TEMPCO_LINEAR_SPREAD_C && solve_linear(fit))
+    {
+        fit->order = 1;
+    }
+}
+
+static double clamp_x(const TEMPCO_FIT_T *fit, double temperature_c)
+{
+    return fmin(fmax(temperature_c - TEMPCO_CENTRE_C, fit->min_x), fit->max_x);
+}
+
+void tempco_fit_track(TEMPCO_FIT_T *fit, double temperature_c)
+{
+    fit->minute_sum += temperature_c;
+    if (++fit->minute_count < 60)
+    {
+        return;
+    }
+    fit->history_c[fit->history_next] = (float)(fit->minute_sum / fit->minute_count);
+    fit->history_next = (fit->history_next + 1) % TEMPCO_HISTORY_MIN;
+    if (fit->history_count < TEMPCO_HISTORY_MIN)
+    {
+        ++fit->history_count;
+    }
+    fit->minute_sum = 0;
+    fit->minute_count = 0;
+}
+
+int32_t tempco_fit_correction_ppb(const TEMPCO_FIT_T *fit, double temperature_c, uint32_t age_s,
+    uint32_t length_s)
+{
+    if (fit->order == 0)
+    {
+        return 0;
+    }
+    // The clock's estimate is the average of the crystal over its window,
+    // so the reference is the average of x and x * x over the same minutes
+    int newest = (int)((age_s - length_s) / 60);
+    int oldest = (int)(age_s / 60);
+    if (oldest > fit->history_count)
+    {
+        oldest = fit->history_count;
+    }
+    if (newest >= oldest)
+    {
+        return 0;
+    }
+    double mx = 0;
+    double mx2 = 0;
+    for (int i = newest; i < oldest; ++i)
+    {
+        int k = (fit->history_next - 1 - i + 2 * TEMPCO_HISTORY_MIN) % TEMPCO_HISTORY_MIN;
+        double hx = clamp_x(fit, fit->history_c[k]);
+        mx += hx;
+        mx2 += hx * hx;
+    }
+    mx /= oldest - newest;
+    mx2 /= oldest - newest;
+    double x = clamp_x(fit, temperature_c);
+    double correction = fit->c[1] * (x - mx) + fit->c[2] * (x * x - mx2);
+    if (correction > TEMPCO_MAX_CORRECTION_PPB)
+    {
+        correction = TEMPCO_MAX_CORRECTION_PPB;
+    }
+    else if (correction < -TEMPCO_MAX_CORRECTION_PPB)
+    {
+        correction = -TEMPCO_MAX_CORRECTION_PPB;
+    }
+    return (int32_t)correction;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+// Least squares fit of crystal frequency error against temperature, kept free
+// of SDK dependencies so it can be built and exercised off target. Older
+// samples are gradually forgotten so the fit follows the crystal as it ages.
+
+// Minutes of temperature history, enough to cover the clock's frequency
+// baseline of up to four hours plus two of its longest poll intervals
+#define TEMPCO_HISTORY_MIN 384
+
+struct TEMPCO_FIT_T
+{
+    // Weighted sums of powers of x = temperature - TEMPCO_CENTRE_C
+    double sw;
+    double sx[4];
+    double sy;
+    double sxy[2];
+    int samples;
+    // Current fit, ppb = c0 + c1 * x + c2 * x * x
+    int order;
+    double c[3];
+    // Range of x the samples have covered, the fit is not extrapolated
+    double min_x;
+    double max_x;
+    // Mean temperature of each minute, newest at history_next - 1
+    float history_c[TEMPCO_HISTORY_MIN];
+    int history_next;
+    int history_count;
+    double minute_sum;
+    int minute_count;
+};
+
+extern void tempco_fit_init(TEMPCO_FIT_T *fit);
+extern void tempco_fit_add(TEMPCO_FIT_T *fit, double temperature_c, double freq_ppb, double weight);
+// Call once a second with the current temperature
+extern void tempco_fit_track(TEMPCO_FIT_T *fit, double temperature_c);
+// Frequency error the fit predicts at a temperature relative to the average
+// over the window the clock's frequency estimate was measured across, which
+// started age_s ago and lasted length_s
+extern int32_t tempco_fit_correction_ppb(const TEMPCO_FIT_T *fit, double temperature_c, uint32_t age_s,
+    uint32_t length_s);
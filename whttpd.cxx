@@ -95,6 +95,8 @@
 #include "wfs.h"
 #include "whttpd_structs.h"
 #include "lwip/def.h"
+#include "power.h"
+#include "wifi_pm.h"
 
 #include "lwip/altcp.h"
 #include "lwip/altcp_tcp.h"
@@ -160,7 +162,8 @@ static const default_filename httpd_default_filenames[] = {
 #define NUM_DEFAULT_FILENAMES LWIP_ARRAYSIZE(httpd_default_filenames)
 
 #if LWIP_HTTPD_SUPPORT_REQUESTLIST
-/** HTTP request is copied here from pbufs for simple parsing */
+/** HTTP request is copied here from pbufs for simple parsing. Only used from
+ * lwIP callbacks, which all run on core 0. */
 static char httpd_req_buf[LWIP_HTTPD_MAX_REQ_LENGTH + 1];
 #endif /* LWIP_HTTPD_SUPPORT_REQUESTLIST */
 
@@ -2403,14 +2406,15 @@ http_sent(void *arg, struct altcp_pcb *pcb, u16_t len)
 
   LWIP_DEBUGF(HTTPD_DEBUG | LWIP_DBG_TRACE, ("http_sent %p\n", (void *)pcb));
 
-  LWIP_UNUSED_ARG(len);
-
   if (hs == NULL) {
     return ERR_OK;
   }
 
   hs->retries = 0;
 
+  /* keep the clock up while a response or upload is under way */
+  power_boost();
+  wifi_pm_note_traffic(len);
   http_send(pcb, hs);
 
   return ERR_OK;
@@ -2493,6 +2497,9 @@ http_recv(void *arg, struct altcp_pcb *pcb, struct pbuf *p, err_t err)
     return ERR_OK;
   }
 
+  power_boost();
+  wifi_pm_note_traffic(p->tot_len);
+
 #if LWIP_HTTPD_SUPPORT_POST && LWIP_HTTPD_POST_MANUAL_WND
   if (hs->no_auto_wnd) {
     hs->unrecved_bytes += p->tot_len;
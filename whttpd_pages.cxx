@@ -37,11 +37,17 @@
  *
  */
 
-#include "ht16k33.h"
+#include "boot_timeline.h"
+#include "health.h"
+#include "clock.h"
+#include "display.h"
 #include "timegm.h"
 #include "localtime.h"
+#include "ntp.h"
 #include "ota.h"
 #include "preferences.h"
+#include "wifi_link.h"
+#include "wifi_pm.h"
 #include "zones.h"
 
 #include "lwip/opt.h"
@@ -53,6 +59,7 @@
 #include "lwip/mem.h"
 #include "pico/time.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -216,6 +223,7 @@ static const char restart_page_tail[] = "</p></body></html>\n";
 
 static int64_t reset_now(alarm_id_t, void *)
 {
+    clock_persist(0);
     watchdog_reboot(0, 0, 0);
     while(1);
 }
@@ -230,6 +238,31 @@ static const char *weekday_string(int wday)
     return wdays[wday];
 }
 
+// Query values arrive still escaped, '+' for space and %XX for anything else
+static void url_decode(char *dst, const char *src, size_t size)
+{
+    size_t n = 0;
+    while (*src && n + 1 < size)
+    {
+        if (*src == '+')
+        {
+            dst[n++] = ' ';
+            ++src;
+        }
+        else if (src[0] == '%' && isxdigit((unsigned char)src[1]) && isxdigit((unsigned char)src[2]))
+        {
+            char hex[3] = { src[1], src[2], '\0' };
+            dst[n++] = (char)strtoul(hex, nullptr, 16);
+            src += 3;
+        }
+        else
+        {
+            dst[n++] = *src++;
+        }
+    }
+    dst[n] = '\0';
+}
+
 int wfs_open_custom(struct wfs_file *file, const char *name, int n_params, char **params, char **values)
 {
     //printf("HTTPD get fs %s\n", name);
@@ -326,6 +359,104 @@ int wfs_open_custom(struct wfs_file *file, const char *name, int n_params, char
             return 1;
         }
     }
+    else if (strcmp(name, "/ntp") == 0)
+    {
+        const size_t len = NTP_HISTORY_JSON_MAX;
+        file->pextension = malloc(len);
+        if (file->pextension != nullptr)
+        {
+            int n = ntp_get_history_json((char *)file->pextension, len);
+            if (n < 0)
+            {
+                // Cut short it would not be valid JSON
+                printf("ntp history does not fit\n");
+                free(file->pextension);
+                file->pextension = nullptr;
+                return 0;
+            }
+            file->data = (const char *)file->pextension;
+            file->len = n;
+            file->index = file->len;
+            file->flags = FS_FILE_FLAGS_HEADER_PERSISTENT;
+            file->content_type = HTTP_HDR_JSON;
+            return 1;
+        }
+    }
+    else if (strcmp(name, "/boot") == 0)
+    {
+        const size_t len = BOOT_JSON_MAX;
+        file->pextension = malloc(len);
+        if (file->pextension != nullptr)
+        {
+            int n = boot_get_json((char *)file->pextension, len);
+            if (n < 0)
+            {
+                // Cut short it would not be valid JSON
+                printf("boot timeline does not fit\n");
+                free(file->pextension);
+                file->pextension = nullptr;
+                return 0;
+            }
+            file->data = (const char *)file->pextension;
+            file->len = n;
+            file->index = file->len;
+            file->flags = FS_FILE_FLAGS_HEADER_PERSISTENT;
+            file->content_type = HTTP_HDR_JSON;
+            return 1;
+        }
+    }
+    else if (strcmp(name, "/health") == 0)
+    {
+        const size_t len = HEALTH_JSON_MAX;
+        file->pextension = malloc(len);
+        if (file->pextension != nullptr)
+        {
+            int n = health_get_json((char *)file->pextension, len);
+            if (n < 0)
+            {
+                // Cut short it would not be valid JSON
+                printf("health does not fit\n");
+                free(file->pextension);
+                file->pextension = nullptr;
+                return 0;
+            }
+            file->data = (const char *)file->pextension;
+            file->len = n;
+            file->index = file->len;
+            file->flags = FS_FILE_FLAGS_HEADER_PERSISTENT;
+            file->content_type = HTTP_HDR_JSON;
+            return 1;
+        }
+    }
+    else if (strcmp(name, "/wifi") == 0)
+    {
+        const size_t len = WIFI_PM_JSON_MAX + WIFI_LINK_JSON_MAX + 32;
+        file->pextension = malloc(len);
+        if (file->pextension != nullptr)
+        {
+            char pm[WIFI_PM_JSON_MAX];
+            char link[WIFI_LINK_JSON_MAX];
+            int n = -1;
+            if (wifi_pm_get_json(pm, sizeof(pm)) >= 0 && wifi_link_get_json(link, sizeof(link)) >= 0)
+            {
+                n = snprintf((char *)file->pextension, len, "{\"pm\":%s,\"link\":%s}\n", pm, link);
+            }
+            if (n < 0 || (size_t)n >= len)
+            {
+                // Cut short it would not be valid JSON
+                printf("wifi stats do not fit\n");
+                free(file->pextension);
+                file->pextension = nullptr;
+                return 0;
+            }
+            file->data = (const char *)file->pextension;
+            file->len = n;
+            file->index = file->len;
+            file->flags = FS_FILE_FLAGS_HEADER_PERSISTENT;
+            file->content_type = HTTP_HDR_JSON;
+            return 1;
+        }
+    }
     else if (strcmp(name, "/zones") == 0)
     {
         int n = micro_tz_db_get_zone_count();
@@ -403,20 +534,69 @@ int wfs_open_custom(struct wfs_file *file, const char *name, int n_params, char
     else if (strcmp(name, "/brightness") == 0)
     {
         bool ok = false;
+        unsigned long val = 0;
+        unsigned long fade = 0;
         for (int i = 0; i < n_params; ++i)
         {
+            char *end;
             if (strcmp(params[i], "v") == 0)
             {
-                char *end;
-                unsigned long val = strtoul(values[i], &end, 10);
-                if (*end == '\0')
-                {
-                    ok = true;
-                    ht16k33_set_brightness(val);
-                    printf("set brightness %lu\n", val);
-                }
-                break;
+                val = strtoul(values[i], &end, 10);
+                ok = *end == '\0';
+            }
+            else if (strcmp(params[i], "fade") == 0)
+            {
+                fade = strtoul(values[i], &end, 10);
+            }
+        }
+        if (ok)
+        {
+            ok = display_set_brightness(val, fade);
+            printf("set brightness %lu fade %lu ms\n", val, fade);
+        }
+        file->data = ok ? "OK" : "NOCHANGE";
+        file->len = strlen(file->data);
+        file->index = file->len;
+        file->flags = FS_FILE_FLAGS_HEADER_PERSISTENT;
+        file->content_type = HTTP_HDR_TEXT;
+        return 1;
+    }
+    else if (strcmp(name, "/message") == 0)
+    {
+        // text, effect scroll, blink or static, priority, step and duration in ms
+        DISPLAY_MESSAGE_T msg;
+        memset(&msg, 0, sizeof(msg));
+        bool ok = false;
+        for (int i = 0; i < n_params; ++i)
+        {
+            if (strcmp(params[i], "text") == 0)
+            {
+                url_decode(msg.text, values[i], sizeof(msg.text));
+                ok = true;
+            }
+            else if (strcmp(params[i], "effect") == 0)
+            {
+                if (strcmp(values[i], "blink") == 0)
+                    msg.effect = DISPLAY_BLINK;
+                else if (strcmp(values[i], "static") == 0)
+                    msg.effect = DISPLAY_STATIC;
             }
+            else if (strcmp(params[i], "priority") == 0)
+            {
+                msg.priority = (uint8_t)strtoul(values[i], nullptr, 10);
+            }
+            else if (strcmp(params[i], "step") == 0)
+            {
+                msg.step_ms = (uint16_t)strtoul(values[i], nullptr, 10);
+            }
+            else if (strcmp(params[i], "duration") == 0)
+            {
+                msg.duration_ms = strtoul(values[i], nullptr, 10);
+            }
+        }
+        if (ok)
+        {
+            ok = display_show_message(&msg);
         }
         file->data = ok ? "OK" : "NOCHANGE";
         file->len = strlen(file->data);
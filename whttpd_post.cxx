@@ -41,7 +41,7 @@
 #include "hardware/flash.h"
 #include "lwip/def.h"
 #include "lwip/mem.h"
-#include "pico/critical_section.h"
+#include "flash_lockout.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -54,8 +54,6 @@ static int page_offset = 0;
 static uint32_t content_offset = 0;
 static int content_length = 0;
 
-static critical_section cs;
-
 err_t
 whttpd_post_begin(void *connection, const char *uri, const char *http_request,
                  u16_t http_request_len, int content_len, char *response_uri,
@@ -66,10 +64,6 @@ whttpd_post_begin(void *connection, const char *uri, const char *http_request,
   LWIP_UNUSED_ARG(http_request_len);
   LWIP_UNUSED_ARG(content_len);
   LWIP_UNUSED_ARG(post_auto_wnd);
-  if (!critical_section_is_initialized(&cs))
-  {
-    critical_section_init(&cs);
-  }
   printf("POST %s %d\n", uri, content_len);
   if (memcmp(uri, "/post_update", 5) == 0 ) {
       current_connection = connection;
@@ -87,10 +81,10 @@ static void flash_page()
 {
   uint32_t ota_offset = (uint32_t)&__flash_ota_start - XIP_BASE;
   printf("flash a page @%lu\n", content_offset);
-  critical_section_enter_blocking(&cs);
+  uint32_t interrupts = flash_lockout_begin();
   flash_range_erase(ota_offset + content_offset, FLASH_SECTOR_SIZE);
   flash_range_program(ota_offset + content_offset, page_buffer, FLASH_SECTOR_SIZE);
-  critical_section_exit(&cs);
+  flash_lockout_end(interrupts);
   content_offset += sizeof(page_buffer);
   page_offset = 0;
 }
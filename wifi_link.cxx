@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include "lwip/netif.h"
+
+#include "power.h"
+#include "wifi_details.h"
+#include "wifi_link.h"
+
+// Reconnect attempts wait this long after a failure, doubling each time
+#define WIFI_LINK_BACKOFF_MIN_MS 250
+#define WIFI_LINK_BACKOFF_MAX_MS (16 * 1000)
+// Give up on a join that has not got an address in this time
+#define WIFI_LINK_JOIN_TIMEOUT_MS (10 * 1000)
+// Joins to the cached access point before going back to a scan
+#define WIFI_LINK_CACHED_TRIES 2
+// Longest wait without calling the idle function
+#define WIFI_LINK_IDLE_MS 500
+
+struct WIFI_LINK_CACHE_T
+{
+    bool valid;
+    WIFI_LINK_AP_T ap;
+};
+
+struct WIFI_LINK_STATS_T
+{
+    uint32_t outages;
+    uint32_t last_outage_ms;
+    uint32_t max_outage_ms;
+    uint64_t total_outage_ms;
+    // From starting to join to being associated and to having an address
+    uint32_t last_assoc_ms;
+    uint32_t last_join_ms;
+    uint32_t max_join_ms;
+    uint32_t attempts;
+    uint32_t cached_joins;
+    uint32_t cached_misses;
+};
+
+static WIFI_LINK_CACHE_T cache;
+static WIFI_LINK_STATS_T stats;
+static int watch_task = -1;
+// Set by the callbacks to wake a wait
+static volatile uint32_t events;
+// When the link was seen to go, 0 while it is up
+static volatile uint64_t down_since_us;
+static volatile uint64_t link_up_us;
+
+static void netif_changed(struct netif *netif)
+{
+    events = 1;
+    if (!netif_is_link_up(netif))
+    {
+        if (down_since_us == 0)
+        {
+            down_since_us = time_us_64();
+        }
+        link_up_us = 0;
+    }
+    else if (link_up_us == 0)
+    {
+        link_up_us = time_us_64();
+    }
+    sched_trigger(watch_task);
+}
+
+void wifi_link_init()
+{
+    cyw43_arch_lwip_begin();
+    struct netif *netif = &cyw43_state.netif[CYW43_ITF_STA];
+    netif_set_link_callback(netif, netif_changed);
+    netif_set_status_callback(netif, netif_changed);
+    cyw43_arch_lwip_end();
+}
+
+static int link_status()
+{
+    cyw43_arch_lwip_begin();
+    int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+    cyw43_arch_lwip_end();
+    return status;
+}
+
+bool wifi_link_is_up()
+{
+    return link_status() == CYW43_LINK_UP;
+}
+
+// Sleep until due or a link event, keeping the idle function going
+static void wait_until(absolute_time_t due, SCHED_FN idle)
+{
+    while (absolute_time_diff_us(get_absolute_time(), due) > 0)
+    {
+        absolute_time_t step = make_timeout_time_ms(WIFI_LINK_IDLE_MS);
+        power_idle_until(absolute_time_diff_us(step, due) > 0 ? step : due, &events);
+        if (idle != nullptr)
+        {
+            idle();
+        }
+        if (events)
+        {
+            return;
+        }
+    }
+}
+
+static int join(bool cached)
+{
+    const char *ssid = WIFI_SSID;
+    const char *pass = WIFI_PASSWORD;
+    cyw43_arch_lwip_begin();
+    int err = cyw43_wifi_join(&cyw43_state, strlen(ssid), (const uint8_t *)ssid, strlen(pass), (const uint8_t *)pass,
+        CYW43_AUTH_WPA2_AES_PSK, cached ? cache.ap.bssid : nullptr, cached ? cache.ap.channel : CYW43_CHANNEL_NONE);
+    cyw43_arch_lwip_end();
+    return err;
+}
+
+static bool wait_for_address(SCHED_FN idle)
+{
+    absolute_time_t give_up = make_timeout_time_ms(WIFI_LINK_JOIN_TIMEOUT_MS);
+    for (;;)
+    {
+        events = 0;
+        int status = link_status();
+        if (status == CYW43_LINK_UP)
+        {
+            return true;
+        }
+        if (status < 0 || absolute_time_diff_us(get_absolute_time(), give_up) <= 0)
+        {
+            return false;
+        }
+        wait_until(give_up, idle);
+    }
+}
+
+static void remember_access_point()
+{
+    uint8_t info[12] = {};
+    cyw43_arch_lwip_begin();
+    bool ok = cyw43_wifi_get_bssid(&cyw43_state, cache.ap.bssid) == 0 &&
+        cyw43_ioctl(&cyw43_state, CYW43_IOCTL_GET_CHANNEL, sizeof(info), info, CYW43_ITF_STA) == 0;
+    cyw43_arch_lwip_end();
+    cache.valid = false;
+    if (ok)
+    {
+        // The reply is hardware, target and scan channel as little endian words
+        cache.ap.channel = info[0] | info[1] << 8;
+        cache.valid = cache.ap.channel != 0;
+    }
+}
+
+void wifi_link_connect(SCHED_FN idle)
+{
+    uint64_t start = time_us_64();
+    uint32_t backoff_ms = WIFI_LINK_BACKOFF_MIN_MS;
+    for (int attempt = 0; ; ++attempt)
+    {
+        bool cached = cache.valid && attempt < WIFI_LINK_CACHED_TRIES;
+        ++stats.attempts;
+        if (join(cached) == 0 && wait_for_address(idle))
+        {
+            if (cached)
+            {
+                ++stats.cached_joins;
+            }
+            break;
+        }
+        if (cached)
+        {
+            ++stats.cached_misses;
+        }
+        printf("wifi join failed, retry in %lu ms\n", (unsigned long)backoff_ms);
+        cyw43_arch_lwip_begin();
+        cyw43_wifi_leave(&cyw43_state, CYW43_ITF_STA);
+        cyw43_arch_lwip_end();
+        absolute_time_t retry = make_timeout_time_ms(backoff_ms);
+        while (absolute_time_diff_us(get_absolute_time(), retry) > 0)
+        {
+            events = 0;
+            wait_until(retry, idle);
+        }
+        backoff_ms = backoff_ms * 2 < WIFI_LINK_BACKOFF_MAX_MS ? backoff_ms * 2 : WIFI_LINK_BACKOFF_MAX_MS;
+    }
+
+    uint64_t now = time_us_64();
+    uint64_t up = link_up_us;
+    stats.last_assoc_ms = up > start ? (uint32_t)((up - start) / 1000) : 0;
+    stats.last_join_ms = (uint32_t)((now - start) / 1000);
+    if (stats.last_join_ms > stats.max_join_ms)
+    {
+        stats.max_join_ms = stats.last_join_ms;
+    }
+    if (down_since_us != 0)
+    {
+        uint32_t outage_ms = (uint32_t)((now - down_since_us) / 1000);
+        stats.last_outage_ms = outage_ms;
+        stats.total_outage_ms += outage_ms;
+        if (outage_ms > stats.max_outage_ms)
+        {
+            stats.max_outage_ms = outage_ms;
+        }
+        down_since_us = 0;
+    }
+    remember_access_point();
+    printf("wifi up in %lu ms, associated in %lu ms on channel %lu\n", (unsigned long)stats.last_join_ms,
+        (unsigned long)stats.last_assoc_ms, (unsigned long)cache.ap.channel);
+}
+
+bool wifi_link_get_ap(WIFI_LINK_AP_T *ap)
+{
+    *ap = cache.ap;
+    return cache.valid;
+}
+
+void wifi_link_set_ap(const WIFI_LINK_AP_T *ap)
+{
+    cache.ap = *ap;
+    cache.valid = ap->channel != 0;
+}
+
+void wifi_link_task()
+{
+    int status = link_status();
+    if (status != CYW43_LINK_UP)
+    {
+        if (down_since_us == 0)
+        {
+            down_since_us = time_us_64();
+        }
+        ++stats.outages;
+        printf("link has gone down %d\n", status);
+        sched_stop();
+    }
+}
+
+void wifi_link_watch(int task_id)
+{
+    watch_task = task_id;
+}
+
+int wifi_link_get_json(char *buf, size_t len)
+{
+    int n = snprintf(buf, len,
+        "{\"up\":%s,\"channel\":%lu,\"bssid\":\"%02x:%02x:%02x:%02x:%02x:%02x\",\"outages\":%lu,"
+        "\"last_outage_ms\":%lu,\"max_outage_ms\":%lu,\"total_outage_ms\":%llu,\"last_assoc_ms\":%lu,\"last_join_ms\":%lu,"
+        "\"max_join_ms\":%lu,\"attempts\":%lu,\"cached_joins\":%lu,\"cached_misses\":%lu}",
+        link_status() == CYW43_LINK_UP ? "true" : "false", (unsigned long)cache.ap.channel, cache.ap.bssid[0], cache.ap.bssid[1],
+        cache.ap.bssid[2], cache.ap.bssid[3], cache.ap.bssid[4], cache.ap.bssid[5], (unsigned long)stats.outages,
+        (unsigned long)stats.last_outage_ms, (unsigned long)stats.max_outage_ms,
+        (unsigned long long)stats.total_outage_ms, (unsigned long)stats.last_assoc_ms, (unsigned long)stats.last_join_ms,
+        (unsigned long)stats.max_join_ms, (unsigned long)stats.attempts, (unsigned long)stats.cached_joins,
+        (unsigned long)stats.cached_misses);
+    return n >= 0 && (size_t)n < len ? n : -1;
+}
+
+void wifi_link_print_stats()
+{
+    printf("wifi link %lu outages, last %lu ms max %lu ms, join %lu ms max %lu ms, %lu attempts, %lu/%lu cached\n",
+        (unsigned long)stats.outages, (unsigned long)stats.last_outage_ms, (unsigned long)stats.max_outage_ms,
+        (unsigned long)stats.last_join_ms, (unsigned long)stats.max_join_ms, (unsigned long)stats.attempts,
+        (unsigned long)stats.cached_joins, (unsigned long)(stats.cached_joins + stats.cached_misses));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sched.h"
+
+// Wifi link supervisor. The netif link and status callbacks trigger the
+// link task as soon as the connection drops, rather than waiting for the
+// next poll. Reconnects start straight away and back off exponentially.
+// They join the last access point by BSSID on its channel, which skips the
+// scan, then fall back to a full scan if that fails.
+
+// The access point joined last
+struct WIFI_LINK_AP_T
+{
+    uint8_t bssid[6];
+    uint32_t channel;
+};
+
+// Hook the netif callbacks, call once station mode is enabled
+extern void wifi_link_init();
+
+// Join and wait for an address, retrying until it works. idle, if not null,
+// is called at least every half second while waiting to feed the watchdog.
+extern void wifi_link_connect(SCHED_FN idle);
+
+// Periodic check as a backstop to the callbacks, stops the scheduler when
+// the link is down
+extern void wifi_link_task();
+
+// Task to trigger from the callbacks, the id sched_add gave wifi_link_task
+extern void wifi_link_watch(int task_id);
+
+extern bool wifi_link_is_up();
+
+// False until a join has worked
+extern bool wifi_link_get_ap(WIFI_LINK_AP_T *ap);
+// Target this access point on the next join, one saved from before a reboot
+extern void wifi_link_set_ap(const WIFI_LINK_AP_T *ap);
+
+// Outage and reconnect figures as a JSON object, returns the length or -1
+// if it does not fit. A buffer of WIFI_LINK_JSON_MAX always fits, it allows
+// for every number at its widest.
+#define WIFI_LINK_JSON_MAX 384
+extern int wifi_link_get_json(char *buf, size_t len);
+
+extern void wifi_link_print_stats();
@@ -0,0 +1,169 @@
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+#include "pico/cyw43_arch.h"
+
+#include "wifi_details.h"
+#include "wifi_pm.h"
+
+// Power save mode used when idle, CYW43_DEFAULT_PM is a gentler choice if
+// clients of the NTP server mind the extra latency
+#ifndef WIFI_PM_IDLE_MODE
+#define WIFI_PM_IDLE_MODE CYW43_AGGRESSIVE_PM
+#endif
+
+// Packets a second at which the radio goes to performance mode
+#define WIFI_PM_BUSY_PPS 8
+// Packets a second below which it counts as quiet
+#define WIFI_PM_QUIET_PPS 2
+// Seconds it must stay quiet before going back to power save
+#define WIFI_PM_QUIET_S 10
+
+static const char *mode_names[] = { "default", "powersave", "performance" };
+
+// Counters only go up, written in lwIP callbacks and read in the update
+static volatile uint32_t packets;
+static volatile uint32_t bytes;
+
+static WIFI_PM_MODE mode = WIFI_PM_DEFAULT;
+static uint32_t last_packets;
+static uint32_t last_bytes;
+static uint32_t packets_per_s;
+static uint32_t bytes_per_s;
+static uint32_t peak_pps;
+static int quiet_s;
+static absolute_time_t hold_until;
+static uint64_t mode_since_us;
+static uint64_t mode_us[3];
+static uint32_t to_performance;
+static uint32_t to_powersave;
+static uint32_t failures;
+
+void wifi_pm_note_traffic(uint32_t len)
+{
+    ++packets;
+    bytes += len;
+}
+
+static void set_mode(WIFI_PM_MODE m)
+{
+    if (m == mode)
+    {
+        return;
+    }
+    cyw43_arch_lwip_begin();
+    int err = cyw43_wifi_pm(&cyw43_state, m == WIFI_PM_PERFORMANCE ? CYW43_PERFORMANCE_PM : WIFI_PM_IDLE_MODE);
+    cyw43_arch_lwip_end();
+    if (err != 0)
+    {
+        ++failures;
+        return;
+    }
+
+    uint64_t now = time_us_64();
+    if (mode_since_us != 0)
+    {
+        mode_us[mode] += now - mode_since_us;
+    }
+    mode_since_us = now;
+    mode = m;
+    if (m == WIFI_PM_PERFORMANCE)
+    {
+        ++to_performance;
+    }
+    else
+    {
+        ++to_powersave;
+    }
+}
+
+void wifi_pm_hold(uint32_t ms)
+{
+    absolute_time_t until = make_timeout_time_ms(ms);
+    if (absolute_time_diff_us(hold_until, until) > 0)
+    {
+        hold_until = until;
+    }
+    quiet_s = 0;
+    set_mode(WIFI_PM_PERFORMANCE);
+}
+
+void wifi_pm_update()
+{
+    uint32_t p = packets;
+    uint32_t b = bytes;
+    packets_per_s = p - last_packets;
+    bytes_per_s = b - last_bytes;
+    last_packets = p;
+    last_bytes = b;
+    if (packets_per_s > peak_pps)
+    {
+        peak_pps = packets_per_s;
+    }
+
+    if (packets_per_s >= WIFI_PM_BUSY_PPS)
+    {
+        quiet_s = 0;
+        set_mode(WIFI_PM_PERFORMANCE);
+        return;
+    }
+    if (packets_per_s < WIFI_PM_QUIET_PPS)
+    {
+        ++quiet_s;
+    }
+    else
+    {
+        quiet_s = 0;
+    }
+    bool held = absolute_time_diff_us(get_absolute_time(), hold_until) > 0;
+    if (mode == WIFI_PM_DEFAULT || (!held && quiet_s >= WIFI_PM_QUIET_S))
+    {
+        set_mode(held ? WIFI_PM_PERFORMANCE : WIFI_PM_POWERSAVE);
+    }
+}
+
+void wifi_pm_reset()
+{
+    if (mode_since_us != 0)
+    {
+        uint64_t now = time_us_64();
+        mode_us[mode] += now - mode_since_us;
+        mode_since_us = now;
+    }
+    mode = WIFI_PM_DEFAULT;
+    quiet_s = 0;
+}
+
+WIFI_PM_MODE wifi_pm_get_mode()
+{
+    return mode;
+}
+
+const char *wifi_pm_get_mode_name()
+{
+    return mode_names[mode];
+}
+
+int wifi_pm_get_json(char *buf, size_t len)
+{
+    uint64_t now = time_us_64();
+    uint64_t us[3] = { mode_us[0], mode_us[1], mode_us[2] };
+    if (mode_since_us != 0)
+    {
+        us[mode] += now - mode_since_us;
+    }
+    int n = snprintf(buf, len,
+        "{\"mode\":\"%s\",\"to_performance\":%lu,\"to_powersave\":%lu,\"failures\":%lu,"
+        "\"performance_s\":%llu,\"powersave_s\":%llu,\"pps\":%lu,\"bps\":%lu,\"peak_pps\":%lu}",
+        mode_names[mode], (unsigned long)to_performance, (unsigned long)to_powersave, (unsigned long)failures,
+        (unsigned long long)(us[WIFI_PM_PERFORMANCE] / 1000000), (unsigned long long)(us[WIFI_PM_POWERSAVE] / 1000000),
+        (unsigned long)packets_per_s, (unsigned long)bytes_per_s, (unsigned long)peak_pps);
+    return n >= 0 && (size_t)n < len ? n : -1;
+}
+
+void wifi_pm_print_stats()
+{
+    printf("wifi pm %s, %lu to performance, %lu to powersave, %lu failed, %lu packets/s peak %lu\n",
+        mode_names[mode], (unsigned long)to_performance, (unsigned long)to_powersave, (unsigned long)failures,
+        (unsigned long)packets_per_s, (unsigned long)peak_pps);
+}
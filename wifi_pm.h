@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Radio power management that follows the traffic. The radio sits in power
+// save while the clock is idle and goes to performance mode while packets
+// are flowing or a burst is expected, such as an NTP round. It goes back to
+// power save only after traffic has stayed low for a while, so a busy page
+// does not flap it.
+
+enum WIFI_PM_MODE
+{
+    // Whatever the driver set up, until the first update
+    WIFI_PM_DEFAULT,
+    WIFI_PM_POWERSAVE,
+    WIFI_PM_PERFORMANCE,
+};
+
+// Count a packet, called from lwIP receive and sent callbacks
+extern void wifi_pm_note_traffic(uint32_t bytes);
+
+// Go to performance mode now and stay there for at least ms. Not from
+// lwIP callbacks, it talks to the radio.
+extern void wifi_pm_hold(uint32_t ms);
+
+// Run once a second from the main loop while the link is up
+extern void wifi_pm_update();
+
+// The radio is set up afresh on each connect, forget the mode it was in
+extern void wifi_pm_reset();
+
+extern WIFI_PM_MODE wifi_pm_get_mode();
+extern const char *wifi_pm_get_mode_name();
+
+// Mode, switch counts and traffic as a JSON object, returns the length or
+// -1 if it does not fit. A buffer of WIFI_PM_JSON_MAX always fits, it allows
+// for every number at its widest.
+#define WIFI_PM_JSON_MAX 256
+extern int wifi_pm_get_json(char *buf, size_t len);
+
+extern void wifi_pm_print_stats();